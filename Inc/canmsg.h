@@ -7,6 +7,7 @@
 
 void CanMsgInit(void);
 int8_t CanMsgManager(uint8_t tick, machine_status *machine);
+void CanMsgRxDrain(machine_status *machine);
 void CanMsgEnableForce(void);
 
 #endif
@@ -25,9 +25,21 @@
 #define FLASH_ADDR_CANID_SEND_OFFS_L   15
 #define FLASH_ADDR_CANID_REC_OFFS_H    16
 #define FLASH_ADDR_CANID_REC_OFFS_L    17
+#define FLASH_ADDR_MON_MODE            18
+#define FLASH_ADDR_MON_DEAD_I          19
+#define FLASH_ADDR_SYNC_SLOT           20
+#define FLASH_ADDR_GROUP_0_H           21
+#define FLASH_ADDR_GROUP_0_L           22
+#define FLASH_ADDR_GROUP_1_H           23
+#define FLASH_ADDR_GROUP_1_L           24
+#define FLASH_ADDR_NODE_IDX            25
+#define FLASH_ADDR_MON_STAT_PERIOD     26
+#define FLASH_ADDR_CMD_TIMEOUT         27
+#define FLASH_ADDR_CANID_GEN           28   /* generazione dell'insieme di ID in scrittura */
+#define FLASH_ADDR_CANID_COMMIT        29   /* generazione dell'ultimo insieme di ID scritto per intero */
 /* se si aggiungono ellementi MODIFICARE: NumbOfVar */
 
-#if NumbOfVar < FLASH_ADDR_CANID_REC_OFFS_L
+#if NumbOfVar < FLASH_ADDR_CANID_COMMIT
 # error "Dimensione errata di NumbOfVar"
 #endif
 
@@ -39,6 +51,7 @@ typedef struct  {
 	uint16_t error_ov_uv        :1; /* errore over/under voltage */
 	uint16_t error_temp_sens_1  :1; /* errore sovratemperatura sensore 1 */
 	uint16_t error_temp_sens_2  :1; /* errore sovratemperatura sensore 1 */
+	uint16_t error_cmd_timeout  :1; /* uscite spente per comandi scaduti (MachineTick) */
 
 	uint16_t enable_power       :1; /* abilita/disabilita uscita di potenza */
 	uint16_t switch_on          :1; /* abilita/disabilita lo switch on */
@@ -46,9 +59,23 @@ typedef struct  {
 	uint32_t i;                    /* I out */
 	uint32_t t_a;                  /* T ntc pwm 1-2 */
 	uint32_t t_b;                  /* T ntc pwm 1-2 */
+	uint32_t t_sample;             /* ms (HAL_GetTick) dell'ultimo aggiornamento di i, t_a e t_b */
+
+	/* statistiche della finestra di invio di MSG_MON_STAT: aggiornate da AnalogManager, azzerate all'invio */
+	uint8_t stat_en;               /* MSG_MON_STAT abilitato (CanMsgManager): da disabilitato nessun accumulo */
+	uint32_t stat_i_min;           /* I out minima sui singoli campioni */
+	uint32_t stat_i_max;           /* I out massima sui singoli campioni */
+	uint32_t stat_i_sum;           /* somma delle medie di I out */
+	uint16_t stat_num;             /* medie sommate in stat_i_sum */
+	uint32_t stat_t_max;           /* temperatura massima (t_a e t_b) */
 } machine_status;
 
 void MachineLogic(void);
 void MachineFault(void);
+void MachineOutputUpdate(machine_status *machine);
+void MachineTick(void);
+void MachineCmdRefresh(uint8_t on, uint16_t age);
+void MachineCmdTimeoutSet(uint16_t timeout);
+uint16_t MachineCmdTimeoutGet(void);
 
 #endif
@@ -75,6 +75,7 @@ void AnalogManager(machine_status *machine)
 	if (adc1_complete == 1) { /* elaborazione dati */
 		uint16_t i,n;
 		uint32_t avg_i, avg_ntc_a, avg_ntc_b;
+		uint16_t min_i, max_i;
 
 		adc1_complete = 0;
 		adc_start_acq = 1;
@@ -82,9 +83,15 @@ void AnalogManager(machine_status *machine)
 
 		/* medie */
 		avg_i = avg_ntc_a = avg_ntc_b = 0;
+		min_i = ADC_MAX;
+		max_i = 0;
 		n = 0;
 		for (i=0; i!=ADC_SAMPLES; i++) {
 			avg_i += adc1_samples[n+ADC_I_OUT];
+			if (adc1_samples[n+ADC_I_OUT] < min_i)
+				min_i = adc1_samples[n+ADC_I_OUT];
+			if (adc1_samples[n+ADC_I_OUT] > max_i)
+				max_i = adc1_samples[n+ADC_I_OUT];
 			avg_ntc_a += adc1_samples[n+ADC_NTC_A];
 			avg_ntc_b += adc1_samples[n+ADC_NTC_B];
 			n += NUMBER_OF_ANALOG_INPUTS;
@@ -99,6 +106,36 @@ void AnalogManager(machine_status *machine)
 		/* calcolo temperatura */
 		machine->t_a = Adc2T(avg_ntc_a);
 		machine->t_b = Adc2T(avg_ntc_b);
+
+		machine->t_sample = HAL_GetTick();
+
+		/* statistiche della finestra: gli estremi sui singoli campioni per non perdere i picchi fra due invii.
+		   Con MSG_MON_STAT disabilitato la finestra resta vuota: il primo invio copre solo il proprio periodo */
+		if (machine->stat_en == 0) {
+			machine->stat_num = 0;
+		}
+		else {
+			if (machine->stat_num == 0) {
+				machine->stat_i_min = Adc2I(min_i);
+				machine->stat_i_max = Adc2I(max_i);
+				machine->stat_i_sum = 0;
+				machine->stat_t_max = 0;
+			}
+			else {
+				if (Adc2I(min_i) < machine->stat_i_min)
+					machine->stat_i_min = Adc2I(min_i);
+				if (Adc2I(max_i) > machine->stat_i_max)
+					machine->stat_i_max = Adc2I(max_i);
+			}
+			if (machine->stat_num != 0xFFFF) {
+				machine->stat_i_sum += machine->i;
+				machine->stat_num++;
+			}
+			if (machine->t_a > machine->stat_t_max)
+				machine->stat_t_max = machine->t_a;
+			if (machine->t_b > machine->stat_t_max)
+				machine->stat_t_max = machine->t_b;
+		}
 	}
 
 	if (adc_start_acq) { /* avvio altra acquisizione */
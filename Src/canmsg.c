@@ -11,15 +11,117 @@
 
 /* ID di configurazione */
 #define CONF_CANID                    0x2001
-
-#define CAN_RX_QUEUE                  20     /* dimensione della coda dei messaggi in ricezione */
+/* ID di SYNC: comune a tutti i nodi, campionamento coerente dello stato */
+#define CAN_SYNC_ID                   0x2000
+/* ID di broadcast: comandi alle uscite per tutti i nodi (o quelli selezionati dalla maschera) */
+#define CAN_BCAST_ID                  0x2002
+#define CAN_GROUP_NUM                 2      /* ID di gruppo configurabili in e2prom, stesso formato del broadcast */
+#define CAN_NODE_IDX_NONE             0xFF   /* nodo senza indice: risponde solo ai comandi senza maschera */
+#define CAN_NODE_IDX_MAX              55     /* data[1..7] di MSG_GROUP: 56 bit di maschera */
+/* selezione dei nodi per UID (stile LSS Fastscan): richieste del master e risposte dei nodi */
+#define CAN_LSS_ID                    0x2003
+#define CAN_LSS_RSP_ID                0x2004
+
+#ifndef CAN_RX_QUEUE
+# define CAN_RX_QUEUE                 32     /* dimensione della coda dei messaggi in ricezione (potenza di 2) */
+#endif
+#ifndef CAN_RX_HP_QUEUE
+# define CAN_RX_HP_QUEUE              8      /* dimensione della coda dei messaggi prioritari (FIFO1, potenza di 2) */
+#endif
+#ifndef CAN_RX_DRAIN_ALL
+# define CAN_RX_DRAIN_ALL             1      /* 1: ad ogni passo si elaborano tutti i messaggi in coda; 0: un messaggio per passo, tutti oltre CAN_RX_DRAIN_WM */
+#endif
+#ifndef CAN_RX_DRAIN_WM
+# define CAN_RX_DRAIN_WM              (CAN_RX_QUEUE/2) /* occupazione della coda FIFO0 oltre la quale si svuota la coda anche fuori passo */
+#endif
+#ifndef CAN_TX_QUEUE
+# define CAN_TX_QUEUE                 8      /* messaggi in attesa di una mailbox libera */
+#endif
+#define CAN_TX_MBX_NUM                3      /* mailbox di invio del bxCAN */
 #define MSG_ERROR_TX_LIMIT            10     /* messaggi inviati con errori consecutivi */
-#define MSG_ERROR_TO                  2      /* errori generici consecutivi non recuperati entro 10*(MSG_ERROR_XX_LIMIT-1)ms */
+#define MSG_ERROR_TO                  20     /* ms di errori senza invii o ricezioni corretti (error_glb) prima di spegnere le uscite */
+#define CAN_BUS_OFF_TO                1000   /* ms di bus-off non recuperato dall'hw prima del reset della periferica */
+#define CAN_AUTOBAUD_DWELL            250    /* ms di ascolto per ogni velocita' durante la ricerca */
+#define CAN_AUTOBAUD_SWEEP            4      /* scansioni complete prima di rinunciare: lock entro CAN_SPEED_NONE*DWELL*SWEEP ms */
+#define CAN_EE_JOB_NUM                32     /* lavori di salvataggio in e2prom in attesa */
+#define CAN_SEG_BUF                   78     /* dimensione massima di un oggetto del trasporto segmentato */
+#define CAN_SEG_BS                    8      /* block size richiesto dal nodo in scrittura */
+#define CAN_SEG_TO                    1000   /* ms di inattivita' prima dell'abbandono della sessione */
+#define CAN_LSS_TO                    2000   /* ms senza frame LSS o di configurazione prima della fine della sessione LSS */
+#define CAN_CMD_NUM                   25     /* elementi di can_cmd_tab */
+#define CAN_CMD_SLOT_NUM              (MSG_REC_NUM + 4) /* messaggi con gestori: quelli del nodo e da MSG_LSS a MSG_CONF */
+
+/* oggetti del trasporto segmentato */
+#define CAN_SEG_OBJ_PARAMS            0      /* tabella parametri in e2prom (can_param_tab), lettura e scrittura */
+#define CAN_SEG_OBJ_VERSION           1      /* versione fw, bootloader e nome scheda, sola lettura */
+#define CAN_SEG_OBJ_DIAG              2      /* tutte le pagine diagnostica, sola lettura */
+#define CAN_SEG_OBJ_CMD               3      /* tempo massimo di esecuzione (us) di ogni gestore di can_cmd_tab, sola lettura */
+
+/* parametri leggibili con MSG_OPC_PARAM_READ (valori attivi, non quelli in e2prom) */
+#define CAN_PAR_CANID                 0      /* can_dev.base */
+#define CAN_PAR_CANID_SEND            1      /* can_dev.base_send */
+#define CAN_PAR_REC_OFFSET            2
+#define CAN_PAR_SEND_OFFSET           3
+#define CAN_PAR_SPEED                 4      /* can_speed */
+#define CAN_PAR_MON_INFO_PERIOD       5      /* ms, 0: solo su variazione/forzato */
+#define CAN_PAR_MON_STAT_PERIOD       6
+#define CAN_PAR_MON_MODE              7      /* mon_mode | mon_dead_t<<8 | mon_dead_i<<16 */
+#define CAN_PAR_SYNC_SLOT             8
+#define CAN_PAR_GROUP_0               9
+#define CAN_PAR_GROUP_1               10
+#define CAN_PAR_NODE_IDX              11
+#define CAN_PAR_CMD_TIMEOUT           12
+#define CAN_PAR_RX                    13     /* contatori */
+#define CAN_PAR_TX                    14
+#define CAN_PAR_TOT_RX                15
+#define CAN_PAR_ERROR_TOT             16
+#define CAN_PAR_ERR                   0x8000 /* | indice nella risposta: parametro inesistente */
+
+/* flow status */
+#define CAN_SEG_FS_CTS                0      /* continua */
+#define CAN_SEG_FS_WAIT               1      /* attesa */
+#define CAN_SEG_FS_ABORT              2      /* errore, sessione abbandonata */
+#define CAN_SEG_FS_DONE               3      /* scrittura eseguita */
+
+/* LSS: command specifier (data[0]) */
+#define CAN_LSS_CS_SWITCH_GLOBAL      0x04   /* data[1] 0: fine sessione, tutti i nodi accettano la configurazione; 1: inizio sessione, nessun nodo selezionato */
+#define CAN_LSS_CS_IDENTIFY           0x4F   /* risposta: almeno un nodo corrisponde alla richiesta */
+#define CAN_LSS_CS_FASTSCAN           0x51   /* data[1..4] IDNumber, data[5] BitChecked, data[6] LSSSub, data[7] LSSNext */
+#define CAN_LSS_BIT_RESET             0x80   /* BitChecked: inizio ricerca, rispondono tutti i nodi non configurati */
+#define CAN_LSS_SUB_NUM               3      /* parole a 32bit dell'UID */
+
+/* configurazione in attesa di commit */
+#define CAN_STAGE_BASE                0x01
+#define CAN_STAGE_BASE_SEND           0x02
+#define CAN_STAGE_OFFSET              0x04
 #define MSG_RE_SEND_MAX               500    /* numero massimo di tentativi di re-invio del msg */
 
 /* periodo messaggi */
 #define MSG_PERIOD_MON_INFO           200     /* ms */
 #define MSG_PERIOD_MIN                50      /* ms */
+#define MSG_PERIOD_MON_STAT           0       /* ms, default di MSG_MON_STAT: disabilitato */
+#define MSG_PERIOD_HEARTBEAT          1000    /* ms, invio minimo garantito di MSG_MON_INFO in MSG_MON_MODE_CHANGE */
+#define MSG_SYNC_SLOT_MAX             1000    /* ms, ritardo massimo di MSG_MON_SYNC rispetto al SYNC */
+
+/* modalita' di invio di MSG_MON_INFO */
+#define MSG_MON_MODE_PERIODIC         0      /* invio periodico */
+#define MSG_MON_MODE_CHANGE           1      /* invio alla variazione di stato/errori o fuori banda morta, piu' heartbeat */
+#define MSG_MON_MODE_MASK             0x7F
+#define MSG_MON_OPT_SEQ               0x80   /* | MSG_MON_MODE_xxx: MSG_MON_INFO a 8 byte con data[6] sequenza e data[7] CRC8, MSG_MON_STAT con data[7] sequenza */
+#define MSG_MON_CRC_POLY              0x07   /* CRC-8 x^8+x^2+x+1, valore iniziale 0, su data[0..6] */
+#define MSG_MON_DEAD_I                10     /* banda morta di default della corrente */
+#define MSG_MON_DEAD_T                2      /* banda morta di default delle temperature */
+
+
+#if CAN_RX_QUEUE < 2 || CAN_RX_QUEUE > 256 || (CAN_RX_QUEUE & (CAN_RX_QUEUE - 1)) != 0
+# error "CAN_RX_QUEUE deve essere una potenza di 2 (2..256)"
+#endif
+#if CAN_RX_HP_QUEUE < 2 || CAN_RX_HP_QUEUE > 256 || (CAN_RX_HP_QUEUE & (CAN_RX_HP_QUEUE - 1)) != 0
+# error "CAN_RX_HP_QUEUE deve essere una potenza di 2 (2..256)"
+#endif
+#if CAN_RX_DRAIN_WM < 1 || CAN_RX_DRAIN_WM > CAN_RX_QUEUE
+# error "CAN_RX_DRAIN_WM fuori dalla coda (1..CAN_RX_QUEUE)"
+#endif
 
 
 #if LOG_ERROR_EN == 0
@@ -34,9 +136,24 @@
 #define MSG_OPC_CANID_REC             0x0000
 #define MSG_OPC_CANID_SEND            0x0001
 #define MSG_OPC_CANID_OFFSET          0x0002
+#define MSG_OPC_STAGE                 0x0080 /* | MSG_OPC_CANID_xxx: valore messo in attesa, attivo solo con il commit */
+#define MSG_OPC_STAGE_COMMIT          0x0083 /* cmd[1] HW_CHECK_3: verifica e salvataggio dei valori in attesa, risposta data[2] 0 ok, 1 errore */
+#define MSG_OPC_STAGE_ABORT           0x0084 /* scarta i valori in attesa */
 #define MSG_OPC_VELOC                 0x0100
+#define MSG_OPC_MON_MODE              0x0200
+#define MSG_OPC_MON_STAT              0x0201 /* cmd[1] periodo di MSG_MON_STAT in ms (0: disabilitato, altrimenti >= MSG_PERIOD_MIN) */
+#define MSG_OPC_CMD_TIMEOUT           0x0202 /* cmd[1] ms senza MSG_OUT_ENABLE/MSG_GROUP prima dello spegnimento delle uscite (0: disabilitato) */
+#define MSG_OPC_PARAM_READ            0x0400 /* cmd[1] indice (CAN_PAR_xxx), risposta data[2..3] indice, data[4..7] valore (DLC 4 e CAN_PAR_ERR se inesistente) */
+#define MSG_OPC_DIAG                  0x0401 /* cmd[1] pagina (MSG_DIAG_PAGE_xxx), data[4..7] base del nodo: risposta su MSG_DIAG_INFO, anche a uscite attive */
 
 #define MSG_OPC_BOOTLOADER            0x1000
+/* trasporto segmentato (stile ISO-TP) sull'ID di configurazione */
+#define MSG_OPC_SEG_MASK              0xFFF0
+#define MSG_OPC_SEG_READ              0x3000 /* tool -> nodo: data[2] oggetto (CAN_SEG_OBJ_xxx) */
+#define MSG_OPC_SEG_FF_READ           0x3010 /* nodo -> tool: primo frame, data[2] oggetto, data[3] lunghezza, data[4..7] dati */
+#define MSG_OPC_SEG_FF_WRITE          0x3011 /* tool -> nodo: primo frame, come MSG_OPC_SEG_FF_READ */
+#define MSG_OPC_SEG_CF                0x3020 /* | sequence number (0..15): data[2..7] dati */
+#define MSG_OPC_SEG_FC                0x3030 /* | CAN_SEG_FS_xxx: data[2] block size (0: nessun limite), data[3] STmin (ms) */
 
 #define HW_CHECK_0                    0x1234
 #define HW_CHECK_2                    0x5157
@@ -48,9 +165,44 @@
 #define MSG_CNG_VELOC                 2
 #define MSG_HW_VER                    3
 #define MSG_FW_VER                    4
+#define MSG_REC_NUM                   5      /* numero di messaggi in ricezione (base + rec_offset*n): passo di 5 ID tra i nodi */
+#define MSG_SEND_NUM                  5      /* numero di ID riservati in invio (base_send + send_offset*n) */
+#define MSG_CONF                      0xFE   /* messaggio sull'ID di configurazione */
+#define MSG_SYNC                      0xFD   /* messaggio sull'ID di SYNC: data[0] (opzionale) contatore, ripetuto in MSG_MON_SYNC */
+#define MSG_LSS                       0xFB   /* messaggio sull'ID LSS: data[0] CAN_LSS_CS_xxx */
+#define MSG_GROUP                     0xFC   /* messaggio sull'ID di broadcast o di gruppo: data[0] bit0 enable_power, bit1 switch_on,
+                                                data[1..7] (opzionale) maschera dei nodi per indice, bit0 di data[1] nodo 0 */
+#define MSG_NONE                      0xFF   /* messaggio non destinato al nodo */
+
+/* filtri: banchi in lista a 32bit, ogni banco fornisce due FilterMatchIndex consecutivi nella propria FIFO */
+#define CAN_FLT_BANK_NUM              7      /* banchi utilizzati */
+#define CAN_FLT_IDX_NUM               (CAN_FLT_BANK_NUM*2)
+#define CAN_FIFO_NUM                  2      /* FIFO hw di ricezione: CAN_RX_FIFO0 (normale), CAN_RX_FIFO1 (prioritaria) */
 
 /* CAN Tx MSG */
 #define MSG_MON_INFO                  0
+#define MSG_DIAG_INFO                 1      /* risposta a MSG_OPC_DIAG: data[0] pagina, a seguire 3 valori a 16bit */
+#define MSG_MON_SYNC                  2      /* risposta a MSG_SYNC dopo sync_slot ms: come MSG_MON_INFO, data[6] contatore, data[7] eta' del campione (ms) */
+#define MSG_MON_STAT                  3      /* statistiche della finestra di invio: I min, max, media (cA), data[6] temperatura massima */
+
+/* pagine diagnostica */
+#define MSG_DIAG_PAGE_CNT             0      /* tx, rx, tot_rx */
+#define MSG_DIAG_PAGE_ERR             1      /* error_tx, error_tot, messaggi scartati in ricezione */
+#define MSG_DIAG_PAGE_LAT_CMD         2      /* ricezione -> risposta in mailbox: min, media, max (us) */
+#define MSG_DIAG_PAGE_LAT_QUEUE       3      /* permanenza in coda rx: min, media, max (us) */
+#define MSG_DIAG_PAGE_LAT_TX          4      /* mailbox -> invio completato: min, media, max (us) */
+#define MSG_DIAG_PAGE_BUS             5      /* tec | rec<<8, bus_state, recovery_time_max (ms) */
+#define MSG_DIAG_PAGE_MISC            6      /* out_en_lat_max (us), reset_num, autobaud_lock_time (ms) */
+#define MSG_DIAG_PAGE_EE              7      /* blocco massimo per scrittura e2prom (us e ms), massimo di lavori in coda */
+#define MSG_DIAG_PAGE_RX0             8      /* FIFO0: overrun della FIFO hw, scartati per coda sw piena, massima occupazione della coda */
+#define MSG_DIAG_PAGE_RX1             9      /* FIFO1: come MSG_DIAG_PAGE_RX0 */
+#define MSG_DIAG_PAGE_RX_DRAIN        10     /* FIFO hw piene (FIFO0, FIFO1), svuotamenti d'emergenza della coda FIFO0 */
+#define MSG_DIAG_PAGE_MON             11     /* telemetria non inviata: soppressa per errori di invio, coda di invio piena; sequenze MSG_MON_INFO | MSG_MON_STAT<<8 */
+#define MSG_DIAG_PAGE_TX              12     /* coda di invio: messaggi rifiutati a coda piena, occupazione attuale e massima */
+#define MSG_DIAG_PAGE_NUM             13
+
+/* messaggi periodici: elementi di can_periodic_tab */
+#define MSG_PERIODIC_NUM              2
 
 
 typedef enum {
@@ -66,49 +218,321 @@ typedef enum {
 	CAN_SPEED_NONE
 } can_speed;
 
+#define CAN_SPEED_AUTO                0xFF   /* in e2prom/MSG_OPC_VELOC: ricerca automatica della velocita' */
+
+/* bit timing calcolato in compilazione dal clock della periferica (PCLK1); a 36MHz valori fissi (can_bit_timing_tab) */
+#ifndef CAN_PCLK1
+# define CAN_PCLK1                    (HSE_VALUE*9/2) /* HSE * RCC_PLL_MUL9 / RCC_HCLK_DIV2: verificato all'avvio (CanSpeedInit) */
+#endif
+#define CAN_SAMPLE_POINT              875    /* punto di campionamento in per mille */
+#define CAN_BT_ERR_MAX                50     /* massimo errore di bitrate in centesimi di % */
+
+/* numero di quanti per bit (8..16): il primo che divide esattamente PCLK1, altrimenti 16 */
+#define CAN_BT_EXACT(br, n)           (CAN_PCLK1 % ((br)*(n)) == 0)
+#define CAN_BT_NTQ(br)                (CAN_BT_EXACT(br, 16) ? 16 : CAN_BT_EXACT(br, 15) ? 15 : CAN_BT_EXACT(br, 14) ? 14 : \
+                                       CAN_BT_EXACT(br, 13) ? 13 : CAN_BT_EXACT(br, 12) ? 12 : CAN_BT_EXACT(br, 11) ? 11 : \
+                                       CAN_BT_EXACT(br, 10) ? 10 : CAN_BT_EXACT(br, 9) ? 9 : CAN_BT_EXACT(br, 8) ? 8 : 16)
+#define CAN_BT_PRESC(br)              ((CAN_PCLK1 + (br)*CAN_BT_NTQ(br)/2) / ((br)*CAN_BT_NTQ(br)))
+#define CAN_BT_SEG1(br)               (CAN_BT_NTQ(br)*CAN_SAMPLE_POINT/1000 - 1) /* quanti dopo il sync fino al campionamento (per difetto) */
+#define CAN_BT_SEG2(br)               (CAN_BT_NTQ(br) - 1 - CAN_BT_SEG1(br))
+#define CAN_BT_RATE(br)               (CAN_PCLK1 / (CAN_BT_PRESC(br)*CAN_BT_NTQ(br)))
+#define CAN_BT_ERR(br)                ((CAN_BT_RATE(br) > (br) ? CAN_BT_RATE(br) - (br) : (br) - CAN_BT_RATE(br))*10000 / (br))
+#define CAN_BT_BAD(br)                (CAN_BT_ERR(br) > CAN_BT_ERR_MAX || CAN_BT_PRESC(br) < 1 || CAN_BT_PRESC(br) > 1024)
+#define CAN_BT(br)                    {CAN_BT_PRESC(br), (CAN_BT_SEG1(br) - 1) << CAN_BTR_TS1_Pos, (CAN_BT_SEG2(br) - 1) << CAN_BTR_TS2_Pos}
+
+/* bitrate di can_speed */
+#define CAN_BITRATE_1M                1000000
+#define CAN_BITRATE_800K              800000
+#define CAN_BITRATE_500K              500000
+#define CAN_BITRATE_250K              250000
+#define CAN_BITRATE_125K              125000
+#define CAN_BITRATE_100K              100000
+#define CAN_BITRATE_50K               50000
+#define CAN_BITRATE_20K               20000
+#define CAN_BITRATE_10K               10000
+
+#if CAN_BT_BAD(CAN_BITRATE_1M) || CAN_BT_BAD(CAN_BITRATE_800K) || CAN_BT_BAD(CAN_BITRATE_500K)
+# error "CAN_PCLK1: errore di bitrate eccessivo (1M, 800K, 500K)"
+#endif
+#if CAN_BT_BAD(CAN_BITRATE_250K) || CAN_BT_BAD(CAN_BITRATE_125K) || CAN_BT_BAD(CAN_BITRATE_100K)
+# error "CAN_PCLK1: errore di bitrate eccessivo (250K, 125K, 100K)"
+#endif
+#if CAN_BT_BAD(CAN_BITRATE_50K) || CAN_BT_BAD(CAN_BITRATE_20K) || CAN_BT_BAD(CAN_BITRATE_10K)
+# error "CAN_PCLK1: errore di bitrate eccessivo (50K, 20K, 10K)"
+#endif
+
+
+typedef enum {
+	CAN_BUS_ACTIVE = 0,         /* error active */
+	CAN_BUS_WARNING,            /* TEC o REC >= 96 */
+	CAN_BUS_PASSIVE,            /* TEC o REC > 127 */
+	CAN_BUS_OFF                 /* TEC > 255, recupero automatico hw (ABOM) */
+} can_bus_state;
+
+
+typedef enum {
+	CAN_EE_WRITE = 0,           /* scrittura di una variabile */
+	CAN_EE_LOAD,                /* rilettura dei parametri (CanParamsLoad) */
+	CAN_EE_ACK,                 /* conferma sull'ID di configurazione */
+	CAN_EE_REINIT               /* re-inizializzazione (ad invii conclusi) */
+} can_ee_job_type;
+
+
+typedef struct {
+	uint8_t type;               /* can_ee_job_type */
+	uint8_t n;                  /* CAN_EE_ACK: byte di val inviati */
+	uint16_t addr;              /* CAN_EE_WRITE: indirizzo virtuale; CAN_EE_ACK: opcode */
+	uint16_t val;               /* CAN_EE_WRITE: valore; CAN_EE_ACK: dati */
+} can_ee_job;
+
+
+typedef enum {
+	CAN_SEG_IDLE = 0,
+	CAN_SEG_TX_WAIT_FC,         /* lettura: attesa del flow control dal tool */
+	CAN_SEG_TX,                 /* lettura: invio dei consecutive frame */
+	CAN_SEG_RX                  /* scrittura: ricezione dei consecutive frame */
+} can_seg_state;
+
+
+typedef struct {
+	uint8_t state;              /* can_seg_state */
+	uint8_t obj;                /* oggetto trasferito */
+	uint8_t len;                /* byte dell'oggetto */
+	uint8_t pos;                /* byte trasferiti */
+	uint8_t sn;                 /* sequence number del prossimo consecutive frame */
+	uint8_t bs;                 /* block size (0: nessun limite) */
+	uint8_t bs_cnt;             /* frame restanti nel blocco */
+	uint8_t st_min;             /* ms fra due consecutive frame inviati */
+	uint32_t t;                 /* ms (HAL_GetTick) dell'ultimo frame, per timeout e STmin */
+	uint8_t buf[CAN_SEG_BUF];   /* oggetto */
+} can_seg;
+
+
+typedef struct {
+	uint16_t prescaler;
+	uint32_t bs1;               /* CAN_BS1_xTQ */
+	uint32_t bs2;               /* CAN_BS2_xTQ */
+} can_bit_timing;
+
 
 typedef struct {
 	CAN_RxHeaderTypeDef header;
 	uint8_t data[8];
+	uint8_t msg_id;             /* messaggio (MSG_xxx) risolto in ricezione */
+	uint32_t ts;                /* istante di ricezione (CanTimestamp) */
 } msg_can_rx;
 
 
+typedef struct {
+	volatile uint16_t in;       /* indice libero (va mascherato con mask) del prossimo messaggio da inserire, scritto solo dall'ISR */
+	volatile uint16_t out;      /* indice libero del prossimo messaggio da estrarre, scritto solo dal main loop. Se in == out la coda e' vuota */
+	uint16_t mask;              /* dimensione della coda (potenza di 2) - 1 */
+	uint16_t max;               /* massima occupazione raggiunta dalla coda */
+	uint32_t drop;              /* messaggi per il nodo scartati per coda piena */
+	uint32_t ovr;               /* overrun della FIFO hw: almeno un messaggio perso prima della lettura */
+	uint32_t full;              /* FIFO hw piena (3 messaggi in attesa di lettura) */
+	msg_can_rx *msg;            /* messaggi in coda */
+} can_rx_queue;
+
+
 typedef struct {
 	CAN_TxHeaderTypeDef header;
 	uint8_t data[8];
+	uint32_t ts;                /* ricezione della richiesta a cui si risponde (CanTimestamp), 0 per i messaggi spontanei */
 } msg_can_tx;
 
 
+typedef enum {
+	CAN_MBX_FREE = 0,           /* mailbox libera */
+	CAN_MBX_BUSY,               /* invio in corso */
+	CAN_MBX_RESEND              /* invio fallito, messaggio da re-inviare */
+} can_mbx_state;
+
+
+typedef struct {
+	msg_can_tx msg;             /* messaggio affidato alla mailbox */
+	uint16_t re_send;           /* tentativi di re-invio del messaggio */
+	volatile uint8_t state;     /* can_mbx_state */
+	uint32_t ts;                /* affidamento alla mailbox (CanTimestamp) */
+} can_mbx;
+
+
+typedef struct {
+	uint32_t min;
+	uint32_t avg;               /* media mobile su 16 campioni */
+	uint32_t max;
+	uint32_t num;               /* campioni */
+} can_lat;
+
+
+typedef struct {
+	uint8_t msg_id;             /* messaggio (CAN Tx MSG) */
+	uint16_t period;            /* periodo di default in ms */
+	uint16_t phase;             /* ritardo in ms del primo invio rispetto al periodo, per distribuire gli invii */
+} can_periodic_def;
+
+
+typedef struct {
+	uint8_t msg_id;             /* messaggio (CAN Tx MSG) */
+	uint16_t period;            /* periodo in ms, 0: invio solo se forzato */
+	uint16_t phase;             /* ritardo in ms del primo invio */
+	int32_t due;                /* ms alla scadenza, negativo se in ritardo */
+	uint8_t force;              /* forza l'invio al prossimo passo */
+} can_periodic;
+
+
+typedef struct {
+	uint8_t msg_id;             /* messaggio (CAN Rx MSG) */
+	uint8_t rtr;                /* 1: remote frame */
+	uint8_t cfg;                /* comando di configurazione: solo con cfg_en (e nodo selezionato se LSS attivo) */
+	uint16_t opc;               /* opcode (cmd[0]) dei data frame di MSG_CONF */
+	uint16_t opc_mask;          /* bit dell'opcode confrontati, 0 se senza opcode */
+	uint8_t dlc_min;
+	uint8_t dlc_max;
+	uint8_t chk;                /* indice della parola che deve valere HW_CHECK_3, 0 se nessuna */
+	uint8_t reply;              /* il gestore accoda una risposta: eseguito solo con posto nella coda di invio */
+	uint8_t (*fn)(const msg_can_rx *msg, machine_status *machine); /* ritorna 1 se conferma il cambio di velocita' */
+} can_cmd_def;
+
+
+typedef struct {            /* parametri degli ID, verificabili senza modificare quelli attivi (CanIdSetCheck) */
+	uint32_t base;
+	uint32_t base_send;
+	uint32_t rec_offset;
+	uint32_t send_offset;
+	uint32_t group_id[CAN_GROUP_NUM];
+} can_id_set;
+
+
 typedef struct {
 	can_speed speed;            /* velocita' del can bus */
 
 	/* gestione coda rx e invio messaggi */
-	uint8_t send_en;            /* abilitazione all'invio. 0: invio in corso; 1: possibili invio nuovo messaggi; 2: re-invio messaggi */
 	uint8_t cfg_en;             /* abilitata alla ricezione dei messaggi di configurazione */
-	uint8_t error_glb;          /* errori nel can bus dall'ultima inizializzazione o invio/reicezione corretta */
+	uint8_t error_glb;          /* errori nel can bus dall'ultima inizializzazione o invio/reicezione corretta (saturato) */
+	uint8_t error_to;           /* MSG_ERROR_TO scaduto: uscite gia' spente per questa sequenza di errori */
+	uint32_t error_glb_start;   /* ms (HAL_GetTick) dell'ultimo controllo senza errori in error_glb */
 	uint16_t error_tx;          /* errori di invio dei mesaggi (sono compesati ad ogni invio corretto) */
 	uint16_t error_tot;         /* errori totali nel can bus */
-	uint16_t rx_queue_in;       /* indice alla coda per i messaggi da inserire nella cosa se rx_queue_in == rx_queue_out la coa e' vuota */
-	uint16_t rx_queue_out;      /* indice della coda per i messaggi da estrarre dalla coda se rx_queue_in == rx_queue_out la coa e' vuota */
-	msg_can_rx rx_msg_queue[CAN_RX_QUEUE]; /* coda messaggi in ricezione */
-	msg_can_tx tx_msg;          /* messaggio in invio */
+	can_bus_state bus_state;    /* stato di errore del controllore (ESR) */
+	uint8_t tec;                /* transmit error counter */
+	uint8_t rec;                /* receive error counter */
+	uint32_t bus_err_start;     /* ms (HAL_GetTick) di uscita da CAN_BUS_ACTIVE */
+	uint32_t bus_off_start;     /* ms (HAL_GetTick) di ingresso in CAN_BUS_OFF */
+	uint32_t recovery_time;     /* ms impiegati dall'ultimo ritorno in CAN_BUS_ACTIVE */
+	uint32_t recovery_time_max; /* ms impiegati, massimo */
+	uint16_t recovery_num;      /* ritorni in CAN_BUS_ACTIVE */
+	uint16_t reset_num;         /* reset della periferica per bus-off non recuperato */
+	uint8_t clk_err;            /* PCLK1 diverso da CAN_PCLK1: periferica non avviata */
+
+	/* ricerca automatica della velocita' (modo silent) */
+	uint8_t autobaud;           /* ricerca in corso */
+	uint8_t autobaud_speed;     /* velocita' in prova */
+	uint8_t autobaud_sweep;     /* scansioni complete eseguite */
+	volatile uint8_t autobaud_rx; /* velocita' in prova alla ricezione dell'ultimo messaggio valido (ISR), CAN_SPEED_NONE se nessuno */
+	uint32_t autobaud_start;    /* ms (HAL_GetTick) di inizio ricerca */
+	uint32_t autobaud_try;      /* ms (HAL_GetTick) di inizio prova della velocita' corrente */
+	uint32_t autobaud_lock_time; /* ms impiegati dall'ultima ricerca conclusa con successo */
+	uint16_t autobaud_fail;     /* ricerche concluse senza successo */
+	can_rx_queue rx_queue[CAN_FIFO_NUM]; /* code messaggi in ricezione, una per FIFO hw */
+	msg_can_rx rx_msg_queue[CAN_RX_QUEUE]; /* messaggi ricevuti sulla FIFO0 */
+	msg_can_rx rx_msg_hp_queue[CAN_RX_HP_QUEUE]; /* messaggi prioritari ricevuti sulla FIFO1 */
+	uint32_t rx_drain_num;      /* svuotamenti d'emergenza della coda FIFO0 (CanMsgRxDrain) */
+	msg_can_tx tx_queue[CAN_TX_QUEUE]; /* messaggi in attesa di invio, ordinati per priorita' (ID crescente) */
+	uint8_t tx_queue_num;       /* messaggi in tx_queue */
+	uint8_t tx_queue_max;       /* massima occupazione di tx_queue */
+	uint32_t tx_queue_full;     /* messaggi rifiutati a coda di invio piena: non sono errori del bus */
+	can_mbx tx_mbx[CAN_TX_MBX_NUM]; /* stato delle mailbox di invio */
 
 	/* conteggio dati */
 	uint32_t tx;                /* messaggi inviati dal nodo */
 	uint32_t rx;                /* messaggi ricevuti per il nodo */
 	uint32_t tot_rx;            /* messaggi ricevuto anche non destinati al nodo */
 
+	/* comandi */
+	uint8_t speed_save;         /* velocita' cambiata: salvataggio in attesa di conferma */
+	uint8_t cfg_rtr_resp;       /* dato da inviare alla prossima request su MSG_CONF */
+
 	/* ID di comunizazione */
 	uint32_t cfg_id;            /* can id di configurazione */
 	uint32_t base;              /* can id di base */
 	uint32_t rec_offset;        /* (multiplo) offset per i messaggi in ricezione, a partire dall'ID di base */
  	uint32_t base_send;         /* base del ID per i comandi/msg in ricezione */
 	uint32_t send_offset;       /* (multiplo) offset per i messaggi in invio, a partire dall'ID di base d'invio */
+	uint32_t group_id[CAN_GROUP_NUM]; /* ID di gruppo, 0 se non impostato */
+	uint8_t node_idx;           /* posizione del nodo nella maschera di MSG_GROUP, CAN_NODE_IDX_NONE se non impostata */
+	uint32_t rx_id[MSG_REC_NUM];  /* ID risolti dei messaggi in ricezione (base + rec_offset*n), vedi CanIdUpdate */
+	uint32_t tx_id[MSG_SEND_NUM]; /* ID risolti dei messaggi in invio (base_send + send_offset*n), vedi CanIdUpdate */
+
+	/* filtri */
+	uint8_t flt_all;            /* filtro piglia tutto attivo: i messaggi vanno verificati via software */
+	uint8_t flt_fifo[CAN_FLT_BANK_NUM]; /* FIFO assegnata ad ogni banco */
+	uint8_t flt_msg[CAN_FIFO_NUM][CAN_FLT_IDX_NUM]; /* messaggio (MSG_xxx) associato ad ogni FilterMatchIndex di ogni FIFO */
+
+	/* configurazione in attesa di commit (MSG_OPC_STAGE) */
+	uint8_t stage_mask;         /* CAN_STAGE_xxx dei valori in attesa */
+	uint32_t stage_base;
+	uint32_t stage_base_send;
+	uint32_t stage_offset;
+	uint16_t id_gen;            /* generazione dell'ultimo insieme di ID salvato (FLASH_ADDR_CANID_COMMIT) */
+
+	/* selezione per UID: con sessione attiva solo il nodo selezionato accetta la configurazione */
+	uint32_t uid[CAN_LSS_SUB_NUM]; /* UID a 96bit del micro */
+	uint8_t lss_active;         /* sessione LSS in corso */
+	uint8_t lss_selected;       /* nodo selezionato dal master */
+	uint32_t lss_t;             /* ultimo frame della sessione (HAL_GetTick), vedi CAN_LSS_TO */
+	uint8_t lss_pos;            /* parola dell'UID attesa dalla prossima richiesta fastscan */
+
+	/* salvataggi in e2prom differiti (CanEeTask) */
+	can_ee_job ee_job[CAN_EE_JOB_NUM];
+	uint8_t ee_job_out;         /* prossimo lavoro da eseguire */
+	uint8_t ee_job_num;         /* lavori in coda */
+	uint8_t ee_job_max;         /* massimo di lavori in coda */
+	uint32_t ee_stall;          /* cicli di clock dell'ultima scrittura */
+	uint32_t ee_stall_max;      /* cicli di clock della scrittura piu' lunga (con eventuale trasferimento di pagina) */
+
+	/* trasporto segmentato */
+	can_seg seg;
+	uint8_t reinit_req;         /* re-inizializzazione richiesta, eseguita ad invii conclusi */
+
+	/* latenze (cicli di clock) */
+	uint32_t out_en_lat;        /* ricezione MSG_OUT_ENABLE/MSG_GROUP -> aggiornamento uscite, ultimo comando */
+	uint32_t out_en_lat_max;    /* ricezione MSG_OUT_ENABLE/MSG_GROUP -> aggiornamento uscite, massimo */
+	uint32_t rx_ts;             /* ricezione del messaggio in elaborazione, 0 fuori da CanCommandExec */
+	uint32_t cmd_cycles_max[CAN_CMD_NUM]; /* cicli di clock del gestore piu' lento, per elemento di can_cmd_tab */
+	can_lat lat_cmd;            /* ricezione -> risposta affidata alla mailbox */
+	can_lat lat_queue;          /* ricezione -> inizio elaborazione */
+	can_lat lat_tx;             /* affidamento alla mailbox -> invio completato */
 
 	/* gestione messaggi periodici */
 	uint8_t periodic_en;         /* abilitazione messaggi periodici */
-	uint16_t period_mon_info;    /* periodo in ms dell'invio delle info */
-	uint8_t period_mon_info_force     :1; /* forza invio dato */
+	can_periodic periodic[MSG_PERIODIC_NUM]; /* stato dei messaggi periodici */
+
+	/* invio su variazione di MSG_MON_INFO */
+	uint8_t mon_mode;           /* MSG_MON_MODE_xxx */
+	uint8_t mon_seq_en;         /* sequenza e CRC nella telemetria (MSG_MON_OPT_SEQ) */
+	uint8_t mon_seq;            /* sequenza di MSG_MON_INFO: avanza anche per gli invii soppressi o falliti */
+	uint8_t stat_seq;           /* sequenza di MSG_MON_STAT */
+	uint8_t periodic_suppr;     /* invii periodici disabilitati da CanControlLoop: la schedulazione prosegue senza invio */
+	uint32_t mon_suppr;         /* telemetria soppressa con periodic_suppr */
+	uint32_t mon_fail;          /* telemetria persa per coda di invio piena */
+	uint8_t mon_dead_t;         /* banda morta delle temperature */
+	uint16_t mon_dead_i;        /* banda morta della corrente */
+	uint16_t mon_inhibit;       /* ms dall'ultimo invio, per rispettare MSG_PERIOD_MIN */
+	uint16_t mon_status;        /* abilitazioni ed errori inviati per ultimi */
+	uint32_t mon_i;             /* corrente inviata per ultima */
+	uint8_t mon_t_a;            /* temperature inviate per ultime */
+	uint8_t mon_t_b;
+
+	/* risposta al SYNC: stato campionato alla ricezione, inviato dopo sync_slot ms */
+	uint16_t sync_slot;         /* ms di ritardo del nodo, per distribuire le risposte sul bus */
+	int16_t sync_due;           /* ms all'invio di MSG_MON_SYNC, negativo se nessuna risposta in attesa */
+	uint8_t sync_cnt;           /* contatore del SYNC (data[0]), o conteggio locale se assente */
+	uint8_t sync_age;           /* ms fra l'ultimo campionamento delle analogiche e il SYNC */
+	uint16_t sync_status;       /* stato campionato */
+	uint32_t sync_i;
+	uint8_t sync_t_a;
+	uint8_t sync_t_b;
 } candev;
 
 
@@ -117,89 +541,349 @@ extern volatile uint8_t can_tick_1ms;
 
 static candev can_dev;
 
+/* indicizzata con can_speed */
+#if CAN_PCLK1 == 36000000
+/* clock dei nodi installati: valori della vecchia CanSpeedInit, invariati per non spostare il punto di campionamento
+   in campo. Dal calcolo (CAN_BT) differiscono 1M, 500K e 100K, indicati nei commenti */
+static const can_bit_timing can_bit_timing_tab[CAN_SPEED_NONE] = {
+	{4,   CAN_BS1_6TQ,  CAN_BS2_2TQ},   /* 1M: 9 quanti, campionamento 77.8% (CAN_BT: 3, 12 quanti, 83.3%) */
+	{3,   CAN_BS1_12TQ, CAN_BS2_2TQ},   /* 800K: 15 quanti, 86.7% */
+	{4,   CAN_BS1_14TQ, CAN_BS2_3TQ},   /* 500K: 18 quanti, 83.3% (CAN_BT: 6, 12 quanti, 83.3%) */
+	{9,   CAN_BS1_13TQ, CAN_BS2_2TQ},   /* 250K: 16 quanti, 87.5% */
+	{18,  CAN_BS1_13TQ, CAN_BS2_2TQ},   /* 125K */
+	{24,  CAN_BS1_11TQ, CAN_BS2_3TQ},   /* 100K: 15 quanti, 80.0% (CAN_BT: BS1 12, BS2 2, 86.7%) */
+	{45,  CAN_BS1_13TQ, CAN_BS2_2TQ},   /* 50K */
+	{120, CAN_BS1_12TQ, CAN_BS2_2TQ},   /* 20K: 15 quanti, 86.7% */
+	{225, CAN_BS1_13TQ, CAN_BS2_2TQ},   /* 10K */
+};
+#else
+static const can_bit_timing can_bit_timing_tab[CAN_SPEED_NONE] = {
+	CAN_BT(CAN_BITRATE_1M),
+	CAN_BT(CAN_BITRATE_800K),
+	CAN_BT(CAN_BITRATE_500K),
+	CAN_BT(CAN_BITRATE_250K),
+	CAN_BT(CAN_BITRATE_125K),
+	CAN_BT(CAN_BITRATE_100K),
+	CAN_BT(CAN_BITRATE_50K),
+	CAN_BT(CAN_BITRATE_20K),
+	CAN_BT(CAN_BITRATE_10K),
+};
+#endif
+
+/* messaggi periodici: per aggiungerne uno basta un elemento (e aggiornare MSG_PERIODIC_NUM) */
+static const can_periodic_def can_periodic_tab[MSG_PERIODIC_NUM] = {
+	{MSG_MON_INFO, MSG_PERIOD_MON_INFO, 0},
+	{MSG_MON_STAT, MSG_PERIOD_MON_STAT, MSG_PERIOD_MON_INFO/2}, /* sfasato rispetto a MSG_MON_INFO */
+};
+
+
+/* parametri in e2prom accessibili via CAN, nell'ordine dell'oggetto CAN_SEG_OBJ_PARAMS (0xFFFF: non impostato/non modificare) */
+#define CAN_PARAM_NUM                 19
+static const uint16_t can_param_tab[CAN_PARAM_NUM] = {
+	FLASH_ADDR_SPEED_ID,
+	FLASH_ADDR_CANID_H,
+	FLASH_ADDR_CANID_L,
+	FLASH_ADDR_CANID_SEND_H,
+	FLASH_ADDR_CANID_SEND_L,
+	FLASH_ADDR_CANID_REC_OFFS_H,
+	FLASH_ADDR_CANID_REC_OFFS_L,
+	FLASH_ADDR_CANID_SEND_OFFS_H,
+	FLASH_ADDR_CANID_SEND_OFFS_L,
+	FLASH_ADDR_MON_MODE,
+	FLASH_ADDR_MON_DEAD_I,
+	FLASH_ADDR_SYNC_SLOT,
+	FLASH_ADDR_GROUP_0_H,
+	FLASH_ADDR_GROUP_0_L,
+	FLASH_ADDR_GROUP_1_H,
+	FLASH_ADDR_GROUP_1_L,
+	FLASH_ADDR_NODE_IDX,
+	FLASH_ADDR_MON_STAT_PERIOD,
+	FLASH_ADDR_CMD_TIMEOUT,
+};
+
+#if CAN_PARAM_NUM*2 > CAN_SEG_BUF || MSG_DIAG_PAGE_NUM*6 > CAN_SEG_BUF || CAN_CMD_NUM*2 > CAN_SEG_BUF
+# error "CAN_SEG_BUF insufficiente"
+#endif
+
 
 static void CanInit(void);
+static void CanEeJobExec(const can_ee_job *job);
+static void CanEeJobPop(void);
+static int CanIdCheck(void);
 
-static void CanSpeedInit(can_speed id)
+
+static uint32_t CanTimestamp(void)
 {
-	/* check speed */
-	if (id >= CAN_SPEED_NONE)
-		return;
+	return DWT->CYCCNT;
+}
 
-	/* deinizializzazione */
-	HAL_CAN_Stop(&hcan);
-	HAL_CAN_DeInit(&hcan);
-	__HAL_RCC_CAN1_FORCE_RESET();
-	__HAL_RCC_CAN1_RELEASE_RESET();
 
-	/* impostazione velocita' */
-	switch (id) { /* http://www.bittiming.can-wiki.info/ */
-	case CAN_SPEED_1M:
-		hcan.Init.Prescaler = 4;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_6TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_2TQ;
-		break;
+static void CanLatAdd(can_lat *lat, uint32_t dt)
+{
+	if (lat->num == 0) {
+		lat->min = lat->max = lat->avg = dt;
+	}
+	else {
+		if (dt < lat->min)
+			lat->min = dt;
+		if (dt > lat->max)
+			lat->max = dt;
+		lat->avg = (uint32_t)((int32_t)lat->avg + ((int32_t)(dt - lat->avg) / 16));
+	}
+	lat->num++;
+}
 
-	case CAN_SPEED_800K:
-		hcan.Init.Prescaler = 3;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_12TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_2TQ;
-		break;
 
-	case CAN_SPEED_500K:
-		hcan.Init.Prescaler = 4;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_14TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_3TQ;
-		break;
+/* cicli -> us, saturato a 16bit per la diagnostica */
+static uint16_t CanCyclesToUs(uint32_t cycles)
+{
+	cycles /= SystemCoreClock / 1000000;
+	return cycles > 0xFFFF ? 0xFFFF : cycles;
+}
 
-	case CAN_SPEED_250K:
-		hcan.Init.Prescaler = 9;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_13TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_2TQ;
-		break;
 
-	case CAN_SPEED_125K:
-		hcan.Init.Prescaler = 18;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_13TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_2TQ;
-		break;
+/* salvataggi in e2prom: eseguiti in ordine dal main loop, una scrittura per passo (CanEeTask) */
+static void CanEePost(uint8_t type, uint16_t addr, uint16_t val, uint8_t n)
+{
+	can_ee_job job, *p;
+
+	job.type = type;
+	job.n = n;
+	job.addr = addr;
+	job.val = val;
+	if (can_dev.ee_job_num == CAN_EE_JOB_NUM) {
+		/* coda piena: esecuzione anticipata del lavoro piu' vecchio, mai fuori ordine */
+		CanEeJobPop();
+	}
 
-	case CAN_SPEED_100K:
-		hcan.Init.Prescaler = 24;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_11TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_3TQ;
-		break;
+	p = &can_dev.ee_job[(can_dev.ee_job_out + can_dev.ee_job_num) % CAN_EE_JOB_NUM];
+	*p = job;
+	can_dev.ee_job_num++;
+	if (can_dev.ee_job_num > can_dev.ee_job_max)
+		can_dev.ee_job_max = can_dev.ee_job_num;
+}
 
-	case CAN_SPEED_50K:
-		hcan.Init.Prescaler = 45;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_13TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_2TQ;
-		break;
 
-	case CAN_SPEED_20K:
-		hcan.Init.Prescaler = 120;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_12TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_2TQ;
-		break;
+static void CanEeWrite(uint16_t addr, uint16_t val)
+{
+	CanEePost(CAN_EE_WRITE, addr, val, 0);
+}
 
-	case CAN_SPEED_10K:
-		hcan.Init.Prescaler = 225;
-		hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
-		hcan.Init.TimeSeg1 = CAN_BS1_13TQ;
-		hcan.Init.TimeSeg2 = CAN_BS2_2TQ;
-		break;
 
-	default:
-		break;
+/* conferma inviata sull'ID di configurazione dopo i salvataggi gia' in coda */
+static void CanEeAck(uint16_t opc, uint16_t val, uint8_t n)
+{
+	CanEePost(CAN_EE_ACK, opc, val, n);
+}
+
+
+/* code rx: un solo produttore (ISR) ed un solo consumatore (main loop), nessuna sezione critica */
+static void CanRxQueueInit(can_rx_queue *q, msg_can_rx *msg, uint16_t size)
+{
+	q->in = q->out = 0;
+	q->mask = size - 1;
+	q->msg = msg;
+}
+
+
+/* slot libero in cui l'ISR legge direttamente la mailbox; NULL se la coda e' piena */
+static msg_can_rx *CanRxQueueReserve(can_rx_queue *q)
+{
+	uint16_t in;
+
+	in = q->in;
+	if ((uint16_t)(in - q->out) > q->mask)
+		return NULL;
+
+	return &q->msg[in & q->mask];
+}
+
+
+/* pubblica lo slot ottenuto con CanRxQueueReserve */
+static void CanRxQueueCommit(can_rx_queue *q)
+{
+	uint16_t in, level;
+
+	in = q->in;
+	__DMB(); /* il messaggio deve essere in memoria prima della pubblicazione dell'indice */
+	q->in = in + 1;
+
+	level = (uint16_t)(in + 1 - q->out);
+	if (level > q->max)
+		q->max = level;
+}
+
+
+static msg_can_rx *CanRxQueueHead(can_rx_queue *q)
+{
+	uint16_t out;
+
+	out = q->out;
+	if (q->in == out)
+		return NULL;
+	__DMB(); /* lettura del messaggio solo dopo la lettura dell'indice */
+
+	return &q->msg[out & q->mask];
+}
+
+
+static void CanRxQueuePop(can_rx_queue *q)
+{
+	__DMB(); /* il messaggio deve essere stato consumato prima di liberare lo slot */
+	q->out++;
+}
+
+
+static uint16_t CanRxQueueLevel(const can_rx_queue *q)
+{
+	return (uint16_t)(q->in - q->out);
+}
+
+
+/* coda tx: gestita solo dal main loop, le ISR aggiornano solo lo stato delle mailbox */
+static int CanTxQueuePush(const CAN_TxHeaderTypeDef *header, const uint8_t *data)
+{
+	uint8_t i;
+
+	if (can_dev.tx_queue_num == CAN_TX_QUEUE) {
+		can_dev.tx_queue_full++;
+		return -1;
+	}
+
+	/* inserimento ordinato per ID (a parita' di ID in ordine di arrivo) */
+	i = can_dev.tx_queue_num;
+	while (i != 0 && can_dev.tx_queue[i-1].header.ExtId > header->ExtId) {
+		can_dev.tx_queue[i] = can_dev.tx_queue[i-1];
+		i--;
+	}
+	memcpy(&can_dev.tx_queue[i].header, header, sizeof(CAN_TxHeaderTypeDef));
+	memcpy(can_dev.tx_queue[i].data, data, sizeof(can_dev.tx_queue[i].data));
+	can_dev.tx_queue[i].ts = can_dev.rx_ts;
+	can_dev.tx_queue_num++;
+	if (can_dev.tx_queue_num > can_dev.tx_queue_max)
+		can_dev.tx_queue_max = can_dev.tx_queue_num;
+
+	return 0;
+}
+
+
+static uint8_t CanTxMbxIdx(uint32_t mbx)
+{
+	if (mbx == CAN_TX_MAILBOX0)
+		return 0;
+	if (mbx == CAN_TX_MAILBOX1)
+		return 1;
+	return 2;
+}
+
+
+static void CanReInit(void);
+
+static void CanTxFlush(void) /* affida i messaggi alle mailbox libere */
+{
+	uint32_t primask, mbx;
+	uint8_t i, k, resend;
+	can_mbx tmp;
+
+	/* re-invii: hanno precedenza sui messaggi in coda */
+	resend = 0;
+	i = 0;
+	while (i != CAN_TX_MBX_NUM) {
+		if (can_dev.tx_mbx[i].state != CAN_MBX_RESEND) {
+			i++;
+			continue;
+		}
+
+		if (can_dev.tx_mbx[i].re_send == MSG_RE_SEND_MAX) {
+			/* re-iniziliazzazione CANbus, il messaggio resta da re-inviare */
+			can_dev.tx_mbx[i].re_send = 0;
+			printf_err("Re-Send Error\r\n");
+			CanReInit();
+			return;
+		}
+
+		primask = __get_PRIMASK();
+		__disable_irq();
+		if (HAL_CAN_AddTxMessage(&hcan, &can_dev.tx_mbx[i].msg.header, can_dev.tx_mbx[i].msg.data, &mbx) != HAL_OK) {
+			can_dev.error_tot++;
+			can_dev.error_tx++;
+			resend = 1;
+			i++;
+		}
+		else {
+			/* l'hw puo' aver scelto un'altra mailbox libera: scambio dei dati di gestione */
+			k = CanTxMbxIdx(mbx);
+			if (k != i) {
+				tmp = can_dev.tx_mbx[k];
+				can_dev.tx_mbx[k] = can_dev.tx_mbx[i];
+				can_dev.tx_mbx[i] = tmp; /* la mailbox i viene rielaborata */
+			}
+			else {
+				i++;
+			}
+			can_dev.tx_mbx[k].re_send++;
+			can_dev.tx_mbx[k].ts = CanTimestamp();
+			can_dev.tx_mbx[k].state = CAN_MBX_BUSY;
+		}
+		__set_PRIMASK(primask);
 	}
+	if (resend)
+		return;
+
+	/* messaggi in coda in ordine di priorita' */
+	while (can_dev.tx_queue_num != 0 && HAL_CAN_GetTxMailboxesFreeLevel(&hcan) != 0) {
+		primask = __get_PRIMASK();
+		__disable_irq();
+		if (HAL_CAN_AddTxMessage(&hcan, &can_dev.tx_queue[0].header, can_dev.tx_queue[0].data, &mbx) != HAL_OK) {
+			__set_PRIMASK(primask);
+			can_dev.error_tot++;
+			can_dev.error_tx++;
+			break;
+		}
+		k = CanTxMbxIdx(mbx);
+		can_dev.tx_mbx[k].msg = can_dev.tx_queue[0];
+		can_dev.tx_mbx[k].re_send = 0;
+		can_dev.tx_mbx[k].ts = CanTimestamp();
+		can_dev.tx_mbx[k].state = CAN_MBX_BUSY;
+		__set_PRIMASK(primask);
+
+		if (can_dev.tx_queue[0].ts != 0) /* risposta ad un comando */
+			CanLatAdd(&can_dev.lat_cmd, can_dev.tx_mbx[k].ts - can_dev.tx_queue[0].ts);
+
+		can_dev.tx_queue_num--;
+		memmove(&can_dev.tx_queue[0], &can_dev.tx_queue[1], can_dev.tx_queue_num*sizeof(msg_can_tx));
+	}
+}
+
+static void CanSpeedInit(can_speed id)
+{
+	/* check speed */
+	if (id >= CAN_SPEED_NONE)
+		return;
+
+	/* deinizializzazione */
+	HAL_CAN_Stop(&hcan);
+	HAL_CAN_DeInit(&hcan);
+	__HAL_RCC_CAN1_FORCE_RESET();
+	__HAL_RCC_CAN1_RELEASE_RESET();
+
+	/* impostazione velocita': con un clock diverso da quello del calcolo tutti i bitrate sarebbero errati, il can resta spento */
+	if (HAL_RCC_GetPCLK1Freq() != CAN_PCLK1) {
+		can_dev.clk_err = 1;
+		printf_err("CAN_PCLK1 non allineato al clock\r\n");
+		return;
+	}
+	hcan.Init.Prescaler = can_bit_timing_tab[id].prescaler;
+	hcan.Init.SyncJumpWidth = CAN_SJW_1TQ;
+	hcan.Init.TimeSeg1 = can_bit_timing_tab[id].bs1;
+	hcan.Init.TimeSeg2 = can_bit_timing_tab[id].bs2;
+
+	/* priorita' di invio fra le mailbox in base all'ID e non in ordine cronologico */
+	hcan.Init.TransmitFifoPriority = DISABLE;
+	/* uscita dal bus-off gestita dall'hw dopo 128 x 11 bit recessivi */
+	hcan.Init.AutoBusOff = ENABLE;
+	/* in ricerca della velocita' solo ascolto: nessun ACK ne' error frame sul bus */
+	hcan.Init.Mode = can_dev.autobaud ? CAN_MODE_SILENT : CAN_MODE_NORMAL;
 
 	/* inizializzazione */
 	HAL_CAN_Init(&hcan);
@@ -213,38 +897,131 @@ static void CanReInit(void)
 }
 
 
-static short CanControlLoop(uint8_t tick_event) /* tick_event indica che sono trascorsi 10ms */
+/* prova della velocita' autobaud_speed: le ricezioni precedenti sono scartate */
+static void CanAutoBaudTry(void)
 {
-	static unsigned char to_cnt = 0;
-	uint32_t error, state;
-	short ret;
+	CanSpeedInit(can_dev.autobaud_speed);
+	__disable_irq();
+	can_dev.autobaud_rx = CAN_SPEED_NONE;
+	__enable_irq();
+}
+
+
+static void CanAutoBaudStart(void)
+{
+	can_dev.autobaud = 1;
+	can_dev.autobaud_speed = 0;
+	can_dev.autobaud_sweep = 0;
+	can_dev.autobaud_start = can_dev.autobaud_try = HAL_GetTick();
+	CanAutoBaudTry();
+}
+
+
+/* passo non bloccante della ricerca: ogni velocita' e' ascoltata per CAN_AUTOBAUD_DWELL ms,
+   la prima su cui arriva un messaggio valido (CRC corretto) viene salvata */
+static void CanAutoBaud(void)
+{
+	uint32_t now;
+
+	now = HAL_GetTick();
+	if (can_dev.autobaud_rx == can_dev.autobaud_speed) { /* ricezione alla velocita' in prova */
+		can_dev.autobaud = 0;
+		can_dev.autobaud_lock_time = now - can_dev.autobaud_start;
+		can_dev.speed = can_dev.autobaud_speed;
+		CanEeWrite(FLASH_ADDR_SPEED_ID, can_dev.speed);
+		CanReInit();
+		return;
+	}
 
-	if (can_dev.error_glb == 0)
-		to_cnt = 0;
+	if (now - can_dev.autobaud_try < CAN_AUTOBAUD_DWELL)
+		return;
 
-	if (tick_event) {
-		if (can_dev.error_glb)
-			to_cnt++;
+	can_dev.autobaud_try = now;
+	can_dev.autobaud_speed++;
+	if (can_dev.autobaud_speed == CAN_SPEED_NONE) {
+		can_dev.autobaud_speed = 0;
+		can_dev.autobaud_sweep++;
+		if (can_dev.autobaud_sweep == CAN_AUTOBAUD_SWEEP) {
+			/* bus muto: si va in linea con l'ultima velocita' nota, la ricerca riparte al prossimo avvio */
+			can_dev.autobaud = 0;
+			can_dev.autobaud_fail++;
+			CanReInit();
+			return;
+		}
 	}
+	CanAutoBaudTry();
+}
+
+
+/* recupero graduale degli errori: il controllore resta attivo finche' l'hw riesce a recuperare da solo */
+static short CanControlLoop(void)
+{
+	uint32_t esr, now;
+	can_bus_state state;
+	short ret;
+
 	ret = 0;
-	/* gestione errori */
-	error = HAL_CAN_GetError(&hcan);
-	state = HAL_CAN_GetState(&hcan);
-	if (error != HAL_CAN_ERROR_NONE || state == HAL_CAN_STATE_ERROR || to_cnt == MSG_ERROR_TO) {
-		HAL_CAN_Stop(&hcan);
-		HAL_CAN_DeInit(&hcan);
+	now = HAL_GetTick();
+	esr = hcan.Instance->ESR;
+	can_dev.tec = (esr & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+	can_dev.rec = (esr & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+	if (esr & CAN_ESR_BOFF)
+		state = CAN_BUS_OFF;
+	else if (esr & CAN_ESR_EPVF)
+		state = CAN_BUS_PASSIVE;
+	else if (esr & CAN_ESR_EWGF)
+		state = CAN_BUS_WARNING;
+	else
+		state = CAN_BUS_ACTIVE;
+
+	if (state != can_dev.bus_state) {
+		if (can_dev.bus_state == CAN_BUS_ACTIVE)
+			can_dev.bus_err_start = now;
+		if (state == CAN_BUS_OFF) {
+			can_dev.bus_off_start = now;
+			if (can_dev.error_tx >= MSG_ERROR_TX_LIMIT) {
+				/* disabilitato l'invio del messaggi */
+				can_dev.periodic_suppr = can_dev.periodic_en;
+				can_dev.periodic_en = 0;
+				ret = -1;
+			}
+		}
+		else if (state == CAN_BUS_ACTIVE) {
+			can_dev.recovery_time = now - can_dev.bus_err_start;
+			if (can_dev.recovery_time > can_dev.recovery_time_max)
+				can_dev.recovery_time_max = can_dev.recovery_time;
+			can_dev.recovery_num++;
+		}
+		can_dev.bus_state = state;
+	}
 
-		__HAL_RCC_CAN1_FORCE_RESET();
-		__HAL_RCC_CAN1_RELEASE_RESET();
+	/* invii falliti senza nessun invio o ricezione corretti per MSG_ERROR_TO ms, in qualsiasi stato: con il cavo
+	   scollegato gli errori di ACK in error passive non fanno crescere TEC e il bus-off non arriva mai */
+	if (can_dev.error_glb == 0) {
+		can_dev.error_glb_start = now;
+		can_dev.error_to = 0;
+	}
+	else if (can_dev.error_to == 0 && can_dev.error_tx >= MSG_ERROR_TX_LIMIT && now - can_dev.error_glb_start >= MSG_ERROR_TO) {
+		can_dev.error_to = 1;
+		/* disabilitato l'invio del messaggi */
+		can_dev.periodic_suppr |= can_dev.periodic_en;
+		can_dev.periodic_en = 0;
+		ret = -1;
+	}
 
-	    /* svuota la coda in ingresso al CAN bus */
-	    can_dev.rx_queue_in = can_dev.rx_queue_out = 0;
+	/* errori segnalati dal driver (gia' contati e azzerati in HAL_CAN_ErrorCallback): il controllore continua a funzionare */
+	if (HAL_CAN_GetError(&hcan) != HAL_CAN_ERROR_NONE)
+		HAL_CAN_ResetError(&hcan);
 
-		HAL_CAN_Init(&hcan);
-		CanInit();
+	/* ultima risorsa: bus-off non recuperato dall'hw o driver in errore */
+	if ((state == CAN_BUS_OFF && now - can_dev.bus_off_start >= CAN_BUS_OFF_TO) || HAL_CAN_GetState(&hcan) == HAL_CAN_STATE_ERROR) {
+		can_dev.reset_num++;
+		can_dev.bus_off_start = now;
+		CanReInit();
 
 		if (can_dev.error_tx >= MSG_ERROR_TX_LIMIT) {
 			/* disabilitato l'invio del messaggi */
+			can_dev.periodic_suppr |= can_dev.periodic_en;
 			can_dev.periodic_en = 0;
 			ret = -1;
 		}
@@ -254,10 +1031,32 @@ static short CanControlLoop(uint8_t tick_event) /* tick_event indica che sono tr
 }
 
 
-static HAL_StatusTypeDef CnMsgFilterList(uint32_t filter_id_0, uint32_t filter_id_1, uint16_t flt_num, uint8_t rtr)
+/* da richiamare ad ogni modifica di base, base_send, rec_offset e send_offset */
+static void CanIdUpdate(void)
+{
+	uint32_t id;
+	uint8_t i;
+
+	id = can_dev.base;
+	for (i=0; i!=MSG_REC_NUM; i++) {
+		can_dev.rx_id[i] = id;
+		id += can_dev.rec_offset;
+	}
+
+	id = can_dev.base_send;
+	for (i=0; i!=MSG_SEND_NUM; i++) {
+		can_dev.tx_id[i] = id;
+		id += can_dev.send_offset;
+	}
+}
+
+
+static HAL_StatusTypeDef CnMsgFilterList(uint32_t filter_id_0, uint32_t filter_id_1, uint16_t flt_num, uint8_t rtr, uint32_t fifo, uint8_t msg_0, uint8_t msg_1)
 {
 	CAN_FilterTypeDef can_filter = {0};
 	uint32_t option = 0x04; /* IDE pag 666 "Filter bank scale configuration - register organization" */
+	HAL_StatusTypeDef res;
+	uint16_t i, idx;
 
 	if (rtr)
 		option |= 0x02; /* RTR pag 666 "Filter bank scale configuration - register organization" */
@@ -273,19 +1072,46 @@ static HAL_StatusTypeDef CnMsgFilterList(uint32_t filter_id_0, uint32_t filter_i
 	can_filter.FilterBank = flt_num;
 	can_filter.SlaveStartFilterBank = flt_num;
 	can_filter.FilterActivation = ENABLE;
-	can_filter.FilterFIFOAssignment = CAN_RX_FIFO0;
+	can_filter.FilterFIFOAssignment = fifo;
+
+	res = HAL_CAN_ConfigFilter(&hcan, &can_filter);
+	if (res == HAL_OK && flt_num < CAN_FLT_BANK_NUM) {
+		/* gli indici sono numerati per FIFO: ogni banco precedente assegnato alla stessa FIFO ne occupa due */
+		idx = 0;
+		for (i=0; i!=flt_num; i++) {
+			if (can_dev.flt_fifo[i] == fifo)
+				idx += 2;
+		}
+		can_dev.flt_fifo[flt_num] = fifo;
+		can_dev.flt_msg[fifo][idx] = msg_0;
+		can_dev.flt_msg[fifo][idx + 1] = msg_1;
+	}
 
-	return HAL_CAN_ConfigFilter(&hcan, &can_filter);
+	return res;
 }
 
 
-static void CanInit(void)
+/* banco non utilizzato: disattivato e riportato sulla FIFO0 in lista a 32bit, come previsto dalla numerazione di CnMsgFilterList */
+static void CnMsgFilterOff(uint16_t flt_num)
+{
+	CAN_FilterTypeDef can_filter = {0};
+
+	can_filter.FilterMode = CAN_FILTERMODE_IDLIST;
+	can_filter.FilterScale = CAN_FILTERSCALE_32BIT;
+	can_filter.FilterBank = flt_num;
+	can_filter.SlaveStartFilterBank = flt_num;
+	can_filter.FilterActivation = DISABLE;
+	can_filter.FilterFIFOAssignment = CAN_RX_FIFO0;
+	HAL_CAN_ConfigFilter(&hcan, &can_filter);
+}
+
+
+/* lettura degli ID dalla e2prom: solo all'avvio, le modifiche via CAN aggiornano direttamente can_dev */
+static void CanIdLoad(void)
 {
 	uint16_t ret, val_h, val_l;
-	CAN_FilterTypeDef can_filter;
-	HAL_StatusTypeDef res;
+	uint8_t i;
 
-	/* inizializzazione fifo per la ricezione dei messaggio con i vari ID */
 	can_dev.cfg_id = CONF_CANID;
 	can_dev.base = 0;
 	can_dev.base_send = 0;
@@ -331,36 +1157,84 @@ static void CanInit(void)
 		}
 	}
 
+	/* gruppi e posizione nella maschera del broadcast */
+	for (i=0; i!=CAN_GROUP_NUM; i++) {
+		can_dev.group_id[i] = 0;
+		ret = EE_ReadVariable(FLASH_ADDR_GROUP_0_H + 2*i, &val_h);
+		if (ret == 0) {
+			ret = EE_ReadVariable(FLASH_ADDR_GROUP_0_L + 2*i, &val_l);
+			if (ret == 0 && val_h != 0xFFFF) {
+				can_dev.group_id[i] = val_h;
+				can_dev.group_id[i] = (can_dev.group_id[i]<<16) | val_l;
+			}
+		}
+	}
+	can_dev.node_idx = CAN_NODE_IDX_NONE;
+	ret = EE_ReadVariable(FLASH_ADDR_NODE_IDX, &val_l);
+	if (ret == 0 && val_l <= CAN_NODE_IDX_MAX)
+		can_dev.node_idx = val_l;
+
+	/* commit interrotto a meta' (CanStageCommit): insieme misto di vecchi e nuovi ID, scartato */
+	can_dev.id_gen = 0;
+	ret = EE_ReadVariable(FLASH_ADDR_CANID_COMMIT, &val_l);
+	if (ret == 0)
+		can_dev.id_gen = val_l;
+	ret = EE_ReadVariable(FLASH_ADDR_CANID_GEN, &val_h);
+	if (ret == 0 && val_h != can_dev.id_gen)
+		can_dev.base = 0;
+
+	/* insieme di ID non valido (es. salvataggio interrotto a meta'): solo l'ID di configurazione */
+	CanIdUpdate();
+	if (CanIdCheck() != 0) {
+		can_dev.base = 0;
+		CanIdUpdate();
+	}
+}
+
+
+static void CanInit(void)
+{
+	uint8_t i;
+	CAN_FilterTypeDef can_filter;
+	HAL_StatusTypeDef res;
+
+	CanIdUpdate();
+
 	/* msg receive filters */
-	res = CnMsgFilterList(can_dev.cfg_id, can_dev.cfg_id, 0, 0);
+	can_dev.flt_all = 0;
+	memset(can_dev.flt_fifo, CAN_RX_FIFO0, sizeof(can_dev.flt_fifo)); /* assegnazione di reset dei banchi */
+	memset(can_dev.flt_msg, MSG_NONE, sizeof(can_dev.flt_msg));
+	for (i=1; i!=CAN_FLT_BANK_NUM; i++)
+		CnMsgFilterOff(i); /* nessun banco rimasto dalla configurazione precedente */
+	if (can_dev.autobaud)
+		res = HAL_ERROR; /* in ricerca della velocita' va bene qualsiasi messaggio: filtro piglia tutto */
+	else
+		res = CnMsgFilterList(can_dev.cfg_id, can_dev.cfg_id, 0, 0, CAN_RX_FIFO0, MSG_CONF, MSG_CONF); /* dati e rtr */
 	if (res == HAL_OK  && can_dev.base != 0) {
-		uint32_t flt_id_0, flt_id_1;
-		
-		flt_id_0 = can_dev.cfg_id;
-		flt_id_1 = can_dev.base + can_dev.rec_offset*MSG_CFG_STATUS;
-		res = CnMsgFilterList(flt_id_0, flt_id_1, 0, 0);
+		/* comandi prioritari sulla FIFO1 */
+		res = CnMsgFilterList(can_dev.rx_id[MSG_CFG_STATUS], can_dev.rx_id[MSG_OUT_ENABLE], 1, 0, CAN_RX_FIFO1, MSG_CFG_STATUS, MSG_OUT_ENABLE);
 		if (res == HAL_OK) {
-			flt_id_0 = can_dev.base + can_dev.rec_offset*MSG_OUT_ENABLE;
-			res = CnMsgFilterList(flt_id_0, flt_id_0, 1, 0);
+			res = CnMsgFilterList(can_dev.rx_id[MSG_CNG_VELOC], can_dev.rx_id[MSG_CNG_VELOC], 2, 0, CAN_RX_FIFO0, MSG_CNG_VELOC, MSG_CNG_VELOC);
 			if (res == HAL_OK) {
-				flt_id_1 = can_dev.base + can_dev.rec_offset*MSG_CNG_VELOC;
-				res = CnMsgFilterList(flt_id_0, flt_id_1, 1, 0);
+				res = CnMsgFilterList(can_dev.rx_id[MSG_HW_VER], can_dev.rx_id[MSG_FW_VER], 3, 1, CAN_RX_FIFO0, MSG_HW_VER, MSG_FW_VER);
 				if (res == HAL_OK) {
-					flt_id_0 = can_dev.base + can_dev.rec_offset*MSG_HW_VER;
-					res = CnMsgFilterList(flt_id_0, flt_id_0, 2, 1);
-					if (res == HAL_OK) {
-						flt_id_1 = can_dev.base + can_dev.rec_offset*MSG_FW_VER;
-						res = CnMsgFilterList(flt_id_0, flt_id_1, 2, 1);
+					/* SYNC e broadcast sulla FIFO prioritaria: campionamento e commutazione il prima possibile */
+					res = CnMsgFilterList(CAN_SYNC_ID, CAN_BCAST_ID, 4, 0, CAN_RX_FIFO1, MSG_SYNC, MSG_GROUP);
+					if (res == HAL_OK && (can_dev.group_id[0] != 0 || can_dev.group_id[1] != 0)) {
+						res = CnMsgFilterList(can_dev.group_id[0] != 0 ? can_dev.group_id[0] : can_dev.group_id[1],
+								can_dev.group_id[1] != 0 ? can_dev.group_id[1] : can_dev.group_id[0], 5, 0, CAN_RX_FIFO1, MSG_GROUP, MSG_GROUP);
 					}
 				}
 			}
 		}
-		if (res == HAL_OK) {
-			res = CnMsgFilterList(can_dev.cfg_id, can_dev.cfg_id, 3, 1); /* per rtr */
-		}
+	}
+	if (res == HAL_OK) {
+		/* LSS anche per i nodi non configurati: per ultimo, gli indici dipendono dall'assegnazione dei banchi precedenti */
+		res = CnMsgFilterList(CAN_LSS_ID, CAN_LSS_ID, 6, 0, CAN_RX_FIFO0, MSG_LSS, MSG_LSS);
 	}
 
 	if (res != HAL_OK) {
+		can_dev.flt_all = 1;
 		/* impostazione filtro piglia tutto */
 		can_filter.FilterIdHigh = CONF_CANID>>13;  /* vedi pg 827 manuale uC */
 		can_filter.FilterIdLow = (CONF_CANID<<3) & 0x0000FFFF;
@@ -379,29 +1253,339 @@ static void CanInit(void)
 		printf_err("HAL_CAN_Start: FAIL\r\n");
 	}
 
-	if (HAL_CAN_ActivateNotification(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_TX_MAILBOX_EMPTY | CAN_IT_RX_FIFO0_FULL | CAN_IT_ERROR | CAN_IT_BUSOFF | CAN_IT_ERROR_PASSIVE | CAN_IT_ERROR_WARNING | CAN_IT_LAST_ERROR_CODE) != HAL_OK) {
+	if (HAL_CAN_ActivateNotification(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_TX_MAILBOX_EMPTY | CAN_IT_RX_FIFO0_FULL | CAN_IT_RX_FIFO1_FULL | CAN_IT_RX_FIFO0_OVERRUN | CAN_IT_RX_FIFO1_OVERRUN | CAN_IT_ERROR | CAN_IT_BUSOFF | CAN_IT_ERROR_PASSIVE | CAN_IT_ERROR_WARNING | CAN_IT_LAST_ERROR_CODE) != HAL_OK) {
 		printf_err("HAL_CAN_ActivateNotification: FAIL\r\n");
 	}
 
     /* reset errore in CAN */
     can_dev.error_glb = 0;
 
-    /* abilita l'invio */
-    can_dev.send_en = 1;
+    /* i messaggi affidati alle mailbox prima della re-inizializzazione sono da re-inviare */
+    for (i=0; i!=CAN_TX_MBX_NUM; i++) {
+    	if (can_dev.tx_mbx[i].state == CAN_MBX_BUSY)
+    		can_dev.tx_mbx[i].state = CAN_MBX_RESEND;
+    }
 }
 
 
 
-static void CanSendData(uint8_t msg_id, machine_status *machine, uint16_t param)
+static can_periodic *CanPeriodicFind(uint8_t msg_id)
 {
-	uint16_t can_data[5] = {0};
-	uint8_t *data = (uint8_t *)can_data;
-	uint8_t send = 1;
-	uint32_t mbx;
+	uint8_t i;
+
+	for (i=0; i!=MSG_PERIODIC_NUM; i++) {
+		if (can_dev.periodic[i].msg_id == msg_id)
+			return &can_dev.periodic[i];
+	}
+
+	return NULL;
+}
+
+
+static void CanPeriodicSet(uint8_t msg_id, uint16_t period)
+{
+	can_periodic *per;
+
+	per = CanPeriodicFind(msg_id);
+	if (per != NULL) {
+		per->period = period;
+		if (per->due > period)
+			per->due = period;
+	}
+}
+
+
+static void CanPeriodicForce(uint8_t msg_id)
+{
+	can_periodic *per;
+
+	per = CanPeriodicFind(msg_id);
+	if (per != NULL)
+		per->force = 1;
+}
+
+
+/* riparte dal primo periodo, sfasato di phase */
+static void CanPeriodicReset(void)
+{
+	uint8_t i;
+
+	for (i=0; i!=MSG_PERIODIC_NUM; i++)
+		can_dev.periodic[i].due = (int32_t)can_dev.periodic[i].period + can_dev.periodic[i].phase;
+}
+
+
+static void CanPeriodicTick(uint32_t dt)
+{
+	uint8_t i;
+
+	for (i=0; i!=MSG_PERIODIC_NUM; i++) {
+		if (can_dev.periodic[i].period != 0)
+			can_dev.periodic[i].due -= (int32_t)dt;
+	}
+}
+
+
+/* messaggio scaduto piu' in ritardo (i forzati hanno la precedenza), NULL se nessuno */
+static can_periodic *CanPeriodicNext(void)
+{
+	can_periodic *per, *next;
+	uint8_t i;
+
+	next = NULL;
+	for (i=0; i!=MSG_PERIODIC_NUM; i++) {
+		per = &can_dev.periodic[i];
+		if (per->force) {
+			if (next == NULL || next->force == 0 || per->due < next->due)
+				next = per;
+		}
+		else if (per->period != 0 && per->due <= 0) {
+			if (next == NULL || (next->force == 0 && per->due < next->due))
+				next = per;
+		}
+	}
+
+	return next;
+}
+
+
+/* abilitazioni (byte basso) ed errori (byte alto) come inviati in MSG_MON_INFO */
+static uint16_t CanMonStatus(const machine_status *machine)
+{
+	uint16_t status = 0;
+
+	/* abilitazioni */
+	if (machine->switch_on)
+		status |= 0x0001;
+	if (machine->enable_power)
+		status |= 0x0002;
+	/* errori */
+	if (machine->error_ov_uv)
+		status |= 0x0100;
+	if (machine->error_overcurrent)
+		status |= 0x0200;
+	if (machine->error_temp_sens_1)
+		status |= 0x0400;
+	if (machine->error_temp_sens_2)
+		status |= 0x0800;
+	if (machine->error_th)
+		status |= 0x1000;
+	if (machine->error_cmd_timeout)
+		status |= 0x2000;
+
+	return status;
+}
+
+
+static uint32_t CanMonDiff(uint32_t a, uint32_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+
+/* in MSG_MON_MODE_CHANGE forza l'invio di MSG_MON_INFO se lo stato e' cambiato dall'ultimo invio */
+static void CanMonChange(const machine_status *machine, uint32_t dt)
+{
+	if (can_dev.mon_inhibit < MSG_PERIOD_MIN)
+		can_dev.mon_inhibit += dt;
+	if (can_dev.mon_mode != MSG_MON_MODE_CHANGE || can_dev.mon_inhibit < MSG_PERIOD_MIN)
+		return;
+
+	if (CanMonStatus(machine) != can_dev.mon_status
+		|| CanMonDiff(machine->i, can_dev.mon_i) > can_dev.mon_dead_i
+		|| CanMonDiff((uint8_t)machine->t_a, can_dev.mon_t_a) > can_dev.mon_dead_t
+		|| CanMonDiff((uint8_t)machine->t_b, can_dev.mon_t_b) > can_dev.mon_dead_t) {
+		CanPeriodicForce(MSG_MON_INFO);
+	}
+}
+
+
+static void CanMonModeSet(uint8_t mode)
+{
+	can_dev.mon_seq_en = (mode & MSG_MON_OPT_SEQ) != 0;
+	mode &= MSG_MON_MODE_MASK;
+	can_dev.mon_mode = mode;
+	if (mode == MSG_MON_MODE_CHANGE)
+		CanPeriodicSet(MSG_MON_INFO, MSG_PERIOD_HEARTBEAT);
+	else
+		CanPeriodicSet(MSG_MON_INFO, MSG_PERIOD_MON_INFO);
+}
+
+
+/* SYNC: fotografia dell'ultimo risultato di AnalogManager, inviata dopo sync_slot ms */
+static void CanSyncLatch(const msg_can_rx *msg, const machine_status *machine)
+{
+	uint32_t age;
+
+	if (can_dev.periodic_en == 0)
+		return;
+
+	if (msg->header.DLC >= 1)
+		can_dev.sync_cnt = msg->data[0];
+	else
+		can_dev.sync_cnt++;
+
+	age = HAL_GetTick() - machine->t_sample;
+	can_dev.sync_age = age > 0xFF ? 0xFF : age;
+	can_dev.sync_status = CanMonStatus(machine);
+	can_dev.sync_i = machine->i;
+	can_dev.sync_t_a = machine->t_a;
+	can_dev.sync_t_b = machine->t_b;
+	can_dev.sync_due = can_dev.sync_slot;
+}
+
+
+/* lettura dei parametri dalla e2prom: all'avvio e dopo una scrittura della tabella parametri */
+static void CanParamsLoad(void)
+{
+	uint16_t ret, val;
+
+	can_dev.speed = CAN_SPEED_250K; /* default */
+	ret = EE_ReadVariable(FLASH_ADDR_SPEED_ID, &val);
+	if (ret == 0 && val < CAN_SPEED_NONE) {
+		can_dev.speed = val;
+	}
+	else if (ret == 0 && val == CAN_SPEED_AUTO) {
+		can_dev.autobaud = 1;
+	}
+
+	/* ID dei messaggi */
+	CanIdLoad();
+
+	/* modalita' di invio di MSG_MON_INFO */
+	can_dev.mon_dead_t = MSG_MON_DEAD_T;
+	can_dev.mon_dead_i = MSG_MON_DEAD_I;
+	can_dev.mon_mode = MSG_MON_MODE_PERIODIC;
+	ret = EE_ReadVariable(FLASH_ADDR_MON_MODE, &val);
+	if (ret == 0 && (val & MSG_MON_MODE_MASK) <= MSG_MON_MODE_CHANGE) {
+		can_dev.mon_dead_t = val >> 8;
+		CanMonModeSet(val & 0xFF);
+		ret = EE_ReadVariable(FLASH_ADDR_MON_DEAD_I, &val);
+		if (ret == 0)
+			can_dev.mon_dead_i = val;
+	}
+
+	/* periodo delle statistiche */
+	ret = EE_ReadVariable(FLASH_ADDR_MON_STAT_PERIOD, &val);
+	if (ret == 0 && (val == 0 || val >= MSG_PERIOD_MIN))
+		CanPeriodicSet(MSG_MON_STAT, val);
+
+	/* supervisione dei comandi alle uscite */
+	ret = EE_ReadVariable(FLASH_ADDR_CMD_TIMEOUT, &val);
+	MachineCmdTimeoutSet(ret == 0 && val != 0xFFFF ? val : 0);
+
+	/* ritardo della risposta al SYNC */
+	can_dev.sync_slot = 0;
+	ret = EE_ReadVariable(FLASH_ADDR_SYNC_SLOT, &val);
+	if (ret == 0 && val <= MSG_SYNC_SLOT_MAX)
+		can_dev.sync_slot = val;
+}
+
+
+/* valori di una pagina di diagnostica, -1 se la pagina non esiste */
+static int CanDiagPage(uint8_t page, uint16_t *val)
+{
+	const can_lat *lat;
+	const can_rx_queue *q;
+
+	switch (page) {
+	case MSG_DIAG_PAGE_CNT:
+		val[0] = can_dev.tx;
+		val[1] = can_dev.rx;
+		val[2] = can_dev.tot_rx;
+		break;
+
+	case MSG_DIAG_PAGE_ERR:
+		val[0] = can_dev.error_tx;
+		val[1] = can_dev.error_tot;
+		val[2] = can_dev.rx_queue[CAN_RX_FIFO0].drop + can_dev.rx_queue[CAN_RX_FIFO1].drop;
+		break;
+
+	case MSG_DIAG_PAGE_LAT_CMD:
+	case MSG_DIAG_PAGE_LAT_QUEUE:
+	case MSG_DIAG_PAGE_LAT_TX:
+		lat = page == MSG_DIAG_PAGE_LAT_CMD ? &can_dev.lat_cmd : page == MSG_DIAG_PAGE_LAT_QUEUE ? &can_dev.lat_queue : &can_dev.lat_tx;
+		val[0] = CanCyclesToUs(lat->min);
+		val[1] = CanCyclesToUs(lat->avg);
+		val[2] = CanCyclesToUs(lat->max);
+		break;
+
+	case MSG_DIAG_PAGE_BUS:
+		val[0] = can_dev.tec | (can_dev.rec << 8);
+		val[1] = can_dev.bus_state;
+		val[2] = can_dev.recovery_time_max > 0xFFFF ? 0xFFFF : can_dev.recovery_time_max;
+		break;
+
+	case MSG_DIAG_PAGE_MISC:
+		val[0] = CanCyclesToUs(can_dev.out_en_lat_max);
+		val[1] = can_dev.reset_num;
+		val[2] = can_dev.autobaud_lock_time > 0xFFFF ? 0xFFFF : can_dev.autobaud_lock_time;
+		break;
+
+	case MSG_DIAG_PAGE_EE:
+		val[0] = CanCyclesToUs(can_dev.ee_stall_max);
+		val[1] = can_dev.ee_stall_max / (SystemCoreClock / 1000);
+		val[2] = can_dev.ee_job_max;
+		break;
+
+	case MSG_DIAG_PAGE_RX0:
+	case MSG_DIAG_PAGE_RX1:
+		q = &can_dev.rx_queue[page == MSG_DIAG_PAGE_RX0 ? CAN_RX_FIFO0 : CAN_RX_FIFO1];
+		val[0] = q->ovr > 0xFFFF ? 0xFFFF : q->ovr;
+		val[1] = q->drop > 0xFFFF ? 0xFFFF : q->drop;
+		val[2] = q->max;
+		break;
+
+	case MSG_DIAG_PAGE_MON:
+		val[0] = can_dev.mon_suppr > 0xFFFF ? 0xFFFF : can_dev.mon_suppr;
+		val[1] = can_dev.mon_fail > 0xFFFF ? 0xFFFF : can_dev.mon_fail;
+		val[2] = can_dev.mon_seq | (can_dev.stat_seq << 8);
+		break;
+
+	case MSG_DIAG_PAGE_RX_DRAIN:
+		val[0] = can_dev.rx_queue[CAN_RX_FIFO0].full > 0xFFFF ? 0xFFFF : can_dev.rx_queue[CAN_RX_FIFO0].full;
+		val[1] = can_dev.rx_queue[CAN_RX_FIFO1].full > 0xFFFF ? 0xFFFF : can_dev.rx_queue[CAN_RX_FIFO1].full;
+		val[2] = can_dev.rx_drain_num > 0xFFFF ? 0xFFFF : can_dev.rx_drain_num;
+		break;
+
+	case MSG_DIAG_PAGE_TX:
+		val[0] = can_dev.tx_queue_full > 0xFFFF ? 0xFFFF : can_dev.tx_queue_full;
+		val[1] = can_dev.tx_queue_num;
+		val[2] = can_dev.tx_queue_max;
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static uint8_t CanCrc8(const uint8_t *data, uint8_t n)
+{
+	uint8_t crc = 0;
+	uint8_t i;
+
+	while (n--) {
+		crc ^= *data++;
+		for (i=0; i!=8; i++)
+			crc = (crc & 0x80) ? (crc << 1) ^ MSG_MON_CRC_POLY : crc << 1;
+	}
+
+	return crc;
+}
+
+
+static void CanSendData(uint8_t msg_id, machine_status *machine, uint16_t param)
+{
+	uint16_t can_data[5] = {0};
+	uint8_t *data = (uint8_t *)can_data;
+	uint8_t send = 1;
 	CAN_TxHeaderTypeDef header = {0};
 
 	header.StdId = 0x00;
-	header.ExtId = can_dev.base_send + can_dev.send_offset*msg_id;
+	header.ExtId = can_dev.tx_id[msg_id];
 	header.IDE = CAN_ID_EXT;
 	header.RTR = CAN_RTR_DATA;
 	header.TransmitGlobalTime = DISABLE;
@@ -409,23 +1593,10 @@ static void CanSendData(uint8_t msg_id, machine_status *machine, uint16_t param)
 	switch (msg_id) {
 	case MSG_MON_INFO:
 		header.DLC = 6;
-		can_dev.period_mon_info_force = 0;
-		/* abilitazioni */
-		if (machine->switch_on)
-			data[0] |= 0x01;
-		if (machine->enable_power)
-			data[0] |= 0x02;
-		/* errori */
-		if (machine->error_ov_uv)
-			data[1] |= 0x01;
-		if (machine->error_overcurrent)
-			data[1] |= 0x02;
-		if (machine->error_temp_sens_1)
-			data[1] |= 0x04;
-		if (machine->error_temp_sens_2)
-			data[1] |= 0x08;
-		if (machine->error_th)
-			data[1] |= 0x10;
+		/* abilitazioni ed errori */
+		can_dev.mon_status = CanMonStatus(machine);
+		data[0] = can_dev.mon_status & 0xFF;
+		data[1] = can_dev.mon_status >> 8;
 
 		/* corrente */
 		can_data[1] = machine->i;
@@ -433,6 +1604,54 @@ static void CanSendData(uint8_t msg_id, machine_status *machine, uint16_t param)
 		/* temperature */
 		data[4] = machine->t_a;
 		data[5] = machine->t_b;
+
+		/* riferimento per l'invio su variazione */
+		can_dev.mon_i = machine->i;
+		can_dev.mon_t_a = data[4];
+		can_dev.mon_t_b = data[5];
+		can_dev.mon_inhibit = 0;
+
+		/* sequenza e CRC nei byte liberi: i primi 6 byte non cambiano */
+		if (can_dev.mon_seq_en) {
+			header.DLC = 8;
+			data[6] = can_dev.mon_seq;
+			data[7] = CanCrc8(data, 7);
+		}
+		can_dev.mon_seq++;
+		break;
+
+	case MSG_MON_STAT:
+		header.DLC = 7;
+		can_data[0] = machine->stat_i_min > 0xFFFF ? 0xFFFF : machine->stat_i_min;
+		can_data[1] = machine->stat_i_max > 0xFFFF ? 0xFFFF : machine->stat_i_max;
+		can_data[2] = machine->stat_num == 0 ? 0 : machine->stat_i_sum / machine->stat_num;
+		data[6] = machine->stat_t_max;
+		/* nuova finestra */
+		machine->stat_num = 0;
+
+		if (can_dev.mon_seq_en) {
+			header.DLC = 8;
+			data[7] = can_dev.stat_seq;
+		}
+		can_dev.stat_seq++;
+		break;
+
+	case MSG_MON_SYNC:
+		header.DLC = 8;
+		data[0] = can_dev.sync_status & 0xFF;
+		data[1] = can_dev.sync_status >> 8;
+		can_data[1] = can_dev.sync_i;
+		data[4] = can_dev.sync_t_a;
+		data[5] = can_dev.sync_t_b;
+		data[6] = can_dev.sync_cnt;
+		data[7] = can_dev.sync_age;
+		break;
+
+	case MSG_DIAG_INFO:
+		header.DLC = 8;
+		data[0] = param;
+		if (CanDiagPage(param, &can_data[1]) != 0)
+			send = 0;
 		break;
 
 	default:
@@ -441,378 +1660,1375 @@ static void CanSendData(uint8_t msg_id, machine_status *machine, uint16_t param)
 	}
 
 	if (send) {
-		memcpy(&can_dev.tx_msg.header, &header, sizeof(CAN_TxHeaderTypeDef));
-		memcpy(can_dev.tx_msg.data, data, 8);
-		if (HAL_CAN_AddTxMessage(&hcan, &header, data, &mbx) != HAL_OK) {
-			can_dev.error_tot++;
-			can_dev.error_tx++;
-		}
-		else {
-			can_dev.send_en = 0;
+		if (CanTxQueuePush(&header, data) != 0 && msg_id != MSG_DIAG_INFO)
+			can_dev.mon_fail++;
+	}
+}
+
+
+/* invio periodico soppresso: la sequenza avanza come per un messaggio perso */
+static void CanSendSuppr(uint8_t msg_id)
+{
+	if (msg_id == MSG_MON_INFO)
+		can_dev.mon_seq++;
+	else if (msg_id == MSG_MON_STAT)
+		can_dev.stat_seq++;
+	can_dev.mon_suppr++;
+}
+
+
+/* invio periodico perso per coda di invio piena */
+static void CanSendFail(uint8_t msg_id)
+{
+	if (msg_id == MSG_MON_INFO)
+		can_dev.mon_seq++;
+	else if (msg_id == MSG_MON_STAT)
+		can_dev.stat_seq++;
+	can_dev.mon_fail++;
+}
+
+
+static void CanSyncTick(machine_status *machine, uint32_t dt)
+{
+	if (can_dev.sync_due < 0)
+		return;
+
+	if (can_dev.sync_due > (int32_t)dt)
+		can_dev.sync_due -= dt;
+	else if (can_dev.tx_queue_num != CAN_TX_QUEUE) {
+		can_dev.sync_due = -1;
+		CanSendData(MSG_MON_SYNC, machine, 0);
+	}
+	else
+		can_dev.sync_due = 0; /* coda di invio piena: al prossimo passo */
+}
+
+
+static void CanSendCfgData(uint8_t cmd_id)
+{
+	uint16_t can_data[5] = {0};
+	uint8_t *data = (uint8_t *)can_data;
+	uint8_t send = 1;
+	CAN_TxHeaderTypeDef header = {0};
+
+	header.StdId = 0x00;
+	header.ExtId = can_dev.cfg_id;
+	header.IDE = CAN_ID_EXT;
+	header.RTR = CAN_RTR_DATA;
+	header.TransmitGlobalTime = DISABLE;
+
+	data[0] = cmd_id & 0x000000FF;
+	data[1] = (cmd_id>>8) & 0x000000FF;
+
+	switch (cmd_id) {
+	case MSG_OPC_CANID_REC:
+		header.DLC = 6;
+		data[2] = can_dev.base & 0x000000FF;
+		data[3] = (can_dev.base>>8) & 0x000000FF;
+		data[4] = (can_dev.base>>16) & 0x000000FF;
+		data[5] = (can_dev.base>>24) & 0x000000FF;
+		break;
+
+	case MSG_OPC_CANID_SEND:
+		header.DLC = 6;
+		data[2] = can_dev.base_send & 0x000000FF;
+		data[3] = (can_dev.base_send>>8) & 0x000000FF;
+		data[4] = (can_dev.base_send>>16) & 0x000000FF;
+		data[5] = (can_dev.base_send>>24) & 0x000000FF;
+		break;
+
+	case MSG_OPC_CANID_OFFSET:
+		header.DLC = 6;
+		data[2] = can_dev.rec_offset & 0x000000FF;
+		data[3] = (can_dev.rec_offset>>8) & 0x000000FF;
+		data[4] = (can_dev.rec_offset>>16) & 0x000000FF;
+		data[5] = (can_dev.rec_offset>>24) & 0x000000FF;
+		break;
+
+	default:
+		send = 0;
+		break;
+	}
+
+	if (send) {
+		CanTxQueuePush(&header, data);
+	}
+}
+
+
+/* valore attivo di un parametro CAN_PAR_xxx, ritorna -1 se inesistente */
+static int CanParamGet(uint16_t idx, uint32_t *val)
+{
+	can_periodic *per;
+
+	switch (idx) {
+	case CAN_PAR_CANID:
+		*val = can_dev.base;
+		break;
+
+	case CAN_PAR_CANID_SEND:
+		*val = can_dev.base_send;
+		break;
+
+	case CAN_PAR_REC_OFFSET:
+		*val = can_dev.rec_offset;
+		break;
+
+	case CAN_PAR_SEND_OFFSET:
+		*val = can_dev.send_offset;
+		break;
+
+	case CAN_PAR_SPEED:
+		*val = can_dev.speed;
+		break;
+
+	case CAN_PAR_MON_INFO_PERIOD:
+	case CAN_PAR_MON_STAT_PERIOD:
+		per = CanPeriodicFind(idx == CAN_PAR_MON_INFO_PERIOD ? MSG_MON_INFO : MSG_MON_STAT);
+		if (per == NULL)
+			return -1;
+		*val = per->period;
+		break;
+
+	case CAN_PAR_MON_MODE:
+		*val = can_dev.mon_mode | ((uint32_t)can_dev.mon_dead_t<<8) | ((uint32_t)can_dev.mon_dead_i<<16);
+		break;
+
+	case CAN_PAR_SYNC_SLOT:
+		*val = can_dev.sync_slot;
+		break;
+
+	case CAN_PAR_GROUP_0:
+	case CAN_PAR_GROUP_1:
+		*val = can_dev.group_id[idx - CAN_PAR_GROUP_0];
+		break;
+
+	case CAN_PAR_NODE_IDX:
+		*val = can_dev.node_idx;
+		break;
+
+	case CAN_PAR_CMD_TIMEOUT:
+		*val = MachineCmdTimeoutGet();
+		break;
+
+	case CAN_PAR_RX:
+		*val = can_dev.rx;
+		break;
+
+	case CAN_PAR_TX:
+		*val = can_dev.tx;
+		break;
+
+	case CAN_PAR_TOT_RX:
+		*val = can_dev.tot_rx;
+		break;
+
+	case CAN_PAR_ERROR_TOT:
+		*val = can_dev.error_tot;
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* ID di configurazione e ID fissi comuni a tutti i nodi */
+static int CanIdReserved(uint32_t id)
+{
+	return id == can_dev.cfg_id || id == CAN_SYNC_ID || id == CAN_BCAST_ID || id == CAN_LSS_ID || id == CAN_LSS_RSP_ID;
+}
+
+
+static void CanIdSetGet(can_id_set *set) /* parametri attivi */
+{
+	set->base = can_dev.base;
+	set->base_send = can_dev.base_send;
+	set->rec_offset = can_dev.rec_offset;
+	set->send_offset = can_dev.send_offset;
+	memcpy(set->group_id, can_dev.group_id, sizeof(set->group_id));
+}
+
+
+static int CanIdSetCheck(const can_id_set *set) /* ID risolti come in CanIdUpdate, senza scriverli in can_dev */
+{
+	uint32_t rx_id[MSG_REC_NUM], id;
+	uint8_t i, j;
+
+	id = set->base;
+	for (i=0; i!=MSG_REC_NUM; i++) {
+		rx_id[i] = id;
+		if (CanIdReserved(id))
+			return -1;
+		id += set->rec_offset;
+	}
+
+	id = set->base_send;
+	for (i=0; i!=MSG_SEND_NUM; i++) {
+		if (CanIdReserved(id))
+			return -1;
+		id += set->send_offset;
+	}
+
+	for (i=0; i!=CAN_GROUP_NUM; i++) {
+		if (set->group_id[i] == 0)
+			continue;
+		if (CanIdReserved(set->group_id[i]))
+			return -1;
+		for (j=0; j!=MSG_REC_NUM; j++) {
+			if (rx_id[j] == set->group_id[i])
+				return -1;
 		}
 	}
+
+	return 0;
+}
+
+
+static int CanIdCheck(void) /* verifica sugli ID attivi */
+{
+	can_id_set set;
+
+	CanIdSetGet(&set);
+
+	return CanIdSetCheck(&set);
+}
+
+
+static void CanCfgFrame(uint16_t opc, const uint8_t *buf, uint8_t n) /* risposta sull'ID di configurazione, n <= 6 byte dopo l'opcode */
+{
+	CAN_TxHeaderTypeDef header = {0};
+	uint8_t data[8] = {0};
+
+	header.StdId = 0x00;
+	header.ExtId = can_dev.cfg_id;
+	header.IDE = CAN_ID_EXT;
+	header.RTR = CAN_RTR_DATA;
+	header.TransmitGlobalTime = DISABLE;
+	header.DLC = 2 + n;
+
+	data[0] = opc & 0x00FF;
+	data[1] = (opc>>8) & 0x00FF;
+	memcpy(&data[2], buf, n);
+	CanTxQueuePush(&header, data);
+}
+
+
+static void CanEeJobExec(const can_ee_job *job)
+{
+	uint32_t t;
+
+	switch (job->type) {
+	case CAN_EE_WRITE:
+		t = CanTimestamp();
+		FLASH_Unlock();
+		EE_WriteVariable(job->addr, job->val);
+		FLASH_Lock();
+		can_dev.ee_stall = CanTimestamp() - t;
+		if (can_dev.ee_stall > can_dev.ee_stall_max)
+			can_dev.ee_stall_max = can_dev.ee_stall;
+		break;
+
+	case CAN_EE_LOAD:
+		CanParamsLoad(); /* con la verifica degli ID (CanIdLoad) */
+		break;
+
+	case CAN_EE_ACK:
+		CanCfgFrame(job->addr, (const uint8_t *)&job->val, job->n);
+		break;
+
+	case CAN_EE_REINIT:
+		can_dev.reinit_req = 1;
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/* esecuzione ed estrazione del lavoro piu' vecchio */
+static void CanEeJobPop(void)
+{
+	CanEeJobExec(&can_dev.ee_job[can_dev.ee_job_out]);
+	can_dev.ee_job_out = (can_dev.ee_job_out + 1) % CAN_EE_JOB_NUM;
+	can_dev.ee_job_num--;
+}
+
+
+/* esecuzione dei salvataggi in coda: al massimo una scrittura in flash per passo del main loop.
+   Una scrittura che trova la pagina piena esegue comunque il trasferimento di pagina (EE_PageTransfer) nello stesso passo:
+   lo stallo resta visibile in ee_stall_max */
+static void CanEeTask(void)
+{
+	uint8_t type;
+
+	while (can_dev.ee_job_num != 0) {
+		type = can_dev.ee_job[can_dev.ee_job_out].type;
+		if (type == CAN_EE_ACK && can_dev.tx_queue_num == CAN_TX_QUEUE)
+			return; /* conferma al prossimo passo */
+		CanEeJobPop();
+		if (type == CAN_EE_WRITE)
+			return;
+	}
+}
+
+
+static void CanSegFc(uint8_t fs, uint8_t bs)
+{
+	uint8_t buf[2];
+
+	buf[0] = bs;
+	buf[1] = 0; /* STmin */
+	CanCfgFrame(MSG_OPC_SEG_FC | fs, buf, 2);
+}
+
+
+/* serializzazione di un oggetto in buf, ritorna la lunghezza o -1 */
+static int CanSegObjRead(uint8_t obj, uint8_t *buf)
+{
+	app_btl *share_app = (app_btl *)APP_BTL_SHARE_ADDR;
+	uint16_t val[3];
+	uint8_t i, n;
+
+	n = 0;
+	switch (obj) {
+	case CAN_SEG_OBJ_PARAMS:
+		for (i=0; i!=CAN_PARAM_NUM; i++) {
+			if (EE_ReadVariable(can_param_tab[i], &val[0]) != 0)
+				val[0] = 0xFFFF;
+			buf[n++] = val[0] & 0x00FF;
+			buf[n++] = (val[0]>>8) & 0x00FF;
+		}
+		break;
+
+	case CAN_SEG_OBJ_VERSION:
+		memset(buf, 0, 34);
+		buf[0] = VER_CODE & 0x00FF;
+		buf[1] = (VER_CODE>>8) & 0x00FF;
+		buf[2] = VER_MAJ;
+		buf[4] = VER_MIN;
+		buf[6] = VER_PATCH;
+		if (share_app->head_code == APP_BTL_HEAD_CODE && *(&(share_app->head_code)+share_app->offset) == APP_BTL_TAIL_CODE) {
+			memcpy(&buf[8], &share_app->btl_v_maj, 2);
+			memcpy(&buf[10], &share_app->btl_v_min, 2);
+			memcpy(&buf[12], &share_app->btl_v_patch, 2);
+			memcpy(&buf[14], share_app->brd_name, sizeof(share_app->brd_name));
+		}
+		else {
+			memcpy(&buf[14], "HW.dev", 6);
+		}
+		n = 34;
+		break;
+
+	case CAN_SEG_OBJ_DIAG:
+		for (i=0; i!=MSG_DIAG_PAGE_NUM; i++) {
+			CanDiagPage(i, val);
+			memcpy(&buf[n], val, sizeof(val));
+			n += sizeof(val);
+		}
+		break;
+
+	case CAN_SEG_OBJ_CMD:
+		for (i=0; i!=CAN_CMD_NUM; i++) {
+			val[0] = CanCyclesToUs(can_dev.cmd_cycles_max[i]);
+			buf[n++] = val[0] & 0x00FF;
+			buf[n++] = (val[0]>>8) & 0x00FF;
+		}
+		break;
+
+	default:
+		return -1;
+	}
+
+	return n;
+}
+
+
+/* valore a 32bit di una coppia di parametri (addr_h, addr_l) dell'oggetto CAN_SEG_OBJ_PARAMS: le parti a 0xFFFF restano quelle di cur */
+static uint32_t CanParamPair(const uint8_t *buf, uint16_t addr_h, uint16_t addr_l, uint32_t cur)
+{
+	uint16_t val;
+	uint8_t i;
+
+	for (i=0; i!=CAN_PARAM_NUM; i++) {
+		val = buf[2*i] | (buf[2*i + 1]<<8);
+		if (val == 0xFFFF)
+			continue;
+		if (can_param_tab[i] == addr_h)
+			cur = (cur & 0x0000FFFF) | ((uint32_t)val<<16);
+		else if (can_param_tab[i] == addr_l)
+			cur = (cur & 0xFFFF0000) | val;
+	}
+
+	return cur;
+}
+
+
+/* verifica degli ID risultanti dall'oggetto CAN_SEG_OBJ_PARAMS, senza modificare quelli attivi */
+static int CanParamIdCheck(const uint8_t *buf)
+{
+	can_id_set set;
+	uint8_t i;
+
+	CanIdSetGet(&set);
+	set.base = CanParamPair(buf, FLASH_ADDR_CANID_H, FLASH_ADDR_CANID_L, set.base);
+	set.base_send = CanParamPair(buf, FLASH_ADDR_CANID_SEND_H, FLASH_ADDR_CANID_SEND_L, set.base_send);
+	set.rec_offset = CanParamPair(buf, FLASH_ADDR_CANID_REC_OFFS_H, FLASH_ADDR_CANID_REC_OFFS_L, set.rec_offset);
+	set.send_offset = CanParamPair(buf, FLASH_ADDR_CANID_SEND_OFFS_H, FLASH_ADDR_CANID_SEND_OFFS_L, set.send_offset);
+	for (i=0; i!=CAN_GROUP_NUM; i++)
+		set.group_id[i] = CanParamPair(buf, FLASH_ADDR_GROUP_0_H + 2*i, FLASH_ADDR_GROUP_0_L + 2*i, set.group_id[i]);
+
+	return CanIdSetCheck(&set);
+}
+
+
+/* applicazione di un oggetto ricevuto: solo CAN_SEG_OBJ_PARAMS, verificato prima di accodare i salvataggi */
+static int CanSegObjWrite(uint8_t obj, const uint8_t *buf, uint8_t len)
+{
+	uint16_t val;
+	uint8_t i;
+
+	if (obj != CAN_SEG_OBJ_PARAMS || len != CAN_PARAM_NUM*2)
+		return -1;
+
+	val = buf[0] | (buf[1]<<8); /* FLASH_ADDR_SPEED_ID */
+	if (val != 0xFFFF && val >= CAN_SPEED_NONE && val != CAN_SPEED_AUTO)
+		return -1;
+
+	/* ID in conflitto: rifiutati qui, altrimenti resterebbero in e2prom */
+	if (CanParamIdCheck(buf) != 0)
+		return -1;
+
+	for (i=0; i!=CAN_PARAM_NUM; i++) {
+		val = buf[2*i] | (buf[2*i + 1]<<8);
+		if (val != 0xFFFF)
+			CanEeWrite(can_param_tab[i], val);
+	}
+
+	/* rilettura a scritture concluse, nuovi parametri attivi dopo l'invio della conferma */
+	CanEePost(CAN_EE_LOAD, 0, 0, 0);
+
+	return 0;
+}
+
+
+/* attivazione dei valori in attesa: una sola verifica e una sola re-inizializzazione.
+   Le variabili sono salvate una alla volta (CanEeTask), racchiuse tra FLASH_ADDR_CANID_GEN e
+   FLASH_ADDR_CANID_COMMIT con la stessa generazione: uno spegnimento a meta' lascia i due marcatori
+   diversi e CanIdLoad scarta l'insieme */
+static int CanStageCommit(void)
+{
+	can_id_set set;
+
+	if (can_dev.stage_mask == 0)
+		return -1;
+
+	CanIdSetGet(&set);
+	if (can_dev.stage_mask & CAN_STAGE_BASE)
+		set.base = can_dev.stage_base;
+	if (can_dev.stage_mask & CAN_STAGE_BASE_SEND)
+		set.base_send = can_dev.stage_base_send;
+	else if (set.base_send == 0)
+		set.base_send = set.base;
+	if (can_dev.stage_mask & CAN_STAGE_OFFSET)
+		set.rec_offset = set.send_offset = can_dev.stage_offset;
+	can_dev.stage_mask = 0;
+
+	/* controllo che non si utilizzi l'ID di configurazione */
+	if (CanIdSetCheck(&set) != 0)
+		return -1;
+
+	/* scrittura dei soli valori modificati */
+	can_dev.id_gen++;
+	CanEeWrite(FLASH_ADDR_CANID_GEN, can_dev.id_gen);
+	if (set.base != can_dev.base) {
+		CanEeWrite(FLASH_ADDR_CANID_H, ((set.base>>16) & 0x0000FFFF));
+		CanEeWrite(FLASH_ADDR_CANID_L, (set.base & 0x0000FFFF));
+	}
+	if (set.base_send != can_dev.base_send) {
+		CanEeWrite(FLASH_ADDR_CANID_SEND_H, ((set.base_send>>16) & 0x0000FFFF));
+		CanEeWrite(FLASH_ADDR_CANID_SEND_L, (set.base_send & 0x0000FFFF));
+	}
+	if (set.rec_offset != can_dev.rec_offset || set.send_offset != can_dev.send_offset) {
+		CanEeWrite(FLASH_ADDR_CANID_SEND_OFFS_H, ((set.send_offset>>16) & 0x0000FFFF));
+		CanEeWrite(FLASH_ADDR_CANID_SEND_OFFS_L, (set.send_offset & 0x0000FFFF));
+		CanEeWrite(FLASH_ADDR_CANID_REC_OFFS_H, ((set.rec_offset>>16) & 0x0000FFFF));
+		CanEeWrite(FLASH_ADDR_CANID_REC_OFFS_L, (set.rec_offset & 0x0000FFFF));
+	}
+	CanEeWrite(FLASH_ADDR_CANID_COMMIT, can_dev.id_gen);
+
+	can_dev.base = set.base;
+	can_dev.base_send = set.base_send;
+	can_dev.rec_offset = set.rec_offset;
+	can_dev.send_offset = set.send_offset;
+	CanIdUpdate();
+
+	return 0;
+}
+
+
+/* frame del trasporto segmentato ricevuto sull'ID di configurazione */
+static void CanSegRx(const msg_can_rx *msg)
+{
+	can_seg *seg = &can_dev.seg;
+	uint16_t opc;
+	uint8_t n, ff[6];
+	int res;
+	int len;
+
+	opc = msg->data[0] | (msg->data[1]<<8);
+	seg->t = HAL_GetTick();
+
+	if (opc == MSG_OPC_SEG_READ && msg->header.DLC >= 3) {
+		len = CanSegObjRead(msg->data[2], seg->buf);
+		if (len < 0) {
+			seg->state = CAN_SEG_IDLE;
+			CanSegFc(CAN_SEG_FS_ABORT, 0);
+			return;
+		}
+		seg->obj = msg->data[2];
+		seg->len = len;
+		seg->pos = len < 4 ? len : 4;
+		seg->sn = 1;
+		ff[0] = seg->obj;
+		ff[1] = seg->len;
+		memcpy(&ff[2], seg->buf, seg->pos);
+		CanCfgFrame(MSG_OPC_SEG_FF_READ, ff, 2 + seg->pos);
+		seg->state = seg->pos < seg->len ? CAN_SEG_TX_WAIT_FC : CAN_SEG_IDLE;
+	}
+	else if (opc == MSG_OPC_SEG_FF_WRITE && msg->header.DLC >= 4) {
+		seg->obj = msg->data[2];
+		seg->len = msg->data[3];
+		if (seg->len > CAN_SEG_BUF || (seg->len > 4 && msg->header.DLC != 8) || (seg->len <= 4 && msg->header.DLC < (uint32_t)(4 + seg->len))) {
+			seg->state = CAN_SEG_IDLE;
+			CanSegFc(CAN_SEG_FS_ABORT, 0);
+			return;
+		}
+		seg->pos = seg->len < 4 ? seg->len : 4;
+		memcpy(seg->buf, &msg->data[4], seg->pos);
+		seg->sn = 1;
+		if (seg->pos == seg->len) {
+			seg->state = CAN_SEG_IDLE;
+			res = CanSegObjWrite(seg->obj, seg->buf, seg->len);
+			if (res == 0) {
+				CanEeAck(MSG_OPC_SEG_FC | CAN_SEG_FS_DONE, 0, 2);
+				CanEePost(CAN_EE_REINIT, 0, 0, 0);
+			}
+			else {
+				CanSegFc(CAN_SEG_FS_ABORT, 0);
+			}
+		}
+		else {
+			seg->state = CAN_SEG_RX;
+			seg->bs_cnt = CAN_SEG_BS;
+			CanSegFc(CAN_SEG_FS_CTS, CAN_SEG_BS);
+		}
+	}
+	else if ((opc & MSG_OPC_SEG_MASK) == MSG_OPC_SEG_CF && seg->state == CAN_SEG_RX) {
+		if ((opc & 0x000F) != (seg->sn & 0x0F) || msg->header.DLC < 3) {
+			seg->state = CAN_SEG_IDLE;
+			CanSegFc(CAN_SEG_FS_ABORT, 0);
+			return;
+		}
+		n = seg->len - seg->pos;
+		if (n > 6)
+			n = 6;
+		if (n > msg->header.DLC - 2)
+			n = msg->header.DLC - 2;
+		memcpy(&seg->buf[seg->pos], &msg->data[2], n);
+		seg->pos += n;
+		seg->sn++;
+		if (seg->pos == seg->len) {
+			seg->state = CAN_SEG_IDLE;
+			res = CanSegObjWrite(seg->obj, seg->buf, seg->len);
+			if (res == 0) {
+				CanEeAck(MSG_OPC_SEG_FC | CAN_SEG_FS_DONE, 0, 2);
+				CanEePost(CAN_EE_REINIT, 0, 0, 0);
+			}
+			else {
+				CanSegFc(CAN_SEG_FS_ABORT, 0);
+			}
+		}
+		else if (--seg->bs_cnt == 0) {
+			seg->bs_cnt = CAN_SEG_BS;
+			CanSegFc(CAN_SEG_FS_CTS, CAN_SEG_BS);
+		}
+	}
+	else if ((opc & MSG_OPC_SEG_MASK) == MSG_OPC_SEG_FC && seg->state == CAN_SEG_TX_WAIT_FC && msg->header.DLC >= 4) {
+		switch (opc & 0x000F) {
+		case CAN_SEG_FS_CTS:
+			seg->bs = seg->bs_cnt = msg->data[2];
+			seg->st_min = msg->data[3];
+			seg->state = CAN_SEG_TX;
+			seg->t -= seg->st_min; /* primo consecutive frame subito */
+			break;
+
+		case CAN_SEG_FS_WAIT:
+			break;
+
+		default:
+			seg->state = CAN_SEG_IDLE;
+			break;
+		}
+	}
+}
+
+
+/* invio dei consecutive frame in lettura e timeout della sessione: ad ogni passo del manager */
+static void CanSegTask(void)
+{
+	can_seg *seg = &can_dev.seg;
+	uint32_t now;
+	uint8_t n;
+
+	if (seg->state == CAN_SEG_IDLE)
+		return;
+
+	now = HAL_GetTick();
+	if (seg->state != CAN_SEG_TX) {
+		if (now - seg->t >= CAN_SEG_TO)
+			seg->state = CAN_SEG_IDLE;
+		return;
+	}
+
+	while (can_dev.tx_queue_num != CAN_TX_QUEUE && now - seg->t >= seg->st_min) {
+		n = seg->len - seg->pos;
+		if (n > 6)
+			n = 6;
+		CanCfgFrame(MSG_OPC_SEG_CF | (seg->sn & 0x0F), &seg->buf[seg->pos], n);
+		seg->pos += n;
+		seg->sn++;
+		seg->t = now;
+		if (seg->pos == seg->len) {
+			seg->state = CAN_SEG_IDLE;
+			break;
+		}
+		if (seg->bs != 0 && --seg->bs_cnt == 0) {
+			seg->state = CAN_SEG_TX_WAIT_FC;
+			break;
+		}
+		if (seg->st_min != 0)
+			break;
+	}
+}
+
+
+/* risposta LSS: uguale per tutti i nodi, le risposte simultanee si sovrappongono sul bus senza conflitti */
+static void CanLssIdentify(void)
+{
+	CAN_TxHeaderTypeDef header = {0};
+	uint8_t data[8] = {0};
+
+	header.ExtId = CAN_LSS_RSP_ID;
+	header.IDE = CAN_ID_EXT;
+	header.RTR = CAN_RTR_DATA;
+	header.DLC = 8;
+	header.TransmitGlobalTime = DISABLE;
+	data[0] = CAN_LSS_CS_IDENTIFY;
+	CanTxQueuePush(&header, data);
+}
+
+
+/* fastscan: il master ricostruisce l'UID bit per bit, rispondono i nodi non configurati
+   con i bit da 31 a BitChecked della parola LSSSub uguali a IDNumber */
+static void CanLssRx(const msg_can_rx *msg)
+{
+	uint32_t id, mask;
+	uint8_t bit, sub, next;
+
+	if (msg->header.DLC != 8)
+		return;
+
+	can_dev.lss_t = HAL_GetTick();
+	if (msg->data[0] == CAN_LSS_CS_SWITCH_GLOBAL) {
+		can_dev.lss_active = msg->data[1] != 0;
+		can_dev.lss_selected = 0;
+		return;
+	}
+	if (msg->data[0] != CAN_LSS_CS_FASTSCAN)
+		return;
+
+	can_dev.lss_active = 1;
+	bit = msg->data[5];
+	if (bit == CAN_LSS_BIT_RESET) {
+		can_dev.lss_selected = 0;
+		can_dev.lss_pos = 0;
+		if (can_dev.base == 0)
+			CanLssIdentify();
+		return;
+	}
+
+	sub = msg->data[6];
+	next = msg->data[7];
+	if (can_dev.base != 0 || can_dev.lss_selected || bit > 31 || sub != can_dev.lss_pos || next >= CAN_LSS_SUB_NUM)
+		return;
+
+	id = msg->data[1] | (msg->data[2] << 8) | (msg->data[3] << 16) | ((uint32_t)msg->data[4] << 24);
+	mask = 0xFFFFFFFF << bit;
+	if (((can_dev.uid[sub] ^ id) & mask) != 0)
+		return;
+
+	CanLssIdentify();
+	if (bit == 0) { /* parola completa */
+		can_dev.lss_pos = next;
+		if (next <= sub) /* UID completo: il nodo e' selezionato */
+			can_dev.lss_selected = 1;
+	}
+}
+
+
+/* master scomparso senza SWITCH_GLOBAL 0: fine della sessione, tutti i nodi accettano di nuovo la configurazione */
+static void CanLssTask(void)
+{
+	if (can_dev.lss_active && HAL_GetTick() - can_dev.lss_t >= CAN_LSS_TO) {
+		can_dev.lss_active = 0;
+		can_dev.lss_selected = 0;
+	}
+}
+
+
+/* comando alle uscite (MSG_OUT_ENABLE e MSG_GROUP) */
+static void CanOutSet(const msg_can_rx *msg, machine_status *machine, uint8_t enable_power, uint8_t switch_on)
+{
+	/* il timeout decorre dalla ricezione: l'attesa in coda e' gia' trascorsa */
+	MachineCmdRefresh(enable_power || switch_on, (CanTimestamp() - msg->ts) / (SystemCoreClock / 1000));
+	machine->error_cmd_timeout = 0;
+
+	if (enable_power) {
+		machine->enable_power = 1;
+		/* reset degli errori */
+		machine->error_overcurrent = 0;
+		machine->error_th = 0;
+	}
+	else {
+		machine->enable_power = 0;
+	}
+	if (switch_on) {
+		machine->switch_on = 1;
+	}
+	else {
+		machine->switch_on = 0;
+	}
+	/* aggiornamento immediato delle uscite senza attendere il ciclo da 10ms */
+	MachineOutputUpdate(machine);
+	can_dev.out_en_lat = CanTimestamp() - msg->ts;
+	if (can_dev.out_en_lat > can_dev.out_en_lat_max)
+		can_dev.out_en_lat_max = can_dev.out_en_lat;
+	can_dev.periodic_en = 1;
+}
+
+
+/* gestori dei comandi: ritornano 1 se il comando conferma una velocita' appena cambiata (speed_save);
+   le request ricevute in configurazione confermano comunque (CanCommandExec) */
+
+static uint8_t CanCmdCfgRtr(const msg_can_rx *msg, machine_status *machine) /* richiesta configurazione CANID, a rotazione */
+{
+	switch (can_dev.cfg_rtr_resp) {
+	default:
+		can_dev.cfg_rtr_resp = 0;
+		/* NON METTERE IL BREAK! */
+	case 0:
+		CanSendCfgData(MSG_OPC_CANID_REC);
+		can_dev.cfg_rtr_resp++;
+		break;
+
+	case 1:
+		CanSendCfgData(MSG_OPC_CANID_SEND);
+		can_dev.cfg_rtr_resp++;
+		break;
+
+	case 2:
+		CanSendCfgData(MSG_OPC_CANID_OFFSET);
+		can_dev.cfg_rtr_resp = 0;
+		break;
+	}
+
+	return 1;
+}
+
+
+static uint8_t CanCmdCanIdRec(const msg_can_rx *msg, machine_status *machine)
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+	uint32_t tmp;
+
+	/* configurazione CANID */
+	can_dev.base = cmd[2];
+	can_dev.base = (can_dev.base<<16) | cmd[1];
+	/* controllo che non si utilizzi l'ID di configurazione */
+	tmp = can_dev.base_send;
+	if (can_dev.base_send == 0) {
+		can_dev.base_send = can_dev.base;
+	}
+	CanIdUpdate();
+	if (CanIdCheck() != 0) {
+		can_dev.base = 0;
+		can_dev.base_send = tmp;
+		CanIdUpdate();
+	}
+	/* scrittura indirizzo CAN */
+	CanEeWrite(FLASH_ADDR_CANID_H, ((can_dev.base>>16) & 0x0000FFFF));
+	CanEeWrite(FLASH_ADDR_CANID_L, (can_dev.base & 0x0000FFFF));
+	if (tmp == 0) {
+		CanEeWrite(FLASH_ADDR_CANID_SEND_H, ((can_dev.base_send>>16) & 0x0000FFFF));
+		CanEeWrite(FLASH_ADDR_CANID_SEND_L, (can_dev.base_send & 0x0000FFFF));
+	}
+	CanReInit();
+
+	return 1;
+}
+
+
+static uint8_t CanCmdCanIdSend(const msg_can_rx *msg, machine_status *machine)
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+
+	/* configurazione CANID SEND */
+	can_dev.base_send = cmd[2];
+	can_dev.base_send = (can_dev.base_send<<16) | cmd[1];
+	/* controllo che non si utilizzi l'ID di configurazione */
+	CanIdUpdate();
+	if (CanIdCheck() != 0) {
+		can_dev.base_send = can_dev.base;
+		CanIdUpdate();
+	}
+	/* scrittura indirizzo CAN */
+	CanEeWrite(FLASH_ADDR_CANID_SEND_H, ((can_dev.base_send>>16) & 0x0000FFFF));
+	CanEeWrite(FLASH_ADDR_CANID_SEND_L, (can_dev.base_send & 0x0000FFFF));
+	CanReInit();
+
+	return 1;
+}
+
+
+static uint8_t CanCmdCanIdOffset(const msg_can_rx *msg, machine_status *machine)
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+
+	/* configurazione CANID OFFSET */
+	can_dev.rec_offset = cmd[2];
+	can_dev.rec_offset = (can_dev.rec_offset<<16) | cmd[1];
+	/* controllo che non si utilizzi l'ID di configurazione */
+	CanIdUpdate();
+	if (CanIdCheck() != 0) {
+		can_dev.rec_offset = 1;
+		CanIdUpdate();
+	}
+	/* scrittura indirizzo CAN */
+	CanEeWrite(FLASH_ADDR_CANID_SEND_OFFS_H, ((can_dev.rec_offset>>16) & 0x0000FFFF));
+	CanEeWrite(FLASH_ADDR_CANID_SEND_OFFS_L, (can_dev.rec_offset & 0x0000FFFF));
+	CanEeWrite(FLASH_ADDR_CANID_REC_OFFS_H, ((can_dev.rec_offset>>16) & 0x0000FFFF));
+	CanEeWrite(FLASH_ADDR_CANID_REC_OFFS_L, (can_dev.rec_offset & 0x0000FFFF));
+	can_dev.send_offset = can_dev.rec_offset;
+	CanReInit();
+
+	return 1;
+}
+
+
+static uint8_t CanCmdMonMode(const msg_can_rx *msg, machine_status *machine) /* modalita' di invio di MSG_MON_INFO */
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+
+	if ((cmd[1] & MSG_MON_MODE_MASK) > MSG_MON_MODE_CHANGE)
+		return 0;
+
+	can_dev.mon_dead_t = cmd[1] >> 8;
+	can_dev.mon_dead_i = cmd[2];
+	CanMonModeSet(cmd[1] & 0xFF);
+	CanEeWrite(FLASH_ADDR_MON_MODE, cmd[1]);
+	CanEeWrite(FLASH_ADDR_MON_DEAD_I, cmd[2]);
+
+	return 1;
+}
+
+
+static uint8_t CanCmdMonStat(const msg_can_rx *msg, machine_status *machine) /* periodo di MSG_MON_STAT */
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+
+	if (cmd[1] != 0 && cmd[1] < MSG_PERIOD_MIN)
+		return 0;
+
+	CanPeriodicSet(MSG_MON_STAT, cmd[1]);
+	CanEeWrite(FLASH_ADDR_MON_STAT_PERIOD, cmd[1]);
+
+	return 1;
+}
+
+
+static uint8_t CanCmdTimeout(const msg_can_rx *msg, machine_status *machine) /* supervisione dei comandi */
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+
+	MachineCmdTimeoutSet(cmd[1]);
+	CanEeWrite(FLASH_ADDR_CMD_TIMEOUT, cmd[1]);
+
+	return 1;
+}
+
+
+static uint8_t CanCmdVeloc(const msg_can_rx *msg, machine_status *machine) /* cambio velocita' */
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+
+	if (can_dev.speed == cmd[1])
+		return 1; /* velocita' gia' attiva: conferma di un cambio in attesa */
+
+	can_dev.speed_save = 1; /* salvataggio al primo comando ricevuto alla nuova velocita' */
+	if (cmd[1] < CAN_SPEED_NONE) {
+		can_dev.speed = cmd[1];
+		CanSpeedInit(can_dev.speed);
+	}
+	else if (cmd[1] == CAN_SPEED_AUTO) {
+		can_dev.speed_save = 0;
+		CanEeWrite(FLASH_ADDR_SPEED_ID, CAN_SPEED_AUTO);
+		CanAutoBaudStart();
+	}
+
+	return 0;
+}
+
+
+static uint8_t CanCmdStage(const msg_can_rx *msg, machine_status *machine) /* configurazione in attesa di commit */
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+	uint32_t tmp;
+
+	tmp = cmd[2];
+	tmp = (tmp<<16) | cmd[1];
+	switch (cmd[0] & ~MSG_OPC_STAGE) {
+	case MSG_OPC_CANID_REC:
+		can_dev.stage_base = tmp;
+		can_dev.stage_mask |= CAN_STAGE_BASE;
+		break;
+
+	case MSG_OPC_CANID_SEND:
+		can_dev.stage_base_send = tmp;
+		can_dev.stage_mask |= CAN_STAGE_BASE_SEND;
+		break;
+
+	default:
+		can_dev.stage_offset = tmp;
+		can_dev.stage_mask |= CAN_STAGE_OFFSET;
+		break;
+	}
+
+	return 1;
+}
+
+
+static uint8_t CanCmdStageCommit(const msg_can_rx *msg, machine_status *machine)
+{
+	uint8_t res;
+
+	res = CanStageCommit() == 0 ? 0 : 1;
+	CanEeAck(MSG_OPC_STAGE_COMMIT, res, 1);
+	if (res == 0)
+		CanEePost(CAN_EE_REINIT, 0, 0, 0); /* nuovi ID attivi dopo l'invio della conferma */
+
+	return 1;
+}
+
+
+static uint8_t CanCmdStageAbort(const msg_can_rx *msg, machine_status *machine)
+{
+	can_dev.stage_mask = 0;
+
+	return 0;
+}
+
+
+static uint8_t CanCmdParamRead(const msg_can_rx *msg, machine_status *machine) /* lettura indirizzata di un parametro */
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+	uint16_t can_data[4] = {0};
+	uint8_t *data = (uint8_t *)can_data;
+	CAN_TxHeaderTypeDef header = {0};
+	uint32_t val;
+
+	header.StdId = 0x00;
+	header.ExtId = can_dev.cfg_id;
+	header.IDE = CAN_ID_EXT;
+	header.RTR = CAN_RTR_DATA;
+	header.TransmitGlobalTime = DISABLE;
+
+	can_data[0] = MSG_OPC_PARAM_READ;
+	if (CanParamGet(cmd[1], &val) == 0) {
+		header.DLC = 8;
+		can_data[1] = cmd[1];
+		data[4] = val & 0x000000FF;
+		data[5] = (val>>8) & 0x000000FF;
+		data[6] = (val>>16) & 0x000000FF;
+		data[7] = (val>>24) & 0x000000FF;
+	}
+	else {
+		header.DLC = 4;
+		can_data[1] = cmd[1] | CAN_PAR_ERR;
+	}
+	CanTxQueuePush(&header, data);
+
+	return 1;
+}
+
+
+static uint8_t CanCmdSeg(const msg_can_rx *msg, machine_status *machine) /* trasporto segmentato */
+{
+	CanSegRx(msg);
+
+	return 0;
+}
+
+
+static uint8_t CanCmdBootloader(const msg_can_rx *msg, machine_status *machine)
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+	app_btl *share_app = (app_btl *)APP_BTL_SHARE_ADDR;
+
+	if (cmd[1] == HW_CHECK_0 && cmd[2] == HW_CHECK_2) {
+		if (share_app->head_code == APP_BTL_HEAD_CODE && *(&(share_app->head_code)+share_app->offset) == APP_BTL_TAIL_CODE) {
+			machine->bootloader = 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static uint8_t CanCmdHwVer(const msg_can_rx *msg, machine_status *machine) /* richiesta versione HW */
+{
+	char hw_ver[25]; /* dim di app_btl brd_name */
+	msg_can_tx tx_msg;
+	app_btl *share_app = (app_btl *)APP_BTL_SHARE_ADDR;
+
+	/* invio risposta */
+	memset(&tx_msg, 0, sizeof(msg_can_tx));
+	tx_msg.header.StdId = 0x00;
+	tx_msg.header.ExtId = can_dev.rx_id[MSG_HW_VER];
+	tx_msg.header.IDE = CAN_ID_EXT;
+	tx_msg.header.RTR = CAN_RTR_DATA;
+	tx_msg.header.TransmitGlobalTime = DISABLE;
+
+	tx_msg.header.DLC = 8;
+	memset(tx_msg.data, '\0', 8);
+
+	memset(hw_ver, '\0', sizeof(hw_ver));
+	if (share_app->head_code == APP_BTL_HEAD_CODE && *(&(share_app->head_code)+share_app->offset) == APP_BTL_TAIL_CODE) {
+		sprintf(hw_ver, (char *)share_app->brd_name);
+	}
+	else {
+		sprintf(hw_ver, "HW.dev");
+	}
+	memcpy(tx_msg.data, hw_ver, 8);
+
+	CanTxQueuePush(&tx_msg.header, tx_msg.data);
+
+	return 0;
+}
+
+
+static uint8_t CanCmdFwVer(const msg_can_rx *msg, machine_status *machine) /* richiesta versione FW */
+{
+	msg_can_tx tx_msg;
+	uint16_t *cmd;
+
+	/* invio risposta */
+	memset(&tx_msg, 0, sizeof(msg_can_tx));
+	tx_msg.header.StdId = 0x00;
+	tx_msg.header.ExtId = can_dev.rx_id[MSG_FW_VER];
+	tx_msg.header.IDE = CAN_ID_EXT;
+	tx_msg.header.RTR = CAN_RTR_DATA;
+	tx_msg.header.TransmitGlobalTime = DISABLE;
+
+	tx_msg.header.DLC = 8;
+	cmd = (uint16_t *)tx_msg.data;
+	cmd[0] = VER_CODE;
+	cmd[1] = VER_MAJ;
+	cmd[2] = VER_MIN;
+	cmd[3] = VER_PATCH;
+	CanTxQueuePush(&tx_msg.header, tx_msg.data);
+
+	return 0;
+}
+
+
+static uint8_t CanCmdCfgStatus(const msg_can_rx *msg, machine_status *machine)
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+
+	if (cmd[0] >= MSG_PERIOD_MIN || cmd[0] == 0)
+		CanPeriodicSet(MSG_MON_INFO, cmd[0]);
+	can_dev.periodic_en = 1;
+
+	return 1;
 }
 
 
-static void CanSendCfgData(uint8_t cmd_id)
+static uint8_t CanCmdOutEnable(const msg_can_rx *msg, machine_status *machine)
 {
-	uint16_t can_data[5] = {0};
-	uint8_t *data = (uint8_t *)can_data;
-	uint8_t send = 1;
-	uint32_t mbx;
-	CAN_TxHeaderTypeDef header = {0};
+	const uint16_t *cmd = (const uint16_t *)msg->data;
 
-	header.StdId = 0x00;
-	header.ExtId = can_dev.cfg_id;
-	header.IDE = CAN_ID_EXT;
-	header.RTR = CAN_RTR_DATA;
-	header.TransmitGlobalTime = DISABLE;
+	CanOutSet(msg, machine, cmd[0] & 0x0001, cmd[1] & 0x0001);
 
-	data[0] = cmd_id & 0x000000FF;
-	data[1] = (cmd_id>>8) & 0x000000FF;
+	return 1;
+}
 
-	switch (cmd_id) {
-	case MSG_OPC_CANID_REC:
-		header.DLC = 6;
-		data[2] = can_dev.base & 0x000000FF;
-		data[3] = (can_dev.base>>8) & 0x000000FF;
-		data[4] = (can_dev.base>>16) & 0x000000FF;
-		data[5] = (can_dev.base>>24) & 0x000000FF;
-		break;
 
-	case MSG_OPC_CANID_SEND:
-		header.DLC = 6;
-		data[2] = can_dev.base_send & 0x000000FF;
-		data[3] = (can_dev.base_send>>8) & 0x000000FF;
-		data[4] = (can_dev.base_send>>16) & 0x000000FF;
-		data[5] = (can_dev.base_send>>24) & 0x000000FF;
-		break;
+static uint8_t CanCmdGroup(const msg_can_rx *msg, machine_status *machine) /* broadcast o gruppo: solo se il nodo e' selezionato */
+{
+	if (msg->header.DLC == 1 || (can_dev.node_idx <= CAN_NODE_IDX_MAX && can_dev.node_idx < (msg->header.DLC - 1)*8
+			&& (msg->data[1 + can_dev.node_idx/8] & (1 << (can_dev.node_idx%8))) != 0)) {
+		CanOutSet(msg, machine, msg->data[0] & 0x01, msg->data[0] & 0x02);
+	}
 
-	case MSG_OPC_CANID_OFFSET:
-		header.DLC = 6;
-		data[2] = can_dev.rec_offset & 0x000000FF;
-		data[3] = (can_dev.rec_offset>>8) & 0x000000FF;
-		data[4] = (can_dev.rec_offset>>16) & 0x000000FF;
-		data[5] = (can_dev.rec_offset>>24) & 0x000000FF;
-		break;
+	return 1;
+}
 
-	default:
-		send = 0;
-		break;
-	}
 
-	if (send) {
-		memcpy(&can_dev.tx_msg.header, &header, sizeof(CAN_TxHeaderTypeDef));
-		memcpy(can_dev.tx_msg.data, data, 8);
-		if (HAL_CAN_AddTxMessage(&hcan, &header, data, &mbx) != HAL_OK) {
-			can_dev.error_tot++;
-			can_dev.error_tx++;
-		}
-		else {
-			can_dev.send_en = 0;
-		}
-	}
+static uint8_t CanCmdSync(const msg_can_rx *msg, machine_status *machine) /* campionamento coerente */
+{
+	CanSyncLatch(msg, machine);
+
+	return 1;
 }
 
 
-static int CanIdCheck(void)
+static uint8_t CanCmdDiag(const msg_can_rx *msg, machine_status *machine) /* richiesta diagnostica sull'ID di configurazione */
 {
-	if (can_dev.base == can_dev.cfg_id ||
-		can_dev.base + can_dev.rec_offset*MSG_CFG_STATUS == can_dev.cfg_id ||
-		can_dev.base + can_dev.rec_offset*MSG_OUT_ENABLE == can_dev.cfg_id ||
-		can_dev.base + can_dev.rec_offset*MSG_CNG_VELOC == can_dev.cfg_id ||
-		can_dev.base + can_dev.rec_offset*MSG_HW_VER == can_dev.cfg_id ||
-		can_dev.base + can_dev.rec_offset*MSG_FW_VER == can_dev.cfg_id
-		) {
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+	uint32_t base;
 
-		return -1;
-	}
+	/* l'ID di configurazione e' comune: risponde solo il nodo indicato */
+	base = msg->data[4] | (msg->data[5] << 8) | (msg->data[6] << 16) | ((uint32_t)msg->data[7] << 24);
+	if (can_dev.base == 0 || base != can_dev.base)
+		return 0;
+	CanSendData(MSG_DIAG_INFO, machine, cmd[1]);
 
-	if (can_dev.base_send == can_dev.cfg_id ||
-		can_dev.base_send + can_dev.send_offset*MSG_CFG_STATUS == can_dev.cfg_id ||
-		can_dev.base_send + can_dev.send_offset*MSG_OUT_ENABLE == can_dev.cfg_id ||
-		can_dev.base_send + can_dev.send_offset*MSG_CNG_VELOC == can_dev.cfg_id ||
-		can_dev.base_send + can_dev.send_offset*MSG_HW_VER == can_dev.cfg_id ||
-		can_dev.base_send + can_dev.send_offset*MSG_FW_VER == can_dev.cfg_id
-		) {
+	return 1;
+}
 
-		return -1;
+
+static uint8_t CanCmdCngVeloc(const msg_can_rx *msg, machine_status *machine) /* cambio velocita' */
+{
+	const uint16_t *cmd = (const uint16_t *)msg->data;
+
+	if (can_dev.speed != cmd[0] && cmd[0] < CAN_SPEED_NONE) { /*  && cmd[0] >= CAN_SPEED_1M */
+		can_dev.speed_save = 1;
+		can_dev.speed = cmd[0];
+		CanSpeedInit(can_dev.speed); /* c'e' anche l'inizializzazione */
 	}
 
 	return 0;
 }
 
 
-static void CanCommandExec(msg_can_rx *msg, machine_status *machine)
+static uint8_t CanCmdLss(const msg_can_rx *msg, machine_status *machine)
 {
-	static uint8_t save_speed = 0; /* 0: nulla; 1: attesa conferma; */
-	int8_t save_speed_ack = 0; /* indica che e' arrivato un messaggio alla nuova vel (conferma cambio di vel) */
-	uint16_t *cmd, opc;
-	uint32_t mbx;
-	app_btl *share_app = (app_btl *)APP_BTL_SHARE_ADDR;
+	CanLssRx(msg);
 
-	cmd = (uint16_t *)msg->data;
-
-	/* se in configurazione */
-	if (can_dev.cfg_en) { /* elaborazione dei comandi di configurazione */
-		if (msg->header.RTR != CAN_RTR_DATA) { /* request */
-			save_speed_ack = 1;
-			if (msg->header.ExtId == can_dev.cfg_id) { /* richiesta configurazione CANID */
-				static uint8_t rtr_resp = 0; /* indica il dato da inviare alla prossima request */
-				switch (rtr_resp) {
-				default:
-					rtr_resp = 0;
-					/* NON METTERE IL BREAK! */
-				case 0:
-					CanSendCfgData(MSG_OPC_CANID_REC);
-					rtr_resp++;
-					break;
-
-				case 1:
-					CanSendCfgData(MSG_OPC_CANID_SEND);
-					rtr_resp++;
-					break;
-
-				case 2:
-					CanSendCfgData(MSG_OPC_CANID_OFFSET);
-					rtr_resp = 0;
-					break;
-				}
-			}
-		}
-		else if (msg->header.ExtId == can_dev.cfg_id) {
-			if (msg->header.DLC > 1) {
-				opc = cmd[0];
-				if (opc == MSG_OPC_CANID_REC && cmd[3] == HW_CHECK_3 && msg->header.DLC == 8) { /* configurazione CANID */
-					uint32_t tmp;
-					
-					save_speed_ack = 1;
-					/* configurazione CANID */
-					can_dev.base = cmd[2];
-					can_dev.base = (can_dev.base<<16) | cmd[1];
-					/* controllo che non si utilizzi l'ID di configurazione */
-					tmp = can_dev.base_send;
-					if (can_dev.base_send == 0) {
-						can_dev.base_send = can_dev.base;
-					}
-					if (CanIdCheck() != 0) {
-						can_dev.base = 0;
-						can_dev.base_send = tmp;
-					}
-					/* scrittura indirizzo CAN */
-					FLASH_Unlock();
-					EE_WriteVariable(FLASH_ADDR_CANID_H, ((can_dev.base>>16) & 0x0000FFFF));
-					EE_WriteVariable(FLASH_ADDR_CANID_L, (can_dev.base & 0x0000FFFF));
-					if (tmp == 0) {
-						EE_WriteVariable(FLASH_ADDR_CANID_SEND_H, ((can_dev.base_send>>16) & 0x0000FFFF));
-						EE_WriteVariable(FLASH_ADDR_CANID_SEND_L, (can_dev.base_send & 0x0000FFFF));
-					}
-					FLASH_Lock();
-					CanReInit();
-				}
-				else if (opc == MSG_OPC_CANID_SEND && cmd[3] == HW_CHECK_3 && msg->header.DLC == 8) { /* configurazione CANID SEND */
-					save_speed_ack = 1;
-					/* configurazione CANID SEND */
-					can_dev.base_send = cmd[2];
-					can_dev.base_send = (can_dev.base_send<<16) | cmd[1];
-					/* controllo che non si utilizzi l'ID di configurazione */
-					if (CanIdCheck() != 0)
-						can_dev.base_send = can_dev.base;
-					/* scrittura indirizzo CAN */
-					FLASH_Unlock();
-					EE_WriteVariable(FLASH_ADDR_CANID_SEND_H, ((can_dev.base_send>>16) & 0x0000FFFF));
-					EE_WriteVariable(FLASH_ADDR_CANID_SEND_L, (can_dev.base_send & 0x0000FFFF));
-					FLASH_Lock();
-					CanReInit();
-				}
-				else if (opc == MSG_OPC_CANID_OFFSET && cmd[3] == HW_CHECK_3 && msg->header.DLC == 8) { /* configurazione CANID OFFSET */
-					save_speed_ack = 1;
-					/* configurazione CANID OFFSET */
-					can_dev.rec_offset = cmd[2];
-					can_dev.rec_offset = (can_dev.rec_offset<<16) | cmd[1];
-					/* controllo che non si utilizzi l'ID di configurazione */
-					if (CanIdCheck() != 0)
-						can_dev.rec_offset = 1;
-					/* scrittura indirizzo CAN */
-					FLASH_Unlock();
-					EE_WriteVariable(FLASH_ADDR_CANID_SEND_OFFS_H, ((can_dev.rec_offset>>16) & 0x0000FFFF));
-					EE_WriteVariable(FLASH_ADDR_CANID_SEND_OFFS_L, (can_dev.rec_offset & 0x0000FFFF));
-					EE_WriteVariable(FLASH_ADDR_CANID_REC_OFFS_H, ((can_dev.rec_offset>>16) & 0x0000FFFF));
-					EE_WriteVariable(FLASH_ADDR_CANID_REC_OFFS_L, (can_dev.rec_offset & 0x0000FFFF));
-					FLASH_Lock();
-					can_dev.send_offset = can_dev.rec_offset;
-					CanReInit();
-				}
-				else if (opc == MSG_OPC_VELOC && cmd[2] == HW_CHECK_3 && msg->header.DLC == 6) { /* cambio velocita' */
-					if (can_dev.speed == cmd[1]) {
-						save_speed_ack = 1;
-					}
-					else {
-						save_speed = 1;
-						if (cmd[1] < CAN_SPEED_NONE) {
-							can_dev.speed = cmd[1];
-							CanSpeedInit(can_dev.speed);
-						}
-					}
-				}
-				else if (opc == MSG_OPC_BOOTLOADER && cmd[1] == HW_CHECK_0 && cmd[2] == HW_CHECK_2 && msg->header.DLC == 6) {
-					if (share_app->head_code == APP_BTL_HEAD_CODE && *(&(share_app->head_code)+share_app->offset) == APP_BTL_TAIL_CODE) {
-						machine->bootloader = 1;
-					}
-				}
-			}
-		}
-		if (save_speed_ack == 1 && save_speed == 1) {
-			save_speed = 0;
-			/* scrittura indirizzo CAN */
-			FLASH_Unlock();
-			EE_WriteVariable(FLASH_ADDR_SPEED_ID, can_dev.speed);
-			FLASH_Lock();
-		}
-	}
-
-	/* richieste generiche */
-	if (msg->header.RTR != CAN_RTR_DATA) { /* request */
-		if (msg->header.ExtId == can_dev.base + can_dev.rec_offset*MSG_HW_VER) { /* richiesta versione HW */
-			char hw_ver[25]; /* dim di app_btl brd_name */
-			
-			/* invio risposta */
-			memset(&can_dev.tx_msg, 0, sizeof(msg_can_tx));
-			can_dev.tx_msg.header.StdId = 0x00;
-			can_dev.tx_msg.header.ExtId = can_dev.base + can_dev.rec_offset*MSG_HW_VER;
-			can_dev.tx_msg.header.IDE = CAN_ID_EXT;
-			can_dev.tx_msg.header.RTR = CAN_RTR_DATA;
-			can_dev.tx_msg.header.TransmitGlobalTime = DISABLE;
-
-			can_dev.tx_msg.header.DLC = 8;
-			memset(can_dev.tx_msg.data, '\0', 8);
-
-			memset(hw_ver, '\0', sizeof(hw_ver));
-			if (share_app->head_code == APP_BTL_HEAD_CODE && *(&(share_app->head_code)+share_app->offset) == APP_BTL_TAIL_CODE) {
-				sprintf(hw_ver, (char *)share_app->brd_name);
-			}
-			else {
-				sprintf(hw_ver, "HW.dev");
-			}
-			memcpy(can_dev.tx_msg.data, hw_ver, 8);
+	return 0;
+}
 
-			if (HAL_CAN_AddTxMessage(&hcan, &can_dev.tx_msg.header, can_dev.tx_msg.data, &mbx) != HAL_OK) {
-				can_dev.error_tot++;
-				can_dev.error_tx++;
-			}
-			else {
-				can_dev.send_en = 0;
-			}
-		}
-		else if (msg->header.ExtId == can_dev.base + can_dev.rec_offset*MSG_FW_VER) { /* richiesta versione HW */
-			/* invio risposta */
-			memset(&can_dev.tx_msg, 0, sizeof(msg_can_tx));
-			can_dev.tx_msg.header.StdId = 0x00;
-			can_dev.tx_msg.header.ExtId = can_dev.base + can_dev.rec_offset*MSG_FW_VER;
-			can_dev.tx_msg.header.IDE = CAN_ID_EXT;
-			can_dev.tx_msg.header.RTR = CAN_RTR_DATA;
-			can_dev.tx_msg.header.TransmitGlobalTime = DISABLE;
-
-			can_dev.tx_msg.header.DLC = 8;
-			cmd = (uint16_t *)can_dev.tx_msg.data;
-			cmd[0] = VER_CODE;
-			cmd[1] = VER_MAJ;
-			cmd[2] = VER_MIN;
-			cmd[3] = VER_PATCH;
-			if (HAL_CAN_AddTxMessage(&hcan, &can_dev.tx_msg.header, can_dev.tx_msg.data, &mbx) != HAL_OK) {
-				can_dev.error_tot++;
-				can_dev.error_tx++;
-			}
-			else {
-				can_dev.send_en = 0;
-			}
-		}
-	}
 
-	/* only data frame */
-	if (msg->header.RTR != CAN_RTR_DATA)
-		return;
-	
-#if 0
-	if (can_dev.base == 0) { /* comandi abilitati se e solo se il CANID e' 0 (in produzone) */
-		if (msg->header.ExtId == can_dev.cfg_id) {
-			opc = cmd[0];
-		}
-		return;
+/* tabella dei comandi: un solo elemento per (messaggio, rtr, opcode), vedi CanCommandExec.
+   Elementi dello stesso (messaggio, rtr) consecutivi e in ordine crescente di opc, senza sovrapposizioni
+   degli intervalli mascherati: ricerca binaria in CanCmdFind */
+static const can_cmd_def can_cmd_tab[CAN_CMD_NUM] = {
+	/* msg_id          rtr cfg opc                                       opc_mask  dlc    chk  reply  fn */
+	{MSG_CONF,         1,  1,  0,                                        0,        0, 8,  0,   1,     CanCmdCfgRtr},
+	{MSG_CONF,         0,  1,  MSG_OPC_CANID_REC,                        0xFFFF,   8, 8,  3,   0,     CanCmdCanIdRec},
+	{MSG_CONF,         0,  1,  MSG_OPC_CANID_SEND,                       0xFFFF,   8, 8,  3,   0,     CanCmdCanIdSend},
+	{MSG_CONF,         0,  1,  MSG_OPC_CANID_OFFSET,                     0xFFFF,   8, 8,  3,   0,     CanCmdCanIdOffset},
+	{MSG_CONF,         0,  1,  MSG_OPC_STAGE | MSG_OPC_CANID_REC,        0xFFFF,   8, 8,  3,   0,     CanCmdStage},
+	{MSG_CONF,         0,  1,  MSG_OPC_STAGE | MSG_OPC_CANID_SEND,       0xFFFF,   8, 8,  3,   0,     CanCmdStage},
+	{MSG_CONF,         0,  1,  MSG_OPC_STAGE | MSG_OPC_CANID_OFFSET,     0xFFFF,   8, 8,  3,   0,     CanCmdStage},
+	{MSG_CONF,         0,  1,  MSG_OPC_STAGE_COMMIT,                     0xFFFF,   4, 4,  1,   0,     CanCmdStageCommit},
+	{MSG_CONF,         0,  1,  MSG_OPC_STAGE_ABORT,                      0xFFFF,   2, 8,  0,   0,     CanCmdStageAbort},
+	{MSG_CONF,         0,  1,  MSG_OPC_VELOC,                            0xFFFF,   6, 6,  2,   0,     CanCmdVeloc},
+	{MSG_CONF,         0,  1,  MSG_OPC_MON_MODE,                         0xFFFF,   8, 8,  3,   0,     CanCmdMonMode},
+	{MSG_CONF,         0,  1,  MSG_OPC_MON_STAT,                         0xFFFF,   6, 6,  2,   0,     CanCmdMonStat},
+	{MSG_CONF,         0,  1,  MSG_OPC_CMD_TIMEOUT,                      0xFFFF,   6, 6,  2,   0,     CanCmdTimeout},
+	{MSG_CONF,         0,  1,  MSG_OPC_PARAM_READ,                       0xFFFF,   4, 4,  0,   1,     CanCmdParamRead},
+	{MSG_CONF,         0,  0,  MSG_OPC_DIAG,                             0xFFFF,   8, 8,  0,   1,     CanCmdDiag},
+	{MSG_CONF,         0,  1,  MSG_OPC_BOOTLOADER,                       0xFFFF,   6, 6,  0,   0,     CanCmdBootloader},
+	{MSG_CONF,         0,  1,  MSG_OPC_SEG_READ & 0xFF00,                0xFF00,   2, 8,  0,   1,     CanCmdSeg},
+	{MSG_HW_VER,       1,  0,  0,                                        0,        0, 8,  0,   1,     CanCmdHwVer},
+	{MSG_FW_VER,       1,  0,  0,                                        0,        0, 8,  0,   1,     CanCmdFwVer},
+	{MSG_CFG_STATUS,   0,  0,  0,                                        0,        2, 2,  0,   0,     CanCmdCfgStatus},
+	{MSG_OUT_ENABLE,   0,  0,  0,                                        0,        4, 4,  0,   0,     CanCmdOutEnable},
+	{MSG_GROUP,        0,  0,  0,                                        0,        1, 8,  0,   0,     CanCmdGroup},
+	{MSG_SYNC,         0,  0,  0,                                        0,        0, 8,  0,   0,     CanCmdSync},
+	{MSG_CNG_VELOC,    0,  0,  0,                                        0,        2, 2,  0,   0,     CanCmdCngVeloc},
+	{MSG_LSS,          0,  0,  0,                                        0,        0, 8,  0,   1,     CanCmdLss},
+};
+
+
+/* comando ricevuto alla nuova velocita': salvataggio del cambio in attesa */
+static void CanSpeedAck(uint8_t ack)
+{
+	if (ack && can_dev.speed_save) {
+		can_dev.speed_save = 0;
+		/* scrittura velocita' confermata */
+		CanEeWrite(FLASH_ADDR_SPEED_ID, can_dev.speed);
 	}
+}
+
+
+/* elementi di can_cmd_tab per ogni (messaggio, rtr), vedi CanCmdIndexInit */
+typedef struct {
+	uint8_t first;
+	uint8_t num;
+} can_cmd_range;
+
+static can_cmd_range can_cmd_idx[CAN_CMD_SLOT_NUM][2];
+
+#if MSG_CONF - MSG_LSS != 3 || MSG_SYNC <= MSG_LSS || MSG_GROUP <= MSG_LSS
+# error "messaggi speciali non contigui: rivedere CanCmdSlot"
 #endif
 
-	/* gestione dei comandi */
-	save_speed_ack = 1;
-	if (msg->header.ExtId == can_dev.base + can_dev.rec_offset*MSG_CFG_STATUS && msg->header.DLC == 2) {
-	    if (cmd[0] >= MSG_PERIOD_MIN || cmd[0] == 0)
-	    	can_dev.period_mon_info = cmd[0];
-	    can_dev.periodic_en = 1;
-	}
-	else if (msg->header.ExtId == can_dev.base + can_dev.rec_offset*MSG_OUT_ENABLE && msg->header.DLC == 4) {
-		if (cmd[0] & 0x0001) {
-			machine->enable_power = 1;
-			/* reset degli errori */
-			machine->error_overcurrent = 0;
-			machine->error_th = 0;
-		}
-		else {
-			machine->enable_power = 0;
-		}
-		if (cmd[1] & 0x0001) {
-			machine->switch_on = 1;
-		}
-		else {
-			machine->switch_on = 0;
-		}
-	    can_dev.periodic_en = 1;
-	}
-	else if (msg->header.ExtId == can_dev.base + can_dev.rec_offset*MSG_CNG_VELOC && msg->header.DLC == 2) { /* cambio velocita' */
-		if (can_dev.speed != cmd[0] && cmd[0] < CAN_SPEED_NONE) { /*  && cmd[0] >= CAN_SPEED_1M */
-			save_speed = 1;
-			save_speed_ack = 0;
-			can_dev.speed = cmd[0];
-		    CanSpeedInit(can_dev.speed); /* c'e' anche l'inizializzazione */
-		}
+
+static uint8_t CanCmdSlot(uint8_t msg_id)
+{
+	if (msg_id < MSG_REC_NUM)
+		return msg_id;
+	if (msg_id >= MSG_LSS && msg_id <= MSG_CONF)
+		return MSG_REC_NUM + msg_id - MSG_LSS;
+
+	return CAN_CMD_SLOT_NUM;
+}
+
+
+static void CanCmdIndexInit(void)
+{
+	can_cmd_range *r;
+	uint8_t i;
+
+	memset(can_cmd_idx, 0, sizeof(can_cmd_idx));
+	for (i=CAN_CMD_NUM; i--!=0;) { /* dal fondo: first resta sul primo elemento del gruppo */
+		r = &can_cmd_idx[CanCmdSlot(can_cmd_tab[i].msg_id)][can_cmd_tab[i].rtr];
+		r->first = i;
+		r->num++;
 	}
-	else {
-		save_speed_ack = 0;
+}
+
+
+/* indice in can_cmd_tab del gestore, CAN_CMD_NUM se nessuno.
+   Gruppo del messaggio per indice, poi ricerca binaria sull'opcode: al piu' 5 confronti per MSG_CONF, 1 per gli altri */
+static uint8_t CanCmdFind(uint8_t msg_id, uint8_t rtr, uint16_t opc)
+{
+	const can_cmd_def *def;
+	const can_cmd_range *r;
+	uint8_t slot, lo, hi, mid;
+
+	slot = CanCmdSlot(msg_id);
+	if (slot == CAN_CMD_SLOT_NUM)
+		return CAN_CMD_NUM;
+
+	r = &can_cmd_idx[slot][rtr];
+	lo = r->first;
+	hi = r->first + r->num;
+	while (lo != hi) {
+		mid = (lo + hi) / 2;
+		def = &can_cmd_tab[mid];
+		if ((opc & def->opc_mask) == def->opc)
+			return mid;
+		if (opc < def->opc)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
 
-	if (save_speed_ack == 1 && save_speed == 1) {
-		save_speed = 0;
-		/* scrittura indirizzo CAN */
-		FLASH_Unlock();
-		EE_WriteVariable(FLASH_ADDR_SPEED_ID, can_dev.speed);
-		FLASH_Lock();
+	return CAN_CMD_NUM;
+}
+
+
+/* ritorna -1 se il comando risponde e la coda di invio e' piena: il messaggio va rielaborato */
+static int CanCommandExec(msg_can_rx *msg, machine_status *machine)
+{
+	const can_cmd_def *def;
+	const uint16_t *cmd;
+	uint16_t opc;
+	uint32_t t;
+	uint8_t i, rtr, cfg, ack;
+
+	cmd = (const uint16_t *)msg->data;
+	rtr = msg->header.RTR != CAN_RTR_DATA;
+	opc = (msg->msg_id == MSG_CONF && rtr == 0 && msg->header.DLC >= 2) ? cmd[0] : 0;
+
+	/* configurazione solo a uscite spente e, con una sessione LSS, solo se selezionato.
+	   Anche i nodi non selezionati vedono la configurazione in corso: la sessione resta attiva */
+	if (msg->msg_id == MSG_CONF && can_dev.lss_active)
+		can_dev.lss_t = HAL_GetTick();
+	cfg = can_dev.cfg_en && (can_dev.lss_active == 0 || can_dev.lss_selected);
+	ack = rtr && cfg; /* qualsiasi request in configurazione conferma la velocita' */
+
+	i = CanCmdFind(msg->msg_id, rtr, opc);
+	def = &can_cmd_tab[i];
+	if (i == CAN_CMD_NUM || msg->header.DLC < def->dlc_min || msg->header.DLC > def->dlc_max
+			|| (def->chk != 0 && cmd[def->chk] != HW_CHECK_3) || (def->cfg && cfg == 0)) {
+		CanSpeedAck(ack);
+		return 0;
 	}
+	if (def->reply && can_dev.tx_queue_num == CAN_TX_QUEUE)
+		return -1;
+
+	t = CanTimestamp();
+	ack |= def->fn(msg, machine);
+	CanSpeedAck(ack);
+	t = CanTimestamp() - t;
+	if (t > can_dev.cmd_cycles_max[i])
+		can_dev.cmd_cycles_max[i] = t;
+
+	return 0;
 }
 
 
 void CanMsgInit(void)
 {
-	uint16_t ret, val;
+	uint8_t i;
 
-	/* CAN inizializzazione */
-	can_dev.speed = CAN_SPEED_250K; /* default */
-	ret = EE_ReadVariable(FLASH_ADDR_SPEED_ID, &val);
-	if (ret == 0 && val < CAN_SPEED_NONE) {
-		can_dev.speed = val;
-	}
+    /* svuota le code in ingresso al CAN bus */
+    CanRxQueueInit(&can_dev.rx_queue[CAN_RX_FIFO0], can_dev.rx_msg_queue, CAN_RX_QUEUE);
+    CanRxQueueInit(&can_dev.rx_queue[CAN_RX_FIFO1], can_dev.rx_msg_hp_queue, CAN_RX_HP_QUEUE);
 
-    /* svuota la coda in ingresso al CAN bus */
-    can_dev.rx_queue_in = can_dev.rx_queue_out = 0;
+    /* UID per la selezione LSS */
+    can_dev.uid[0] = HAL_GetUIDw0();
+    can_dev.uid[1] = HAL_GetUIDw1();
+    can_dev.uid[2] = HAL_GetUIDw2();
 
-    /* presisposizione periodicita' messaggi */
-    can_dev.period_mon_info = MSG_PERIOD_MON_INFO;
+    /* contatore di cicli per la misura delle latenze */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 
-    CanSpeedInit(can_dev.speed); /* c'e' anche l'inizializzazione */
+    /* indice dei gestori dei comandi */
+    CanCmdIndexInit();
+
+    /* presisposizione periodicita' messaggi */
+    for (i=0; i!=MSG_PERIODIC_NUM; i++) {
+    	can_dev.periodic[i].msg_id = can_periodic_tab[i].msg_id;
+    	can_dev.periodic[i].period = can_periodic_tab[i].period;
+    	can_dev.periodic[i].phase = can_periodic_tab[i].phase;
+    }
+    CanPeriodicReset();
+    can_dev.sync_due = -1;
+
+    /* velocita', ID e modalita' di invio */
+    CanParamsLoad();
+
+    if (can_dev.autobaud)
+    	CanAutoBaudStart(); /* c'e' anche l'inizializzazione */
+    else
+    	CanSpeedInit(can_dev.speed); /* c'e' anche l'inizializzazione */
 }
 
 
 void CanMsgEnableForce(void)
 {
-	can_dev.period_mon_info_force = 1;
+	CanPeriodicForce(MSG_MON_INFO);
 }
 
 
@@ -824,12 +3040,46 @@ static int16_t OutsAreDisable(machine_status *machine)
 }
 
 
+/* elaborazione dei messaggi in coda: la coda prioritaria (FIFO1) e' sempre servita per prima;
+   della coda FIFO0 si elabora un messaggio e si prosegue solo se l'occupazione resta
+   almeno pari a level (0: fino a svuotarla) */
+static void CanRxDrain(machine_status *machine, uint16_t level)
+{
+	msg_can_rx *msg;
+	can_rx_queue *q;
+	uint32_t t;
+	int res;
+
+	/* la coda prioritaria e' sempre elaborata: solo i comandi con risposta attendono posto nella coda di invio */
+	for (;;) {
+		q = &can_dev.rx_queue[CAN_RX_FIFO1];
+		msg = CanRxQueueHead(q);
+		if (msg == NULL) {
+			q = &can_dev.rx_queue[CAN_RX_FIFO0];
+			msg = CanRxQueueHead(q);
+			if (msg == NULL)
+				break;
+		}
+		t = CanTimestamp();
+		can_dev.rx_ts = msg->ts;
+		res = CanCommandExec(msg, machine);
+		can_dev.rx_ts = 0;
+		if (res != 0)
+			break; /* risposta al prossimo passo, l'ordine dei messaggi e' mantenuto */
+		CanLatAdd(&can_dev.lat_queue, t - msg->ts);
+		CanRxQueuePop(q);
+		if (level != 0 && q == &can_dev.rx_queue[CAN_RX_FIFO0] && CanRxQueueLevel(q) < level)
+			break;
+	}
+}
+
+
 int8_t CanMsgManager(uint8_t tick, machine_status *machine) /* tick va ad 1 ogni 10ms */
 {
-	static uint16_t tick_cnt_mon_info;
 	static uint16_t led_err_on;
 	int8_t ret = 0;
-	uint32_t mbx, dt, dt_max, dt_id;
+	uint32_t dt;
+	can_periodic *per;
 
 /*
 	if (tick) { // 10ms
@@ -845,17 +3095,24 @@ int8_t CanMsgManager(uint8_t tick, machine_status *machine) /* tick va ad 1 ogni
 	}
 
 */
-	if (CanControlLoop(tick) != 0) {
+	/* clock errato: errore permanente, uscite disabilitate */
+	if (can_dev.clk_err)
+		return -1;
+
+	/* ricerca automatica della velocita': nessun invio ne' elaborazione fino al lock */
+	if (can_dev.autobaud) {
+		CanAutoBaud();
+		return ret;
+	}
+
+	if (CanControlLoop() != 0) {
 		/* errore nel can bus, disabilitazione di tutte le uscite */
 		led_err_on = 100; /* lampeggia per 100*10ms */
 		ret = -1;
 	}
 
-	/* elaborazione dei messaggi in cosa */
-	if (can_dev.rx_queue_in != can_dev.rx_queue_out && can_dev.send_en == 1) { /* messaggio ricevuto e possibilita di inviare una risposta */
-		CanCommandExec(&can_dev.rx_msg_queue[can_dev.rx_queue_out], machine);
-		can_dev.rx_queue_out = (can_dev.rx_queue_out + 1)%CAN_RX_QUEUE;
-	}
+	/* elaborazione dei messaggi in coda */
+	CanRxDrain(machine, CAN_RX_DRAIN_ALL ? 0 : CAN_RX_DRAIN_WM);
 
 	/* verifica se si puo' andare in configurazione */
 	if (can_dev.periodic_en == 0 && OutsAreDisable(machine) == 1) {
@@ -865,34 +3122,35 @@ int8_t CanMsgManager(uint8_t tick, machine_status *machine) /* tick va ad 1 ogni
 		can_dev.cfg_en = 0;
 	}
 
-	/* gestione re-invii pacchetti */
-	if (can_dev.send_en == 2) {
-		static uint16_t re_send = 0;
-		
-		if (re_send == MSG_RE_SEND_MAX) {
-			/* re-iniziliazzazione CANbus */
-			re_send = 0;
-			printf_err("Re-Send Error\r\n");
+	/* trasporto segmentato e sessione LSS */
+	CanSegTask();
+	CanLssTask();
+
+	/* salvataggi in e2prom */
+	CanEeTask();
+
+	/* gestione invii e re-invii pacchetti */
+	CanTxFlush();
+
+	/* re-inizializzazione richiesta dalla configurazione, a conferma inviata */
+	if (can_dev.reinit_req && can_dev.tx_queue_num == 0 && HAL_CAN_GetTxMailboxesFreeLevel(&hcan) == CAN_TX_MBX_NUM) {
+		can_dev.reinit_req = 0;
+		if (can_dev.autobaud)
+			CanAutoBaudStart();
+		else
 			CanReInit();
-			can_dev.send_en = 2; /* per imporre il re-invio del medesimo pacchetto */
-		}
-		else {
-			if (HAL_CAN_AddTxMessage(&hcan, &can_dev.tx_msg.header, can_dev.tx_msg.data, &mbx) != HAL_OK) {
-				can_dev.error_tot++;
-				can_dev.error_tx++;
-			}
-			else {
-				re_send++;
-				can_dev.send_en = 0;
-			}
-		}
 	}
 
-	/* gestione messaggi periodici */
+	/* gestione messaggi periodici: se disabilitati per errori di invio la schedulazione prosegue, per il conteggio dei soppressi */
+	if (can_dev.periodic_en)
+		can_dev.periodic_suppr = 0;
 	if (can_dev.periodic_en == 0) {
-		tick_cnt_mon_info = 0;
+		can_dev.sync_due = -1;
+		if (can_dev.periodic_suppr == 0) {
+			CanPeriodicReset();
 
-		return ret;
+			return ret;
+		}
 	}
 
  	if (can_tick_1ms == 0) {
@@ -902,75 +3160,147 @@ int8_t CanMsgManager(uint8_t tick, machine_status *machine) /* tick va ad 1 ogni
  	dt = can_tick_1ms;
  	can_tick_1ms = 0;
 
-	tick_cnt_mon_info += dt;
-
-	/* invio messaggi */
-	dt_max = dt_id = 0; /* da usare per dare priorita' a messaggi piu' in ritardo */
-	if (tick_cnt_mon_info >= can_dev.period_mon_info || can_dev.period_mon_info_force) {
-		dt_max = tick_cnt_mon_info - can_dev.period_mon_info;
-		dt_id = 1;
+	/* invio messaggi: prima i piu' in ritardo; a coda di invio piena i periodici scaduti sono persi (mon_fail),
+	   quelli su variazione attendono posto */
+	CanMonChange(machine, dt);
+	CanPeriodicTick(dt);
+	per = CanPeriodicFind(MSG_MON_STAT);
+	machine->stat_en = per != NULL && per->period != 0;
+	CanSyncTick(machine, dt);
+	while ((per = CanPeriodicNext()) != NULL) {
+		if (per->force && can_dev.periodic_en && can_dev.tx_queue_num == CAN_TX_QUEUE)
+			break;
+		if (per->force) {
+			/* invio forzato (su variazione): il periodo riparte, il prossimo invio entro period ms */
+			per->force = 0;
+			per->due = per->period;
+		}
+		else {
+			per->due += per->period;
+			if (per->due <= 0)
+				per->due = per->period; /* troppo in ritardo: si riparte senza raffica di recupero */
+		}
+		if (can_dev.periodic_en == 0)
+			CanSendSuppr(per->msg_id);
+		else if (can_dev.tx_queue_num == CAN_TX_QUEUE)
+			CanSendFail(per->msg_id);
+		else
+			CanSendData(per->msg_id, machine, 0);
 	}
+	CanTxFlush();
 
-	switch (dt_id) {
-	default:
-		break;
+	return ret;
+}
 
-	case 1:
-		tick_cnt_mon_info = 0;
-		CanSendData(MSG_MON_INFO, machine, 0);
-		break;
-	}
 
-	return ret;
+/* svuotamento d'emergenza fra le elaborazioni del ciclo macchina: interviene solo
+   oltre la soglia CAN_RX_DRAIN_WM, prima che la coda FIFO0 arrivi a scartare messaggi */
+void CanMsgRxDrain(machine_status *machine)
+{
+	if (can_dev.autobaud || CanRxQueueLevel(&can_dev.rx_queue[CAN_RX_FIFO0]) < CAN_RX_DRAIN_WM)
+		return;
+
+	can_dev.rx_drain_num++;
+	CanRxDrain(machine, 0);
+	CanTxFlush();
 }
 
 
+/* solo conteggio: la periferica non viene resettata e con la ritrasmissione automatica
+   i messaggi restano in mailbox fino all'invio; il recupero e' gestito da CanControlLoop */
 void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan)
 {
 	uint32_t err;
 
-	__HAL_RCC_CAN1_FORCE_RESET();
-	__HAL_RCC_CAN1_RELEASE_RESET();
-
+	/* il driver accumula i bit in ErrorCode: azzerato subito per contare solo gli errori di questo interrupt */
 	err = HAL_CAN_GetError(hcan);
-	if ((err & (HAL_CAN_ERROR_TX_ALST0 | HAL_CAN_ERROR_TX_TERR0 | HAL_CAN_ERROR_TX_ALST1 | HAL_CAN_ERROR_TX_TERR1 | HAL_CAN_ERROR_TX_ALST2 | HAL_CAN_ERROR_TX_TERR2))  &&  HAL_CAN_GetState(hcan) == HAL_CAN_STATE_READY) {
-		can_dev.send_en = 2; /* riabilitazione re-invio */
+	HAL_CAN_ResetError(hcan);
+
+	/* overrun delle FIFO hw: messaggi persi, non errori del bus */
+	if ((err & HAL_CAN_ERROR_RX_FOV0) != 0)
+		can_dev.rx_queue[CAN_RX_FIFO0].ovr++;
+	if ((err & HAL_CAN_ERROR_RX_FOV1) != 0)
+		can_dev.rx_queue[CAN_RX_FIFO1].ovr++;
+	err &= ~(HAL_CAN_ERROR_RX_FOV0 | HAL_CAN_ERROR_RX_FOV1);
+	if (err == HAL_CAN_ERROR_NONE)
+		return;
+
+	if ((err & (HAL_CAN_ERROR_ACK | HAL_CAN_ERROR_BOF | HAL_CAN_ERROR_BR | HAL_CAN_ERROR_BD)) != 0) {
+		can_dev.error_tx++;
 	}
-	else {
-		if ((err & (HAL_CAN_ERROR_ACK | HAL_CAN_ERROR_BOF | HAL_CAN_ERROR_BR | HAL_CAN_ERROR_BD)) != 0) {
-			can_dev.error_tx++;
-			can_dev.send_en = 1; /* riabilitazione invio */
-		}
-		can_dev.error_glb++;
+	if ((err & (HAL_CAN_ERROR_TX_ALST0 | HAL_CAN_ERROR_TX_ALST1 | HAL_CAN_ERROR_TX_ALST2)) == 0) { /* l'arbitraggio perso non e' un errore */
+		if (can_dev.error_glb != 0xFF)
+			can_dev.error_glb++;
 		can_dev.error_tot++;
 	}
 }
 
 
-void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan)
+static uint8_t CanRxMsgId(const CAN_RxHeaderTypeDef *header, uint32_t fifo)
 {
-    CAN_RxHeaderTypeDef header;
-    uint8_t data[8];
-
-	if (HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &header, data) == HAL_OK) {
-		if ((can_dev.rx_queue_in+1)%CAN_RX_QUEUE != can_dev.rx_queue_out && header.IDE == CAN_ID_EXT) {
-			uint32_t cmd_id;
-			
-			/* filtro messaggi destinati al nodo */
-			cmd_id = header.ExtId;
-			if (cmd_id == can_dev.cfg_id || (can_dev.base != 0 && (
-					cmd_id == can_dev.base + can_dev.rec_offset*MSG_CFG_STATUS ||
-					cmd_id == can_dev.base + can_dev.rec_offset*MSG_OUT_ENABLE ||
-					cmd_id == can_dev.base + can_dev.rec_offset*MSG_CNG_VELOC ||
-					cmd_id == can_dev.base + can_dev.rec_offset*MSG_HW_VER    ||
-					cmd_id == can_dev.base + can_dev.rec_offset*MSG_FW_VER
-
-					))) {
-				can_dev.rx++;
+	uint32_t cmd_id;
+	uint8_t i;
+
+	if (can_dev.flt_all == 0) { /* messaggio gia' selezionato dai filtri hw */
+		if (header->FilterMatchIndex < CAN_FLT_IDX_NUM)
+			return can_dev.flt_msg[fifo][header->FilterMatchIndex];
+		return MSG_NONE;
+	}
 
-				memcpy(&can_dev.rx_msg_queue[can_dev.rx_queue_in].header, &header, sizeof(CAN_RxHeaderTypeDef));
-				memcpy(can_dev.rx_msg_queue[can_dev.rx_queue_in].data, data, sizeof(data));
-				can_dev.rx_queue_in = (can_dev.rx_queue_in + 1) % CAN_RX_QUEUE;
+	/* filtro piglia tutto: verifica software */
+	if (header->IDE != CAN_ID_EXT)
+		return MSG_NONE;
+
+	cmd_id = header->ExtId;
+	if (cmd_id == can_dev.cfg_id)
+		return MSG_CONF;
+	if (cmd_id == CAN_LSS_ID)
+		return MSG_LSS;
+	if (can_dev.base != 0) {
+		if (cmd_id == CAN_SYNC_ID)
+			return MSG_SYNC;
+		if (cmd_id == CAN_BCAST_ID)
+			return MSG_GROUP;
+		for (i=0; i!=CAN_GROUP_NUM; i++) {
+			if (can_dev.group_id[i] != 0 && cmd_id == can_dev.group_id[i])
+				return MSG_GROUP;
+		}
+		for (i=0; i!=MSG_REC_NUM; i++) {
+			if (cmd_id == can_dev.rx_id[i])
+				return i;
+		}
+	}
+
+	return MSG_NONE;
+}
+
+
+static void CanRxFifo(CAN_HandleTypeDef *hcan, uint32_t fifo)
+{
+	static msg_can_rx rx_discard; /* destinazione della lettura quando la coda e' piena: la FIFO hw va comunque svuotata */
+	can_rx_queue *q;
+	msg_can_rx *msg;
+
+	/* lettura della mailbox direttamente nello slot della coda, pubblicato solo se il messaggio e' per il nodo */
+	q = &can_dev.rx_queue[fifo];
+	msg = CanRxQueueReserve(q);
+	if (msg == NULL)
+		msg = &rx_discard;
+	if (HAL_CAN_GetRxMessage(hcan, fifo, &msg->header, msg->data) == HAL_OK) {
+		if (can_dev.autobaud) { /* basta la ricezione, il messaggio non e' elaborato */
+			can_dev.autobaud_rx = can_dev.autobaud_speed;
+			return;
+		}
+		/* filtro messaggi destinati al nodo */
+		msg->msg_id = CanRxMsgId(&msg->header, fifo);
+		if (msg->msg_id != MSG_NONE) {
+			if (msg != &rx_discard) {
+				msg->ts = CanTimestamp();
+				CanRxQueueCommit(q);
+				can_dev.rx++;
+			}
+			else {
+				q->drop++;
 			}
 		}
 
@@ -980,11 +3310,47 @@ void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan)
 }
 
 
-void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan)
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan)
+{
+	CanRxFifo(hcan, CAN_RX_FIFO0);
+}
+
+
+void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan)
+{
+	CanRxFifo(hcan, CAN_RX_FIFO1);
+}
+
+
+/* FIFO hw piena: al prossimo messaggio ci sarebbe overrun, si svuota tutta la FIFO */
+static void CanRxFifoFull(CAN_HandleTypeDef *hcan, uint32_t fifo)
+{
+	uint32_t n;
+
+	can_dev.rx_queue[fifo].full++;
+	for (n=HAL_CAN_GetRxFifoFillLevel(hcan, fifo); n!=0; n--)
+		CanRxFifo(hcan, fifo);
+}
+
+
+void HAL_CAN_RxFifo0FullCallback(CAN_HandleTypeDef *hcan)
+{
+	CanRxFifoFull(hcan, CAN_RX_FIFO0);
+}
+
+
+void HAL_CAN_RxFifo1FullCallback(CAN_HandleTypeDef *hcan)
+{
+	CanRxFifoFull(hcan, CAN_RX_FIFO1);
+}
+
+
+static void CanTxComplete(uint8_t mbx)
 {
 	static unsigned long old_tx_error = 0;
 
-	can_dev.send_en = 1;
+	CanLatAdd(&can_dev.lat_tx, CanTimestamp() - can_dev.tx_mbx[mbx].ts);
+	can_dev.tx_mbx[mbx].state = CAN_MBX_FREE;
 	can_dev.tx++;
 
 	if (can_dev.error_tx && can_dev.error_tx == old_tx_error) /* il bus ha ricominciato a funzionare */
@@ -995,7 +3361,37 @@ void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan)
 }
 
 
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CanTxComplete(0);
+}
+
+
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CanTxComplete(1);
+}
+
+
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CanTxComplete(2);
+}
+
+
 void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef *hcan)
 {
-	can_dev.send_en = 2; /* riabilitazione re-invio */
+	can_dev.tx_mbx[0].state = CAN_MBX_RESEND; /* riabilitazione re-invio */
+}
+
+
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef *hcan)
+{
+	can_dev.tx_mbx[1].state = CAN_MBX_RESEND; /* riabilitazione re-invio */
+}
+
+
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef *hcan)
+{
+	can_dev.tx_mbx[2].state = CAN_MBX_RESEND; /* riabilitazione re-invio */
 }
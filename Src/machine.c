@@ -18,6 +18,12 @@ extern volatile uint8_t tick_10ms;
 
 uint16_t VirtAddVarTab[NumbOfVar];
 
+/* supervisione dei comandi alle uscite: aggiornata da SysTick */
+static volatile uint16_t cmd_timeout;      /* ms senza comandi prima dello spegnimento, 0: disabilitata */
+static volatile uint16_t cmd_elapsed;      /* ms dall'ultimo comando */
+static volatile uint8_t cmd_armed;         /* ultimo comando con almeno un'uscita attiva */
+static volatile uint8_t cmd_timeout_trip;  /* comandi scaduti: uscite spente fino al prossimo comando */
+
 static void MachineMangeError(machine_status *machine)
 {
 	machine->enable_power = 0;
@@ -44,7 +50,7 @@ static void MachineInit(machine_status *machine)
 {
 	uint16_t j;
 
-	memset(&machine, 0, sizeof(machine));
+	memset(machine, 0, sizeof(*machine));
 
 	/* e2prom emul */
 	memset(VirtAddVarTab, 0, sizeof(VirtAddVarTab));
@@ -61,6 +67,16 @@ static void MachineInit(machine_status *machine)
 	VirtAddVarTab[j++] = FLASH_ADDR_CANID_SEND_OFFS_L;
 	VirtAddVarTab[j++] = FLASH_ADDR_CANID_REC_OFFS_H;
 	VirtAddVarTab[j++] = FLASH_ADDR_CANID_REC_OFFS_L;
+	VirtAddVarTab[j++] = FLASH_ADDR_MON_MODE;
+	VirtAddVarTab[j++] = FLASH_ADDR_MON_DEAD_I;
+	VirtAddVarTab[j++] = FLASH_ADDR_SYNC_SLOT;
+	VirtAddVarTab[j++] = FLASH_ADDR_GROUP_0_H;
+	VirtAddVarTab[j++] = FLASH_ADDR_GROUP_0_L;
+	VirtAddVarTab[j++] = FLASH_ADDR_GROUP_1_H;
+	VirtAddVarTab[j++] = FLASH_ADDR_GROUP_1_L;
+	VirtAddVarTab[j++] = FLASH_ADDR_NODE_IDX;
+	VirtAddVarTab[j++] = FLASH_ADDR_MON_STAT_PERIOD;
+	VirtAddVarTab[j++] = FLASH_ADDR_CMD_TIMEOUT;
 
 	FLASH_Unlock();
 	EE_Init();
@@ -111,6 +127,20 @@ static void Logic(machine_status *machine)
 		machine->error_temp_sens_2 = 0;
 	}
 
+	MachineOutputUpdate(machine);
+}
+
+
+/* ingressi di protezione e comando delle uscite: chiamata anche alla ricezione di MSG_OUT_ENABLE */
+void MachineOutputUpdate(machine_status *machine)
+{
+	/* comandi scaduti: uscite gia' spente da MachineTick */
+	if (cmd_timeout_trip) {
+		machine->enable_power = 0;
+		machine->switch_on = 0;
+		machine->error_cmd_timeout = 1;
+	}
+
 	/* lettura ingressi digitali */
 	if (HAL_GPIO_ReadPin(TH_micro_GPIO_Port, TH_micro_Pin) == GPIO_PIN_RESET) {
 		machine->error_th = 1;
@@ -205,6 +235,9 @@ void MachineLogic(void)
 
 		AnalogManager(&machine);
 
+		/* messaggi in ricezione oltre la soglia: non si attende il prossimo giro */
+		CanMsgRxDrain(&machine);
+
 		Logic(&machine);
 
 		Leds(&machine);
@@ -219,3 +252,47 @@ void MachineFault(void)
 	HAL_GPIO_WritePin(ENABLE_POWER_GPIO_Port, ENABLE_POWER_Pin, GPIO_PIN_RESET);
 	HAL_GPIO_WritePin(SWITCH_ON_micro_GPIO_Port, SWITCH_ON_micro_Pin, GPIO_PIN_RESET);
 }
+
+
+/* da SysTick, ogni ms: spegnimento entro cmd_timeout+1 ms dalla ricezione dell'ultimo comando, indipendente
+   dal ciclo macchina (non da una cancellazione di pagina in flash, che ferma anche SysTick fino alla fine).
+   Dopo lo scatto le uscite sono riportate basse ad ogni ms, anche se il ciclo macchina le ha appena scritte */
+void MachineTick(void)
+{
+	if (cmd_timeout_trip) {
+		MachineFault();
+		return;
+	}
+	if (cmd_armed == 0 || cmd_timeout == 0)
+		return;
+
+	cmd_elapsed++;
+	if (cmd_elapsed >= cmd_timeout) {
+		cmd_armed = 0;
+		cmd_timeout_trip = 1;
+		MachineFault();
+	}
+}
+
+
+/* comando valido alle uscite: riparte il conteggio, on indica se almeno un'uscita e' richiesta attiva,
+   age i ms trascorsi fra la ricezione e l'elaborazione del comando (gia' contati) */
+void MachineCmdRefresh(uint8_t on, uint16_t age)
+{
+	cmd_armed = 0; /* nessuno scatto durante l'aggiornamento */
+	cmd_elapsed = age;
+	cmd_timeout_trip = 0;
+	cmd_armed = on;
+}
+
+
+void MachineCmdTimeoutSet(uint16_t timeout)
+{
+	cmd_timeout = timeout;
+}
+
+
+uint16_t MachineCmdTimeoutGet(void)
+{
+	return cmd_timeout;
+}
@@ -0,0 +1,284 @@
+/* replay di un log candump (formato -l) o di una raffica sintetica verso un nodo simulato:
+   frame accettati, persi e con risposta, occupazione massima delle code e latenze simulate.
+
+   can_replay [-b bitrate] [-n base] [-l us] [-o] log    replay del log (i tempi del log sono rispettati)
+   can_replay [-b bitrate] [-n base] [-l us] [-o] -s N   N frame consecutivi a bus saturo
+
+   -n base   CANID del nodo (0: nodo non configurato), -l us durata di un passo del ciclo macchina,
+   -o        stampa i frame inviati dal nodo in formato candump */
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "canmsg.c"
+
+#define REPLAY_TAIL_US                100000 /* esecuzione dopo l'ultimo frame, per svuotare code e invii */
+#define REPLAY_SEND_BASE              0x200  /* base_send di default: distinta dagli ID in ricezione */
+
+static uint32_t replay_base = 0x100;
+static uint8_t replay_out;
+static uint32_t replay_frames;
+static uint32_t replay_skip;
+
+
+static can_speed ReplaySpeed(uint32_t bitrate)
+{
+	static const uint32_t rate[CAN_SPEED_NONE] = {
+		CAN_BITRATE_1M, CAN_BITRATE_800K, CAN_BITRATE_500K, CAN_BITRATE_250K, CAN_BITRATE_125K,
+		CAN_BITRATE_100K, CAN_BITRATE_50K, CAN_BITRATE_20K, CAN_BITRATE_10K,
+	};
+	uint8_t i;
+
+	for (i=0; i!=CAN_SPEED_NONE; i++) {
+		if (rate[i] == bitrate)
+			return i;
+	}
+	return CAN_SPEED_NONE;
+}
+
+
+static void ReplayPut(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t *data, uint64_t t)
+{
+	while (HostBusPut(id, rtr, dlc, data, t) != 0)
+		HostAdvance(HostFrameUs(0, 8)); /* coda del bus piena: senza ciclo macchina, come un bus saturo */
+	replay_frames++;
+}
+
+
+static void ReplayRun(machine_status *machine, uint64_t until)
+{
+	if (host.us < until)
+		HostRun(machine, until - host.us);
+}
+
+
+/* una riga "(ts) iface ID#DATA", "ID#R" o "ID#Rn": solo ID estesi (8 cifre) */
+static int ReplayLine(const char *line, double *ts, uint32_t *id, uint8_t *rtr, uint8_t *dlc, uint8_t *data)
+{
+	const char *p;
+	char *end;
+	char hex[3] = {0};
+	int n;
+
+	if (sscanf(line, " (%lf) %*s %n", ts, &n) != 1)
+		return -1;
+	p = line + n;
+	errno = 0;
+	*id = strtoul(p, &end, 16);
+	if (errno != 0 || *end != '#')
+		return -1;
+	if (end - p != 8)
+		return 1; /* ID standard: il nodo usa solo ID estesi */
+
+	p = end + 1;
+	*rtr = 0;
+	*dlc = 0;
+	if (*p == 'R') {
+		*rtr = 1;
+		if (p[1] >= '0' && p[1] <= '8')
+			*dlc = p[1] - '0';
+		return 0;
+	}
+	while (*dlc != 8 && isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1])) {
+		hex[0] = p[0];
+		hex[1] = p[1];
+		data[(*dlc)++] = strtoul(hex, NULL, 16);
+		p += 2;
+		if (*p == '.')
+			p++;
+	}
+
+	return 0;
+}
+
+
+static int ReplayLog(machine_status *machine, const char *path)
+{
+	char line[256];
+	uint8_t data[8], rtr, dlc;
+	double ts, ts0 = -1;
+	uint32_t id;
+	uint64_t t, t0 = 0, last = 0;
+	FILE *f;
+	int res;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		memset(data, 0, sizeof(data));
+		res = ReplayLine(line, &ts, &id, &rtr, &dlc, data);
+		if (res != 0) {
+			replay_skip++;
+			continue;
+		}
+		if (ts0 < 0) {
+			ts0 = ts;
+			t0 = host.us;
+		}
+		t = t0 + (uint64_t)((ts - ts0)*1e6);
+		if (t < last)
+			t = last;
+		last = t;
+		/* il nodo gira fino a poco prima del frame: la coda del bus resta corta */
+		ReplayRun(machine, t);
+		ReplayPut(id, rtr, dlc, data, t);
+	}
+	fclose(f);
+
+	return 0;
+}
+
+
+/* raffica sintetica: comandi alle uscite, configurazione dei periodici, diagnostica e traffico di altri nodi */
+static void ReplayStorm(machine_status *machine, uint32_t n)
+{
+	uint8_t data[8];
+	uint32_t i;
+
+	for (i=0; i!=n; i++) {
+		memset(data, 0, sizeof(data));
+		switch (i % 4) {
+		case 0:
+			data[0] = 1; /* enable_power */
+			ReplayPut(can_dev.rx_id[MSG_OUT_ENABLE], 0, 4, data, host.us);
+			break;
+		case 1:
+			data[0] = MSG_PERIOD_MON_INFO & 0xFF;
+			data[1] = MSG_PERIOD_MON_INFO >> 8;
+			ReplayPut(can_dev.rx_id[MSG_CFG_STATUS], 0, 2, data, host.us);
+			break;
+		case 2:
+			data[0] = MSG_OPC_DIAG & 0xFF;
+			data[1] = MSG_OPC_DIAG >> 8;
+			data[2] = i/4 % MSG_DIAG_PAGE_NUM;
+			data[3] = 0;
+			data[4] = can_dev.base & 0xFF;
+			data[5] = (can_dev.base >> 8) & 0xFF;
+			data[6] = (can_dev.base >> 16) & 0xFF;
+			data[7] = can_dev.base >> 24;
+			ReplayPut(can_dev.cfg_id, 0, 8, data, host.us);
+			break;
+		default:
+			ReplayPut(0x1FFF0000 + i, 0, 8, data, host.us); /* altro nodo */
+			break;
+		}
+		/* la raffica non aspetta il nodo: si prosegue finche' la coda del bus non si svuota */
+		if (HostBusPending() > HOST_EXT_QUEUE/2)
+			HostRun(machine, HostBusPending()*HostFrameUs(0, 8)/2);
+	}
+}
+
+
+static void ReplayLat(const char *name, const can_lat *lat)
+{
+	printf("  %-26s %6u campioni  min %5u  media %5u  max %5u us\n", name, lat->num,
+			CanCyclesToUs(lat->min), CanCyclesToUs(lat->avg), CanCyclesToUs(lat->max));
+}
+
+
+static void ReplayReport(uint64_t t0)
+{
+	const can_rx_queue *q0 = &can_dev.rx_queue[CAN_RX_FIFO0];
+	const can_rx_queue *q1 = &can_dev.rx_queue[CAN_RX_FIFO1];
+	host_frame fr;
+	uint32_t ovr, drop, rsp;
+	uint8_t i;
+
+	ovr = q0->ovr + q1->ovr;
+	drop = q0->drop + q1->drop;
+	rsp = can_dev.lat_cmd.num;
+
+	printf("bus %u bit/s, %u frame in %.3f ms (%u righe ignorate)\n", host_bus_bitrate, replay_frames,
+			(host.us - t0)/1000.0, replay_skip);
+	printf("  ricevuti dal controllore   %6u\n", host.rx);
+	printf("  accettati dai filtri hw    %6u\n", host.rx_flt);
+	printf("  accettati dal nodo         %6u  (in coda)\n", can_dev.rx);
+	printf("  persi: overrun FIFO hw     %6u  (eventi %u)\n", host.rx_ovr, ovr);
+	printf("  persi: coda sw piena       %6u\n", drop);
+	printf("  risposte                   %6u\n", rsp);
+	printf("  inviati dal nodo           %6u  (mon_fail %u, errori tx %u)\n", host.tx, can_dev.mon_fail, can_dev.error_tot);
+	printf("  coda di invio max          %6u / %u, rifiutati a coda piena %u\n", can_dev.tx_queue_max, CAN_TX_QUEUE,
+			can_dev.tx_queue_full);
+	printf("  coda FIFO0 max             %6u / %u\n", q0->max, CAN_RX_QUEUE);
+	printf("  coda FIFO1 max             %6u / %u\n", q1->max, CAN_RX_HP_QUEUE);
+	printf("  FIFO hw piene              %6u / %u, svuotamenti d'emergenza %u\n", q0->full, q1->full, can_dev.rx_drain_num);
+	printf("  e2prom: scritture %u, trasferimenti di pagina %u\n", host.ee_write, host.ee_transfer);
+	ReplayLat("ricezione -> elaborazione", &can_dev.lat_queue);
+	ReplayLat("ricezione -> risposta", &can_dev.lat_cmd);
+	ReplayLat("mailbox -> inviato", &can_dev.lat_tx);
+
+	if (replay_out) {
+		while (HostTxPop(&fr)) {
+			printf("(%llu.%06llu) vcan0 %08X#", (unsigned long long)(fr.t/1000000), (unsigned long long)(fr.t%1000000), fr.id);
+			if (fr.rtr)
+				printf("R\n");
+			else {
+				for (i=0; i!=fr.dlc; i++)
+					printf("%02X", fr.data[i]);
+				printf("\n");
+			}
+		}
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	machine_status machine;
+	uint32_t bitrate = CAN_BITRATE_250K, storm = 0, loop_us = HOST_LOOP_US;
+	uint64_t t0;
+	can_speed speed;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:n:l:s:o")) != -1) {
+		switch (c) {
+		case 'b':
+			bitrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			replay_base = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			loop_us = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			storm = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			replay_out = 1;
+			break;
+		default:
+			fprintf(stderr, "uso: %s [-b bitrate] [-n base] [-l us] [-o] (log | -s N)\n", argv[0]);
+			return 2;
+		}
+	}
+	speed = ReplaySpeed(bitrate);
+	if (speed == CAN_SPEED_NONE || loop_us == 0 || (storm == 0 && optind >= argc)) {
+		fprintf(stderr, "uso: %s [-b bitrate] [-n base] [-l us] [-o] (log | -s N)\n", argv[0]);
+		return 2;
+	}
+
+	HostInit();
+	host_loop_us = loop_us;
+	host_bus_bitrate = bitrate;
+	HostEeNode(speed, replay_base, replay_base + REPLAY_SEND_BASE);
+	HostBoot(&machine);
+
+	t0 = host.us;
+	if (storm != 0)
+		ReplayStorm(&machine, storm);
+	else if (ReplayLog(&machine, argv[optind]) != 0)
+		return 1;
+	while (HostBusPending() != 0)
+		HostRun(&machine, 1000);
+	HostRun(&machine, REPLAY_TAIL_US);
+
+	ReplayReport(t0);
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+/* incluso prima di ogni sorgente nella build host (-include): sostituisce cmsis_gcc.h,
+   le intrinsics Cortex-M diventano operazioni su variabili del processo */
+#ifndef __CMSIS_HOST_H
+#define __CMSIS_HOST_H
+
+#include <stdint.h>
+
+#define __CMSIS_GCC_H                          /* cmsis_gcc.h escluso: assembly ARM */
+
+#define __ASM                                  __asm
+#define __INLINE                               inline
+#define __STATIC_INLINE                        static inline
+#define __STATIC_FORCEINLINE                   static inline
+#define __NO_RETURN                            __attribute__((__noreturn__))
+#define __USED                                 __attribute__((used))
+#define __WEAK                                 __attribute__((weak))
+#define __PACKED                               __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT                        struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION                         union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)                           __attribute__((aligned(x)))
+#define __RESTRICT                             __restrict
+
+/* PRIMASK virtuale: gli interrupt simulati sono generati solo dal harness, mai con PRIMASK a 1 */
+extern volatile uint32_t host_primask;
+
+static inline void __enable_irq(void)         { host_primask = 0; }
+static inline void __disable_irq(void)        { host_primask = 1; }
+static inline uint32_t __get_PRIMASK(void)    { return host_primask; }
+static inline void __set_PRIMASK(uint32_t pm) { host_primask = pm; }
+
+#define __NOP()                                do { } while (0)
+#define __WFI()                                do { } while (0)
+#define __DMB()                                __sync_synchronize()
+#define __DSB()                                __sync_synchronize()
+#define __ISB()                                __sync_synchronize()
+#define __CLZ(x)                               ((uint8_t)((x) == 0 ? 32 : __builtin_clz(x)))
+
+static inline uint32_t __RBIT(uint32_t v)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i=0; i!=32; i++)
+		r |= ((v >> i) & 1U) << (31 - i);
+	return r;
+}
+
+#endif
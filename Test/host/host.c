@@ -0,0 +1,971 @@
+/* mock dell'HAL e del bus CAN per l'esecuzione di canmsg.c e machine.c su host */
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "host.h"
+#include "canmsg.h"
+#include "app_btl.h"
+#include "analog.h"
+
+#define HOST_BIT_TOL                  100               /* tolleranza di bitrate: 1/100 */
+
+
+CAN_HandleTypeDef hcan;
+volatile uint8_t can_tick_1ms;
+volatile uint8_t tick_10ms;
+uint32_t SystemCoreClock = HOST_CORE_CLK;
+
+host_node host;
+uint32_t host_bus_bitrate;
+uint32_t host_pclk1;
+uint32_t host_uid[3];
+uint32_t host_loop_us;
+uint32_t host_slow_us;
+volatile uint32_t host_primask;
+
+static uint8_t host_irq_off;        /* CPU in stallo (scrittura in flash): interrupt CAN serviti alla ripresa */
+static uint32_t host_fail;
+static uint32_t host_check;
+
+
+/* regioni della memoria del micro raggiungibili dal firmware: area condivisa col bootloader, periferiche, core */
+static void HostMap(uintptr_t addr, size_t size)
+{
+	void *p;
+
+	p = mmap((void *)addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (p != (void *)addr) {
+		fprintf(stderr, "host: mmap 0x%08lx fallita\n", (unsigned long)addr);
+		exit(2);
+	}
+}
+
+
+__attribute__((constructor)) static void HostMemInit(void)
+{
+	HostMap(SRAM_BASE, 0x10000);
+	HostMap(PERIPH_BASE, 0x30000);
+	HostMap(0xE0000000, 0x100000);
+}
+
+
+void HostCheck(int ok, const char *expr, const char *file, int line)
+{
+	host_check++;
+	if (ok)
+		return;
+	host_fail++;
+	printf("FAIL %s:%d: %s\n", file, line, expr);
+}
+
+
+int HostEnd(void)
+{
+	printf("%s: %u verifiche, %u fallite\n", host_fail ? "FAIL" : "OK", host_check, host_fail);
+	return host_fail ? 1 : 0;
+}
+
+
+uint64_t HostNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+static void HostPeriphReset(void)
+{
+	uint8_t i;
+
+	for (i=0; i!=HOST_FLT_BANKS; i++) {
+		memset(&host.flt[i], 0, sizeof(host.flt[i])); /* reset: banchi inattivi, maschera a 16bit sulla FIFO0 */
+	}
+	memset(host.fifo_num, 0, sizeof(host.fifo_num));
+	memset(host.fifo_full, 0, sizeof(host.fifo_full));
+	memset(host.fifo_ovr, 0, sizeof(host.fifo_ovr));
+	memset(host.mbx_busy, 0, sizeof(host.mbx_busy));
+	if (host.bus_src >= 0 && host.bus_src < HOST_MBX_NUM)
+		host.bus_src = -1; /* frame interrotto dal reset */
+	host.ier = 0;
+	host.bitrate = 0;
+	host.silent = 0;
+}
+
+
+void HostInit(void)
+{
+	memset(&host, 0, sizeof(host));
+	host.bus_src = -1;
+	host_irq_off = 0;
+	host_primask = 0;
+	host_bus_bitrate = 250000;
+	host_pclk1 = HOST_PCLK1;
+	host_uid[0] = 0x00350031;
+	host_uid[1] = 0x32345106;
+	host_uid[2] = 0x20383443;
+	host_loop_us = HOST_LOOP_US;
+	host_slow_us = HOST_SLOW_US;
+
+	memset(&hcan, 0, sizeof(hcan));
+	hcan.Instance = CAN1;
+	memset(CAN1, 0, sizeof(*CAN1));
+	memset((void *)APP_BTL_SHARE_ADDR, 0, sizeof(app_btl));
+	can_tick_1ms = 0;
+	tick_10ms = 0;
+	DWT->CYCCNT = 0;
+
+	/* ingressi di protezione a riposo (attivi bassi) */
+	GPIOB->IDR = TH_micro_Pin | OV_UV_micro_Pin | Overcurrent_micro_Pin;
+	GPIOB->ODR = 0;
+	GPIOC->ODR = 0;
+	GPIOA->ODR = 0;
+}
+
+
+void HostNodeSave(host_node *n)
+{
+	host.hcan = hcan;
+	host.can_tick_1ms = can_tick_1ms;
+	host.tick_10ms = tick_10ms;
+	memcpy(n, &host, sizeof(host));
+}
+
+
+void HostNodeLoad(const host_node *n)
+{
+	memcpy(&host, n, sizeof(host));
+	hcan = host.hcan;
+	can_tick_1ms = host.can_tick_1ms;
+	tick_10ms = host.tick_10ms;
+	DWT->CYCCNT = (uint32_t)(host.us * (HOST_CORE_CLK/1000000));
+}
+
+
+uint32_t HostFrameUs(uint8_t rtr, uint8_t dlc)
+{
+	uint32_t bits;
+
+	/* SOF, ID 11+18, SRR, IDE, RTR, r1 r0, DLC, dati, CRC 15+1, ACK 2, EOF 7, intermissione 3 */
+	bits = 67 + (rtr ? 0 : 8*(dlc > 8 ? 8 : dlc));
+
+	return (uint32_t)(((uint64_t)bits*1000000 + host_bus_bitrate - 1) / host_bus_bitrate);
+}
+
+
+/* bitrate programmato in BTR da HAL_CAN_Init */
+static uint32_t HostBitrate(const CAN_InitTypeDef *init)
+{
+	uint32_t ntq;
+
+	ntq = 1 + ((init->TimeSeg1 >> CAN_BTR_TS1_Pos) + 1) + ((init->TimeSeg2 >> CAN_BTR_TS2_Pos) + 1);
+	if (init->Prescaler == 0)
+		return 0;
+	return host_pclk1 / (init->Prescaler*ntq);
+}
+
+
+/* servizio degli interrupt CAN nell'ordine di HAL_CAN_IRQHandler */
+static void HostIrq(void)
+{
+	uint32_t err;
+	uint8_t f, n;
+
+	if (host_irq_off)
+		return;
+
+	err = HAL_CAN_ERROR_NONE;
+	for (f=0; f!=2; f++) {
+		if (host.fifo_ovr[f]) {
+			host.fifo_ovr[f] = 0;
+			if (host.ier & (f == 0 ? CAN_IT_RX_FIFO0_OVERRUN : CAN_IT_RX_FIFO1_OVERRUN))
+				err |= f == 0 ? HAL_CAN_ERROR_RX_FOV0 : HAL_CAN_ERROR_RX_FOV1;
+		}
+		if (host.fifo_full[f]) {
+			host.fifo_full[f] = 0;
+			if (host.ier & (f == 0 ? CAN_IT_RX_FIFO0_FULL : CAN_IT_RX_FIFO1_FULL)) {
+				if (f == 0)
+					HAL_CAN_RxFifo0FullCallback(&hcan);
+				else
+					HAL_CAN_RxFifo1FullCallback(&hcan);
+			}
+		}
+		/* l'interrupt resta attivo finche' la FIFO non e' vuota */
+		for (n=0; n!=HOST_FIFO_DEPTH && host.fifo_num[f] != 0; n++) {
+			if ((host.ier & (f == 0 ? CAN_IT_RX_FIFO0_MSG_PENDING : CAN_IT_RX_FIFO1_MSG_PENDING)) == 0)
+				break;
+			if (f == 0)
+				HAL_CAN_RxFifo0MsgPendingCallback(&hcan);
+			else
+				HAL_CAN_RxFifo1MsgPendingCallback(&hcan);
+		}
+	}
+
+	if (err != HAL_CAN_ERROR_NONE) {
+		hcan.ErrorCode |= err;
+		HAL_CAN_ErrorCallback(&hcan);
+	}
+}
+
+
+/* TEC e LEC (gia' in posizione) in ESR con i flag di warning e passive; REC e bus-off invariati */
+static void HostTec(uint32_t tec, uint32_t lec)
+{
+	uint32_t esr, rec;
+
+	rec = (CAN1->ESR & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+	esr = CAN1->ESR & (CAN_ESR_REC | CAN_ESR_BOFF);
+	esr |= (tec << CAN_ESR_TEC_Pos) | lec;
+	if (tec >= 96 || rec >= 96)
+		esr |= CAN_ESR_EWGF;
+	if (tec > 127 || rec > 127)
+		esr |= CAN_ESR_EPVF;
+	CAN1->ESR = esr;
+}
+
+
+/* errore di protocollo rilevato in ricezione (LEC) */
+static void HostLec(uint32_t err)
+{
+	if (host_irq_off || (host.ier & CAN_IT_ERROR) == 0 || (host.ier & CAN_IT_LAST_ERROR_CODE) == 0)
+		return;
+	hcan.ErrorCode |= err;
+	HAL_CAN_ErrorCallback(&hcan);
+}
+
+
+static int HostFilter(uint32_t id, uint8_t rtr, uint8_t *fmi)
+{
+	const host_flt *flt;
+	uint32_t reg;
+	uint8_t i, j, pass, idx, hit;
+
+	reg = (id << 3) | 0x04 | (rtr ? 0x02 : 0);
+	/* priorita': prima i banchi in lista, poi quelli a maschera, a parita' il banco piu' basso (solo scala a 32bit) */
+	for (pass=0; pass!=2; pass++) {
+		for (i=0; i!=HOST_FLT_BANKS; i++) {
+			flt = &host.flt[i];
+			if (flt->active == 0 || flt->scale32 == 0 || flt->list != (pass == 0))
+				continue;
+			if (flt->list)
+				hit = reg == flt->r1 ? 1 : reg == flt->r2 ? 2 : 0;
+			else
+				hit = ((reg ^ flt->r1) & flt->r2) == 0 ? 1 : 0;
+			if (hit == 0)
+				continue;
+
+			/* FilterMatchIndex: numerato per FIFO su tutti i banchi precedenti, attivi o no */
+			idx = 0;
+			for (j=0; j!=i; j++) {
+				if (host.flt[j].fifo == flt->fifo)
+					idx += host.flt[j].scale32 ? (host.flt[j].list ? 2 : 1) : (host.flt[j].list ? 4 : 2);
+			}
+			*fmi = idx + hit - 1;
+			return flt->fifo;
+		}
+	}
+
+	return -1;
+}
+
+
+static int HostDeliver(const host_frame *fr)
+{
+	uint8_t fmi;
+	int fifo;
+
+	host.rx++;
+	if (hcan.State != HAL_CAN_STATE_LISTENING)
+		return -1;
+	if (host.bitrate == 0 || (host.bitrate > host_bus_bitrate ? host.bitrate - host_bus_bitrate : host_bus_bitrate - host.bitrate)*HOST_BIT_TOL > host_bus_bitrate) {
+		host.rx_err++;
+		HostLec(HAL_CAN_ERROR_STF);
+		return -1;
+	}
+
+	fifo = HostFilter(fr->id, fr->rtr, &fmi);
+	if (fifo < 0)
+		return -1;
+	host.rx_flt++;
+	host.rx_us = host.us;
+	if (host.fifo_num[fifo] == HOST_FIFO_DEPTH) {
+		host.rx_ovr++;
+		host.fifo_ovr[fifo] = 1; /* FIFO non bloccata (RFLM = 0): l'ultimo messaggio e' sovrascritto, uno perso */
+		host.fifo[fifo][HOST_FIFO_DEPTH - 1] = *fr;
+		host.fifo_fmi[fifo][HOST_FIFO_DEPTH - 1] = fmi;
+	}
+	else {
+		host.fifo[fifo][host.fifo_num[fifo]] = *fr;
+		host.fifo_fmi[fifo][host.fifo_num[fifo]] = fmi;
+		host.fifo_num[fifo]++;
+		if (host.fifo_num[fifo] == HOST_FIFO_DEPTH)
+			host.fifo_full[fifo] = 1;
+	}
+	HostIrq();
+
+	return fifo;
+}
+
+
+int HostRx(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t *data)
+{
+	host_frame fr = {0};
+
+	fr.id = id;
+	fr.rtr = rtr;
+	fr.dlc = dlc;
+	if (data != NULL)
+		memcpy(fr.data, data, dlc > 8 ? 8 : dlc);
+	fr.t = host.us;
+
+	return HostDeliver(&fr);
+}
+
+
+int HostBusPut(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t *data, uint64_t t)
+{
+	host_frame *fr;
+
+	if (host.ext_in - host.ext_out == HOST_EXT_QUEUE)
+		return -1;
+	fr = &host.ext[host.ext_in % HOST_EXT_QUEUE];
+	memset(fr, 0, sizeof(*fr));
+	fr->id = id;
+	fr->rtr = rtr;
+	fr->dlc = dlc;
+	if (data != NULL)
+		memcpy(fr->data, data, dlc > 8 ? 8 : dlc);
+	if (host.ext_in != host.ext_out && t < host.ext[(host.ext_in - 1) % HOST_EXT_QUEUE].t)
+		t = host.ext[(host.ext_in - 1) % HOST_EXT_QUEUE].t; /* coda in ordine di tempo */
+	fr->t = t;
+	host.ext_in++;
+
+	return 0;
+}
+
+
+uint32_t HostBusPending(void)
+{
+	return host.ext_in - host.ext_out + (host.bus_src == HOST_MBX_NUM ? 1 : 0);
+}
+
+
+/* bus libero: arbitraggio fra il primo frame esterno pronto e le mailbox del nodo, vince l'ID piu' basso */
+static void HostBusStart(void)
+{
+	const host_frame *ext;
+	int8_t k, win;
+	uint32_t id;
+
+	if (host.bus_src >= 0)
+		return;
+
+	win = -1;
+	id = 0;
+	if (hcan.State == HAL_CAN_STATE_LISTENING && host.silent == 0) {
+		for (k=0; k!=HOST_MBX_NUM; k++) {
+			if (host.mbx_busy[k] == 0 || host.mbx[k].t > host.us)
+				continue;
+			/* TXFP: in ordine di richiesta, altrimenti per ID e a parita' per mailbox */
+			if (win < 0 || (hcan.Init.TransmitFifoPriority == ENABLE ? host.mbx[k].t < host.mbx[win].t : host.mbx[k].id < id)) {
+				win = k;
+				id = host.mbx[k].id;
+			}
+		}
+	}
+	if (host.ext_in != host.ext_out && host.unplugged == 0) {
+		ext = &host.ext[host.ext_out % HOST_EXT_QUEUE];
+		if (ext->t <= host.us && (win < 0 || ext->id < id))
+			win = HOST_MBX_NUM;
+	}
+	if (win < 0)
+		return;
+
+	host.bus_src = win;
+	host.bus_frame = win == HOST_MBX_NUM ? host.ext[host.ext_out % HOST_EXT_QUEUE] : host.mbx[win];
+	host.bus_end = host.us + HostFrameUs(host.bus_frame.rtr, host.bus_frame.dlc);
+	if (win == HOST_MBX_NUM)
+		host.ext_out++;
+}
+
+
+static void HostBusEnd(void)
+{
+	uint32_t tec;
+	int8_t src;
+
+	src = host.bus_src;
+	host.bus_src = -1;
+	host.bus_frame.t = host.us;
+	if (src == HOST_MBX_NUM) {
+		HostDeliver(&host.bus_frame);
+		return;
+	}
+
+	tec = (CAN1->ESR & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+	if (host.unplugged) {
+		/* errore di ACK: TEC +8, ma non in error passive (ISO 11898-1); la mailbox resta piena e il frame
+		   e' ritrasmesso */
+		if (tec <= 127)
+			tec += 8;
+		HostTec(tec, CAN_ESR_LEC_0 | CAN_ESR_LEC_1);
+		HostLec(HAL_CAN_ERROR_ACK);
+		return;
+	}
+	if (tec != 0)
+		HostTec(tec - 1, 0);
+
+	host.mbx_busy[src] = 0;
+	host.tx++;
+	if (host.tx_in - host.tx_out != HOST_TX_LOG) {
+		host.tx_log[host.tx_in % HOST_TX_LOG] = host.bus_frame;
+		host.tx_in++;
+	}
+	if (host_irq_off == 0 && (host.ier & CAN_IT_TX_MAILBOX_EMPTY)) {
+		if (src == 0)
+			HAL_CAN_TxMailbox0CompleteCallback(&hcan);
+		else if (src == 1)
+			HAL_CAN_TxMailbox1CompleteCallback(&hcan);
+		else
+			HAL_CAN_TxMailbox2CompleteCallback(&hcan);
+	}
+}
+
+
+static void HostSysTick(void)
+{
+	host.tick++;
+	can_tick_1ms++;
+	MachineTick();
+	if (host.tick % 10 == 0)
+		tick_10ms = 1;
+}
+
+
+void HostAdvance(uint32_t us)
+{
+	uint64_t end, next, t_tick;
+	const host_frame *ext;
+
+	end = host.us + us;
+	for (;;) {
+		HostBusStart();
+
+		next = end;
+		t_tick = ((uint64_t)host.systick + 1)*1000;
+		if (t_tick < next)
+			next = t_tick;
+		if (host.bus_src >= 0 && host.bus_end < next)
+			next = host.bus_end;
+		if (host.bus_src < 0 && host.ext_in != host.ext_out) {
+			ext = &host.ext[host.ext_out % HOST_EXT_QUEUE];
+			if (ext->t > host.us && ext->t < next)
+				next = ext->t;
+		}
+
+		host.us = next;
+		DWT->CYCCNT = (uint32_t)(host.us * (HOST_CORE_CLK/1000000));
+		if (host.bus_src >= 0 && host.bus_end == host.us)
+			HostBusEnd();
+		if (host.us == t_tick) {
+			host.systick++;
+			/* CPU in stallo: un solo pending, i periodi intermedi sono persi come su SysTick */
+			if (host_irq_off)
+				host.systick_pend = 1;
+			else
+				HostSysTick();
+		}
+		if (host.us >= end)
+			break;
+	}
+}
+
+
+/* scrittura in flash: la CPU e' ferma, la periferica continua a ricevere nelle FIFO hw */
+static void HostStall(void)
+{
+	uint32_t cost;
+
+	if (host.cost_us == 0)
+		return;
+	cost = host.cost_us;
+	host.cost_us = 0;
+	host_irq_off = 1;
+	HostAdvance(cost);
+	host_irq_off = 0;
+	if (host.systick_pend) {
+		host.systick_pend = 0;
+		HostSysTick();
+	}
+	HostIrq();
+}
+
+
+/* passo di MachineLogic; con run il tempo avanza della durata dichiarata di ogni parte */
+static void HostStep(machine_status *machine, int run)
+{
+	if (CanMsgManager(host.loop_tick, machine) != 0) {
+		machine->enable_power = 0;
+		machine->switch_on = 0;
+		MachineFault();
+	}
+	host.loop_tick = 0;
+	if (run) {
+		HostStall();
+		HostAdvance(host_loop_us);
+	}
+
+	if (tick_10ms) {
+		tick_10ms = 0;
+		host.loop_tick = 1;
+		AnalogManager(machine);
+		if (run)
+			HostAdvance(host_slow_us);
+		/* come in MachineLogic: svuotamento d'emergenza dopo la parte lenta del passo */
+		CanMsgRxDrain(machine);
+		MachineOutputUpdate(machine);
+		if (run)
+			HostStall();
+	}
+}
+
+
+void HostEeNode(uint8_t speed, uint32_t base, uint32_t base_send)
+{
+	HostEeSet(FLASH_ADDR_SPEED_ID, speed);
+	if (base == 0)
+		return;
+	HostEeSet(FLASH_ADDR_CANID_H, base >> 16);
+	HostEeSet(FLASH_ADDR_CANID_L, base & 0xFFFF);
+	HostEeSet(FLASH_ADDR_CANID_SEND_H, base_send >> 16);
+	HostEeSet(FLASH_ADDR_CANID_SEND_L, base_send & 0xFFFF);
+}
+
+
+void HostBoot(machine_status *machine)
+{
+	memset(machine, 0, sizeof(*machine));
+	MachineCmdRefresh(0, 0);
+	AnalogInit();
+	CanMsgInit();
+	MachineOutputUpdate(machine);
+}
+
+
+void HostLoop(machine_status *machine)
+{
+	HostStep(machine, 0);
+}
+
+
+void HostRun(machine_status *machine, uint32_t us)
+{
+	uint64_t end;
+
+	end = host.us + us;
+	while (host.us < end)
+		HostStep(machine, 1);
+}
+
+
+int HostTxPop(host_frame *f)
+{
+	if (host.tx_in == host.tx_out)
+		return 0;
+	*f = host.tx_log[host.tx_out % HOST_TX_LOG];
+	host.tx_out++;
+
+	return 1;
+}
+
+
+void HostTxClear(void)
+{
+	host.tx_out = host.tx_in;
+}
+
+
+uint8_t HostPin(GPIO_TypeDef *port, uint16_t pin)
+{
+	return (port->ODR & pin) != 0;
+}
+
+
+static int HostPort(const GPIO_TypeDef *port)
+{
+	if (port == GPIOA)
+		return 0;
+	if (port == GPIOB)
+		return 1;
+	if (port == GPIOC)
+		return 2;
+	return -1;
+}
+
+
+uint64_t HostPinFall(GPIO_TypeDef *port, uint16_t pin)
+{
+	int p;
+
+	p = HostPort(port);
+	if (p < 0 || pin == 0)
+		return 0;
+	return host.pin_fall[p][__builtin_ctz(pin)];
+}
+
+
+void HostEeSet(uint16_t addr, uint16_t val)
+{
+	if (addr > NumbOfVar)
+		return;
+	host.ee_val[addr] = val;
+	host.ee_set[addr] = 1;
+}
+
+
+int HostEeGet(uint16_t addr, uint16_t *val)
+{
+	if (addr > NumbOfVar || host.ee_set[addr] == 0)
+		return -1;
+	*val = host.ee_val[addr];
+
+	return 0;
+}
+
+
+/* HAL_CAN */
+
+static int HostCanReady(CAN_HandleTypeDef *h)
+{
+	if (h->State == HAL_CAN_STATE_READY || h->State == HAL_CAN_STATE_LISTENING)
+		return 1;
+	h->ErrorCode |= HAL_CAN_ERROR_NOT_INITIALIZED;
+	return 0;
+}
+
+
+HAL_StatusTypeDef HAL_CAN_Init(CAN_HandleTypeDef *h)
+{
+	if (h == NULL)
+		return HAL_ERROR;
+	host.bitrate = HostBitrate(&h->Init);
+	host.silent = h->Init.Mode == CAN_MODE_SILENT || h->Init.Mode == CAN_MODE_SILENT_LOOPBACK;
+	h->ErrorCode = HAL_CAN_ERROR_NONE;
+	h->State = HAL_CAN_STATE_READY;
+
+	return HAL_OK;
+}
+
+
+/* il reset della periferica (RCC_APB1RSTR) non e' intercettabile: i registri si azzerano qui */
+HAL_StatusTypeDef HAL_CAN_DeInit(CAN_HandleTypeDef *h)
+{
+	if (h == NULL)
+		return HAL_ERROR;
+	HAL_CAN_Stop(h);
+	HostPeriphReset();
+	h->ErrorCode = HAL_CAN_ERROR_NONE;
+	h->State = HAL_CAN_STATE_RESET;
+
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_CAN_Start(CAN_HandleTypeDef *h)
+{
+	if (h->State != HAL_CAN_STATE_READY) {
+		h->ErrorCode |= HAL_CAN_ERROR_NOT_READY;
+		return HAL_ERROR;
+	}
+	h->State = HAL_CAN_STATE_LISTENING;
+	h->ErrorCode = HAL_CAN_ERROR_NONE;
+
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_CAN_Stop(CAN_HandleTypeDef *h)
+{
+	if (h->State != HAL_CAN_STATE_LISTENING) {
+		h->ErrorCode |= HAL_CAN_ERROR_NOT_STARTED;
+		return HAL_ERROR;
+	}
+	h->State = HAL_CAN_STATE_READY;
+
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_CAN_ConfigFilter(CAN_HandleTypeDef *h, CAN_FilterTypeDef *cfg)
+{
+	host_flt *flt;
+
+	if (HostCanReady(h) == 0 || cfg->FilterBank >= HOST_FLT_BANKS)
+		return HAL_ERROR;
+
+	flt = &host.flt[cfg->FilterBank];
+	flt->active = cfg->FilterActivation == ENABLE;
+	flt->list = cfg->FilterMode == CAN_FILTERMODE_IDLIST;
+	flt->scale32 = cfg->FilterScale == CAN_FILTERSCALE_32BIT;
+	flt->fifo = cfg->FilterFIFOAssignment == CAN_FILTER_FIFO1 ? 1 : 0;
+	flt->r1 = ((cfg->FilterIdHigh & 0xFFFF) << 16) | (cfg->FilterIdLow & 0xFFFF);
+	flt->r2 = ((cfg->FilterMaskIdHigh & 0xFFFF) << 16) | (cfg->FilterMaskIdLow & 0xFFFF);
+
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_CAN_ActivateNotification(CAN_HandleTypeDef *h, uint32_t its)
+{
+	if (HostCanReady(h) == 0)
+		return HAL_ERROR;
+	host.ier |= its;
+
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_CAN_AddTxMessage(CAN_HandleTypeDef *h, CAN_TxHeaderTypeDef *header, uint8_t data[], uint32_t *mbx)
+{
+	host_frame *fr;
+	uint8_t k;
+
+	if (HostCanReady(h) == 0)
+		return HAL_ERROR;
+	for (k=0; k!=HOST_MBX_NUM && host.mbx_busy[k]; k++)
+		;
+	if (k == HOST_MBX_NUM) {
+		h->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+
+	fr = &host.mbx[k];
+	memset(fr, 0, sizeof(*fr));
+	fr->id = header->IDE == CAN_ID_EXT ? header->ExtId : header->StdId << 18;
+	fr->rtr = header->RTR != CAN_RTR_DATA;
+	fr->dlc = header->DLC;
+	memcpy(fr->data, data, 8);
+	fr->t = host.us;
+	host.mbx_busy[k] = 1;
+	*mbx = 1U << k;
+
+	return HAL_OK;
+}
+
+
+uint32_t HAL_CAN_GetTxMailboxesFreeLevel(CAN_HandleTypeDef *h)
+{
+	uint32_t n = 0;
+	uint8_t k;
+
+	if (h->State != HAL_CAN_STATE_READY && h->State != HAL_CAN_STATE_LISTENING)
+		return 0;
+	for (k=0; k!=HOST_MBX_NUM; k++) {
+		if (host.mbx_busy[k] == 0)
+			n++;
+	}
+
+	return n;
+}
+
+
+HAL_StatusTypeDef HAL_CAN_GetRxMessage(CAN_HandleTypeDef *h, uint32_t fifo, CAN_RxHeaderTypeDef *header, uint8_t data[])
+{
+	const host_frame *fr;
+	uint8_t f;
+
+	if (HostCanReady(h) == 0)
+		return HAL_ERROR;
+	f = fifo == CAN_RX_FIFO1 ? 1 : 0;
+	if (host.fifo_num[f] == 0) {
+		h->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+
+	fr = &host.fifo[f][0];
+	header->IDE = CAN_ID_EXT;
+	header->ExtId = fr->id;
+	header->StdId = 0;
+	header->RTR = fr->rtr ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+	header->DLC = fr->dlc;
+	header->Timestamp = 0;
+	header->FilterMatchIndex = host.fifo_fmi[f][0];
+	memcpy(data, fr->data, 8); /* come l'HAL: sempre 8 byte */
+
+	host.fifo_num[f]--;
+	memmove(&host.fifo[f][0], &host.fifo[f][1], host.fifo_num[f]*sizeof(host_frame));
+	memmove(&host.fifo_fmi[f][0], &host.fifo_fmi[f][1], host.fifo_num[f]);
+
+	return HAL_OK;
+}
+
+
+uint32_t HAL_CAN_GetRxFifoFillLevel(CAN_HandleTypeDef *h, uint32_t fifo)
+{
+	if (h->State != HAL_CAN_STATE_READY && h->State != HAL_CAN_STATE_LISTENING)
+		return 0;
+	return host.fifo_num[fifo == CAN_RX_FIFO1 ? 1 : 0];
+}
+
+
+uint32_t HAL_CAN_GetError(CAN_HandleTypeDef *h)
+{
+	return h->ErrorCode;
+}
+
+
+HAL_StatusTypeDef HAL_CAN_ResetError(CAN_HandleTypeDef *h)
+{
+	if (HostCanReady(h) == 0)
+		return HAL_ERROR;
+	h->ErrorCode = HAL_CAN_ERROR_NONE;
+
+	return HAL_OK;
+}
+
+
+HAL_CAN_StateTypeDef HAL_CAN_GetState(CAN_HandleTypeDef *h)
+{
+	return h->State;
+}
+
+
+/* HAL di sistema, GPIO, flash */
+
+uint32_t HAL_GetTick(void)
+{
+	return host.tick;
+}
+
+
+void HAL_Delay(uint32_t ms)
+{
+	HostAdvance(ms*1000);
+}
+
+
+void HAL_NVIC_SystemReset(void)
+{
+	printf("host: HAL_NVIC_SystemReset\n");
+}
+
+
+uint32_t HAL_GetUIDw0(void)
+{
+	return host_uid[0];
+}
+
+
+uint32_t HAL_GetUIDw1(void)
+{
+	return host_uid[1];
+}
+
+
+uint32_t HAL_GetUIDw2(void)
+{
+	return host_uid[2];
+}
+
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+	return host_pclk1;
+}
+
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *port, uint16_t pin)
+{
+	return (port->IDR & pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+
+static void HostPinWrite(GPIO_TypeDef *port, uint32_t odr)
+{
+	uint32_t fall;
+	int p;
+	uint8_t i;
+
+	fall = port->ODR & ~odr;
+	port->ODR = odr;
+	p = HostPort(port);
+	for (i=0; p >= 0 && i!=16; i++) {
+		if (fall & (1UL << i))
+			host.pin_fall[p][i] = host.us;
+	}
+}
+
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state)
+{
+	if (state == GPIO_PIN_RESET)
+		HostPinWrite(port, port->ODR & ~(uint32_t)pin);
+	else
+		HostPinWrite(port, port->ODR | pin);
+}
+
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *port, uint16_t pin)
+{
+	HostPinWrite(port, port->ODR ^ pin);
+}
+
+
+void FLASH_Unlock(void)
+{
+}
+
+
+void FLASH_Lock(void)
+{
+}
+
+
+uint16_t EE_Init(void)
+{
+	return FLASH_COMPLETE;
+}
+
+
+uint16_t EE_ReadVariable(uint16_t addr, uint16_t *val)
+{
+	return HostEeGet(addr, val) == 0 ? 0 : 1;
+}
+
+
+/* ogni scrittura occupa una posizione della pagina attiva; a pagina piena il trasferimento
+   (EE_PageTransfer) cancella la pagina e ricopia le variabili valide */
+uint16_t EE_WriteVariable(uint16_t addr, uint16_t val)
+{
+	uint16_t i, n;
+
+	HostEeSet(addr, val);
+	host.ee_write++;
+	host.cost_us += HOST_EE_WRITE_US;
+	host.ee_slot++;
+	if (host.ee_slot >= HOST_EE_SLOTS) {
+		n = 0;
+		for (i=0; i<=NumbOfVar; i++)
+			n += host.ee_set[i];
+		host.ee_transfer++;
+		host.ee_slot = n;
+		host.cost_us += HOST_EE_ERASE_US + n*HOST_EE_WRITE_US;
+	}
+
+	return FLASH_COMPLETE;
+}
+
+
+void AnalogInit(void)
+{
+}
+
+
+void AnalogManager(machine_status *machine)
+{
+	machine->t_sample = HAL_GetTick();
+}
@@ -0,0 +1,134 @@
+/* harness host di canmsg.c: bxCAN e bus virtuali, tempo virtuale in us, e2prom in RAM.
+   Il firmware gira a costo zero nel tempo virtuale: i tempi misurati sono quelli di bus, di coda
+   e dei costi dichiarati (host_loop_us, host_slow_us, scritture in e2prom) */
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "main.h"
+#include "machine.h"
+
+#define HOST_PCLK1                    36000000 /* HSE 8MHz * 9 / 2, come SystemClock_Config */
+#define HOST_CORE_CLK                 72000000
+#define HOST_FIFO_DEPTH               3        /* messaggi per FIFO hw */
+#define HOST_FLT_BANKS                14
+#define HOST_MBX_NUM                  3
+#define HOST_EXT_QUEUE                1024     /* frame degli altri nodi in attesa del bus */
+#define HOST_TX_LOG                   256      /* frame inviati dal nodo in attesa di HostTxPop */
+#define HOST_LOOP_US                  20       /* durata di un passo di CanMsgManager */
+#define HOST_SLOW_US                  200      /* durata del passo da 10ms (AnalogManager, Logic, Leds) */
+#define HOST_EE_WRITE_US              50       /* programmazione di una variabile in e2prom */
+#define HOST_EE_ERASE_US              40000    /* cancellazione delle 2 pagine fisiche di una pagina e2prom */
+#define HOST_EE_SLOTS                 (PAGE_SIZE/4 - 1) /* variabili (valore + indirizzo) per pagina, esclusa l'intestazione */
+
+typedef struct {
+	uint32_t id;                /* ID esteso */
+	uint8_t rtr;
+	uint8_t dlc;
+	uint8_t data[8];
+	uint64_t t;                 /* us: pronto per il bus (in coda) o fine della trasmissione (inviato) */
+} host_frame;
+
+typedef struct {
+	uint8_t active;
+	uint8_t list;               /* CAN_FILTERMODE_IDLIST */
+	uint8_t scale32;            /* CAN_FILTERSCALE_32BIT, al reset i banchi sono a 16bit */
+	uint8_t fifo;
+	uint32_t r1, r2;            /* registri FiR1, FiR2 */
+} host_flt;
+
+/* stato completo del nodo simulato: salvato e ripristinato per simulare piu' nodi nello stesso processo */
+typedef struct {
+	uint64_t us;                /* tempo virtuale */
+	uint32_t tick;              /* HAL_GetTick */
+	uint32_t systick;           /* periodi di SysTick trascorsi */
+	uint8_t systick_pend;       /* SysTick scaduto con la CPU in stallo: servito alla ripresa */
+	uint8_t loop_tick;          /* passo da 10ms in corso (argomento tick di CanMsgManager) */
+	uint8_t can_tick_1ms;
+	uint8_t tick_10ms;
+	uint32_t cost_us;           /* costo dichiarato dal firmware nell'ultimo passo (scritture in e2prom) */
+
+	CAN_HandleTypeDef hcan;     /* copia di hcan */
+	uint32_t ier;               /* CAN_IT_xxx attivi */
+	uint32_t bitrate;           /* bitrate configurato (HAL_CAN_Init) */
+	uint8_t silent;
+	host_flt flt[HOST_FLT_BANKS];
+	host_frame fifo[2][HOST_FIFO_DEPTH];
+	uint8_t fifo_fmi[2][HOST_FIFO_DEPTH];
+	uint8_t fifo_num[2];
+	uint8_t fifo_full[2];       /* flag FULL non ancora servito */
+	uint8_t fifo_ovr[2];        /* flag FOVR non ancora servito */
+	uint8_t mbx_busy[HOST_MBX_NUM];
+	host_frame mbx[HOST_MBX_NUM];
+
+	/* bus */
+	host_frame ext[HOST_EXT_QUEUE]; /* frame degli altri nodi, in ordine di t */
+	uint32_t ext_in, ext_out;
+	int8_t bus_src;             /* frame sul bus: -1 nessuno, 0..2 mailbox del nodo, 3 frame esterno */
+	host_frame bus_frame;
+	uint64_t bus_end;
+	uint8_t unplugged;          /* nodo scollegato: nessun frame esterno e nessun ACK ai frame del nodo */
+	host_frame tx_log[HOST_TX_LOG];
+	uint32_t tx_in, tx_out;
+
+	/* uscite */
+	uint64_t pin_fall[3][16];   /* us dell'ultimo fronte di discesa, porte GPIOA..GPIOC */
+
+	/* e2prom */
+	uint16_t ee_val[NumbOfVar + 1];
+	uint8_t ee_set[NumbOfVar + 1];
+	uint16_t ee_slot;           /* variabili scritte nella pagina attiva */
+
+	/* contatori */
+	uint32_t rx;                /* frame completati sul bus dagli altri nodi */
+	uint32_t rx_flt;            /* accettati dai filtri hw */
+	uint64_t rx_us;             /* us dell'ultimo frame accettato dai filtri hw */
+	uint32_t rx_ovr;            /* persi per FIFO hw piena */
+	uint32_t rx_err;            /* ricevuti con bitrate diverso (errore di bus) */
+	uint32_t tx;                /* frame inviati dal nodo */
+	uint32_t ee_write;          /* scritture in e2prom */
+	uint32_t ee_transfer;       /* trasferimenti di pagina */
+} host_node;
+
+extern host_node host;              /* nodo in esecuzione */
+extern uint32_t host_bus_bitrate;   /* bitrate reale del bus */
+extern uint32_t host_pclk1;         /* PCLK1 restituito da HAL_RCC_GetPCLK1Freq */
+extern uint32_t host_uid[3];        /* UID restituito da HAL_GetUIDw0..2 */
+extern uint32_t host_loop_us;       /* durata di un passo di CanMsgManager */
+extern uint32_t host_slow_us;       /* durata del passo da 10ms */
+extern volatile uint32_t host_primask;
+
+/* verifica: stampa l'errore e conta il fallimento, il programma termina con HostEnd */
+#define HOST_CHECK(c)                 HostCheck((c) != 0, #c, __FILE__, __LINE__)
+
+void HostInit(void);
+int HostEnd(void);
+void HostCheck(int ok, const char *expr, const char *file, int line);
+void HostNodeSave(host_node *n);
+void HostNodeLoad(const host_node *n);
+
+uint32_t HostFrameUs(uint8_t rtr, uint8_t dlc); /* durata di un frame esteso sul bus (senza bit di stuffing) */
+void HostAdvance(uint32_t us);      /* avanza il tempo: SysTick ogni ms, arbitraggio e trasmissione dei frame */
+void HostEeNode(uint8_t speed, uint32_t base, uint32_t base_send); /* e2prom di un nodo configurato (base 0: solo velocita') */
+void HostBoot(machine_status *machine); /* avvio come MachineInit: parametri dalla e2prom simulata (HostEeSet) */
+void HostLoop(machine_status *machine); /* un passo del ciclo macchina (MachineLogic), senza avanzare il tempo */
+void HostRun(machine_status *machine, uint32_t us); /* ciclo macchina per us, ogni passo costa host_loop_us */
+
+/* frame di un altro nodo: sul bus appena libero e vinto l'arbitraggio, non prima di t us */
+int HostBusPut(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t *data, uint64_t t);
+uint32_t HostBusPending(void);      /* frame esterni non ancora trasmessi */
+/* frame ricevuto subito dal nodo, senza occupare il bus (ritorna la FIFO o -1 se scartato dai filtri) */
+int HostRx(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t *data);
+int HostTxPop(host_frame *f);       /* frame inviati dal nodo in ordine, 0 se nessuno */
+void HostTxClear(void);
+
+uint8_t HostPin(GPIO_TypeDef *port, uint16_t pin);
+uint64_t HostPinFall(GPIO_TypeDef *port, uint16_t pin); /* us dell'ultimo passaggio a 0 (0 se mai) */
+void HostEeSet(uint16_t addr, uint16_t val);
+int HostEeGet(uint16_t addr, uint16_t *val);
+
+uint64_t HostNs(void);              /* tempo reale del processo host, per i confronti di costo */
+
+#endif
@@ -0,0 +1,116 @@
+/* ricerca automatica della velocita': tempo di lock per ogni velocita' del bus, limite di
+   CAN_SPEED_NONE*CAN_AUTOBAUD_DWELL*CAN_AUTOBAUD_SWEEP ms con bus muto o a velocita' non supportata,
+   velocita' salvata in e2prom e ricezione registrata ad una velocita' gia' abbandonata */
+#include "host.h"
+#include "canmsg.c"
+
+#define TEST_PERIOD_MS                50     /* traffico di un altro nodo: un messaggio ogni 50ms */
+#define TEST_ID                       0x18FF0010
+#define TEST_LOCK_MAX_MS              (CAN_SPEED_NONE*CAN_AUTOBAUD_DWELL*CAN_AUTOBAUD_SWEEP)
+
+static const uint32_t test_rate[CAN_SPEED_NONE] = {
+	CAN_BITRATE_1M, CAN_BITRATE_800K, CAN_BITRATE_500K, CAN_BITRATE_250K, CAN_BITRATE_125K,
+	CAN_BITRATE_100K, CAN_BITRATE_50K, CAN_BITRATE_20K, CAN_BITRATE_10K,
+};
+
+
+static void TestBoot(machine_status *machine, uint32_t bitrate)
+{
+	memset(&can_dev, 0, sizeof(can_dev));
+	HostInit();
+	host_bus_bitrate = bitrate;
+	HostEeNode(CAN_SPEED_AUTO, 0x100, 0x300);
+	HostBoot(machine);
+}
+
+
+/* traffico periodico fino al lock o al limite della ricerca; ritorna i ms dall'avvio */
+static uint32_t TestSearch(machine_status *machine, uint8_t traffic)
+{
+	uint8_t data[8] = {0x12, 0x34};
+	uint64_t t0;
+
+	t0 = host.us;
+	while (can_dev.autobaud && host.us - t0 < (TEST_LOCK_MAX_MS + 1000)*1000ULL) {
+		if (traffic)
+			HostBusPut(TEST_ID, 0, 2, data, host.us);
+		HostRun(machine, TEST_PERIOD_MS*1000);
+	}
+
+	return (host.us - t0)/1000;
+}
+
+
+static void TestLock(can_speed speed)
+{
+	machine_status machine;
+	uint16_t val;
+
+	TestBoot(&machine, test_rate[speed]);
+	HOST_CHECK(can_dev.autobaud == 1 && host.silent == 1);
+	TestSearch(&machine, 1);
+	HOST_CHECK(host.tx == 0); /* nessun invio durante la ricerca */
+	HostRun(&machine, 20000);
+
+	printf("%8u bit/s  lock %5u ms  velocita' %u  frame ricevuti a velocita' errata %u\n", test_rate[speed],
+			can_dev.autobaud_lock_time, can_dev.speed, host.rx_err);
+	HOST_CHECK(can_dev.autobaud == 0 && can_dev.autobaud_fail == 0);
+	HOST_CHECK(can_dev.speed == speed && host.bitrate == test_rate[speed] && host.silent == 0);
+	/* la velocita' giusta e' la speed-esima provata: lock entro la sua finestra piu' un periodo del traffico */
+	HOST_CHECK(can_dev.autobaud_lock_time <= speed*CAN_AUTOBAUD_DWELL + TEST_PERIOD_MS + 10);
+	HOST_CHECK(can_dev.autobaud_lock_time <= TEST_LOCK_MAX_MS);
+	HOST_CHECK(HostEeGet(FLASH_ADDR_SPEED_ID, &val) == 0 && val == speed);
+	HOST_CHECK(host.rx_err == 0 || speed != CAN_SPEED_1M);
+}
+
+
+/* nessun messaggio ricevibile: ricerca conclusa al limite, ultima velocita' nota, e2prom invariata */
+static void TestFail(uint32_t bitrate, uint8_t traffic)
+{
+	machine_status machine;
+	uint32_t ms;
+	uint16_t val;
+
+	TestBoot(&machine, bitrate);
+	ms = TestSearch(&machine, traffic);
+	printf("%8u bit/s  %s: ricerca conclusa in %u ms, velocita' %u\n", bitrate,
+			traffic ? "velocita' non supportata" : "bus muto", ms, can_dev.speed);
+	HOST_CHECK(can_dev.autobaud == 0 && can_dev.autobaud_fail == 1);
+	HOST_CHECK(ms >= TEST_LOCK_MAX_MS && ms <= TEST_LOCK_MAX_MS + TEST_PERIOD_MS);
+	HOST_CHECK(can_dev.speed == CAN_SPEED_250K && host.silent == 0);
+	HOST_CHECK(HostEeGet(FLASH_ADDR_SPEED_ID, &val) == 0 && val == CAN_SPEED_AUTO);
+}
+
+
+/* ricezione registrata dall'ISR alla velocita' precedente, letta dopo il passaggio alla successiva:
+   nessun lock sulla velocita' in prova */
+static void TestRace(void)
+{
+	machine_status machine;
+
+	TestBoot(&machine, 0); /* bus senza velocita': nessuna ricezione valida */
+	HostRun(&machine, (CAN_AUTOBAUD_DWELL + 10)*1000);
+	HOST_CHECK(can_dev.autobaud && can_dev.autobaud_speed == CAN_SPEED_800K);
+	can_dev.autobaud_rx = CAN_SPEED_1M;
+	HostRun(&machine, 10000);
+	HOST_CHECK(can_dev.autobaud && can_dev.autobaud_speed == CAN_SPEED_800K);
+
+	/* ricezione alla velocita' in prova: lock */
+	can_dev.autobaud_rx = CAN_SPEED_800K;
+	HostRun(&machine, 10000);
+	HOST_CHECK(can_dev.autobaud == 0 && can_dev.speed == CAN_SPEED_800K);
+}
+
+
+int main(void)
+{
+	uint8_t i;
+
+	for (i=0; i!=CAN_SPEED_NONE; i++)
+		TestLock(i);
+	TestFail(0, 0);
+	TestFail(83333, 1);
+	TestRace();
+
+	return HostEnd();
+}
@@ -0,0 +1,62 @@
+/* bit timing per ogni velocita' a PCLK1 36MHz: prescaler, BS1 e BS2 uguali alla vecchia CanSpeedInit (nodi in campo),
+   bitrate programmato esatto; confronto con il calcolo CAN_BT usato per gli altri clock */
+#include "host.h"
+#include "canmsg.c"
+
+typedef struct {
+	uint32_t bitrate;
+	uint16_t prescaler;
+	uint8_t bs1;                /* quanti */
+	uint8_t bs2;
+} test_bt;
+
+/* valori della CanSpeedInit originale (switch per velocita') */
+static const test_bt test_tab[CAN_SPEED_NONE] = {
+	{CAN_BITRATE_1M,   4,   6,  2},
+	{CAN_BITRATE_800K, 3,   12, 2},
+	{CAN_BITRATE_500K, 4,   14, 3},
+	{CAN_BITRATE_250K, 9,   13, 2},
+	{CAN_BITRATE_125K, 18,  13, 2},
+	{CAN_BITRATE_100K, 24,  11, 3},
+	{CAN_BITRATE_50K,  45,  13, 2},
+	{CAN_BITRATE_20K,  120, 12, 2},
+	{CAN_BITRATE_10K,  225, 13, 2},
+};
+
+
+int main(void)
+{
+	const can_bit_timing bt_calc[CAN_SPEED_NONE] = {
+		CAN_BT(CAN_BITRATE_1M), CAN_BT(CAN_BITRATE_800K), CAN_BT(CAN_BITRATE_500K),
+		CAN_BT(CAN_BITRATE_250K), CAN_BT(CAN_BITRATE_125K), CAN_BT(CAN_BITRATE_100K),
+		CAN_BT(CAN_BITRATE_50K), CAN_BT(CAN_BITRATE_20K), CAN_BT(CAN_BITRATE_10K),
+	};
+	const test_bt *t;
+	uint32_t bs1, bs2, ntq;
+	uint8_t i;
+
+	HOST_CHECK(CAN_PCLK1 == HOST_PCLK1);
+	HostInit();
+	printf("velocita'  prescaler BS1 BS2  campionamento  calcolo CAN_BT\n");
+	for (i=0; i!=CAN_SPEED_NONE; i++) {
+		t = &test_tab[i];
+		bs1 = (can_bit_timing_tab[i].bs1 >> CAN_BTR_TS1_Pos) + 1;
+		bs2 = (can_bit_timing_tab[i].bs2 >> CAN_BTR_TS2_Pos) + 1;
+		HOST_CHECK(can_bit_timing_tab[i].prescaler == t->prescaler && bs1 == t->bs1 && bs2 == t->bs2);
+
+		/* bitrate effettivo programmato da CanSpeedInit */
+		CanSpeedInit(i);
+		HOST_CHECK(can_dev.clk_err == 0 && host.bitrate == t->bitrate);
+		HOST_CHECK(hcan.Init.Prescaler == t->prescaler && hcan.Init.SyncJumpWidth == CAN_SJW_1TQ);
+
+		/* il calcolo generico da' lo stesso bitrate esatto, anche dove i segmenti differiscono */
+		ntq = 1 + ((bt_calc[i].bs1 >> CAN_BTR_TS1_Pos) + 1) + ((bt_calc[i].bs2 >> CAN_BTR_TS2_Pos) + 1);
+		HOST_CHECK(HOST_PCLK1 / (bt_calc[i].prescaler*ntq) == t->bitrate);
+		printf("%8u  %9u %3u %3u  %12.1f%%  %u/%u/%u %s\n", t->bitrate, t->prescaler, bs1, bs2,
+				100.0*(1 + bs1)/(1 + bs1 + bs2), bt_calc[i].prescaler, (bt_calc[i].bs1 >> CAN_BTR_TS1_Pos) + 1,
+				(bt_calc[i].bs2 >> CAN_BTR_TS2_Pos) + 1,
+				memcmp(&bt_calc[i], &can_bit_timing_tab[i], sizeof(can_bit_timing)) ? "(diverso, non usato a 36MHz)" : "");
+	}
+
+	return HostEnd();
+}
@@ -0,0 +1,121 @@
+/* nodo scollegato dal bus a uscite attive: errori di ACK fino ad error passive, dove TEC non cresce piu' e il bus-off
+   non arriva; uscite spente entro MSG_ERROR_TO ms dal limite di invii falliti, nessuno spegnimento per un'interruzione
+   breve, ripresa al ricollegamento con un nuovo comando */
+#include "host.h"
+#include "canmsg.c"
+
+#define TEST_BASE                     0x100
+#define TEST_BASE_SEND                0x300
+#define TEST_GLITCH_US                10000  /* interruzione breve: meno del tempo di scatto */
+#define TEST_WAIT_US                  1000000
+
+
+static void TestOut(machine_status *machine, uint8_t on)
+{
+	uint8_t data[4] = {0};
+
+	data[0] = on; /* enable_power */
+	data[2] = on; /* switch_on */
+	HOST_CHECK(HostBusPut(can_dev.rx_id[MSG_OUT_ENABLE], 0, 4, data, host.us) == 0);
+	HostRun(machine, 20000);
+}
+
+
+static uint8_t TestOn(void)
+{
+	return HostPin(ENABLE_POWER_GPIO_Port, ENABLE_POWER_Pin) && HostPin(SWITCH_ON_micro_GPIO_Port, SWITCH_ON_micro_Pin);
+}
+
+
+/* richiesta di versione ricevuta subito: una risposta da inviare anche senza telemetria periodica */
+static void TestTraffic(void)
+{
+	HOST_CHECK(HostRx(can_dev.rx_id[MSG_FW_VER], 1, 0, NULL) >= 0);
+}
+
+
+static void TestBoot(machine_status *machine)
+{
+	memset(&can_dev, 0, sizeof(can_dev));
+	HostInit();
+	HostEeNode(CAN_SPEED_250K, TEST_BASE, TEST_BASE_SEND);
+	HostBoot(machine);
+	HostRun(machine, 20000);
+	TestOut(machine, 1);
+	HOST_CHECK(TestOn() && can_dev.periodic_en == 1);
+}
+
+
+static void TestUnplug(void)
+{
+	machine_status machine;
+	uint64_t t0, t_lim = 0;
+	uint32_t mon_suppr;
+
+	TestBoot(&machine);
+	TestTraffic();
+	host.unplugged = 1;
+	t0 = host.us;
+	while (TestOn() && host.us - t0 < TEST_WAIT_US) {
+		HostRun(&machine, host_loop_us);
+		if (t_lim == 0 && can_dev.error_tx >= MSG_ERROR_TX_LIMIT)
+			t_lim = host.us;
+	}
+
+	printf("scollegato: limite di invii falliti dopo %.1f ms, uscite spente dopo %.1f ms, stato %u TEC %u reset %u\n",
+			(t_lim - t0)/1000.0, (host.us - t0)/1000.0, can_dev.bus_state, can_dev.tec, can_dev.reset_num);
+	HOST_CHECK(TestOn() == 0 && machine.enable_power == 0 && machine.switch_on == 0);
+	HOST_CHECK(can_dev.bus_state == CAN_BUS_PASSIVE && can_dev.tec == 128);
+	HOST_CHECK(can_dev.error_tx >= MSG_ERROR_TX_LIMIT && can_dev.error_to == 1);
+	/* ogni tentativo e' un errore di ACK: limite in MSG_ERROR_TX_LIMIT frame, poi MSG_ERROR_TO ms */
+	HOST_CHECK(t_lim != 0 && t_lim - t0 <= (MSG_ERROR_TX_LIMIT + 1)*HostFrameUs(0, 8) + 1000);
+	HOST_CHECK(host.us - t0 <= (MSG_ERROR_TO + 1)*1000ULL + t_lim - t0);
+	HOST_CHECK(can_dev.periodic_en == 0 && can_dev.periodic_suppr == 1);
+
+	/* scatto una sola volta per sequenza di errori, telemetria soppressa senza tentativi di invio */
+	mon_suppr = can_dev.mon_suppr;
+	HostRun(&machine, 500000);
+	HOST_CHECK(TestOn() == 0 && can_dev.error_to == 1);
+	HOST_CHECK(can_dev.bus_state == CAN_BUS_PASSIVE);
+	HOST_CHECK(can_dev.mon_suppr > mon_suppr);
+
+	/* ricollegato: il frame in mailbox viene inviato, il nuovo comando riaccende le uscite */
+	host.unplugged = 0;
+	HostRun(&machine, 20000);
+	HOST_CHECK(can_dev.error_glb == 0 && can_dev.error_to == 0);
+	TestOut(&machine, 1);
+	HOST_CHECK(TestOn() && can_dev.periodic_en == 1);
+	TestTraffic();
+	HostRun(&machine, 20000);
+	HOST_CHECK(TestOn());
+}
+
+
+static void TestGlitch(void)
+{
+	machine_status machine;
+	uint64_t t0;
+
+	TestBoot(&machine);
+	TestTraffic();
+	host.unplugged = 1;
+	t0 = host.us;
+	while (host.us - t0 < TEST_GLITCH_US) {
+		HostRun(&machine, host_loop_us);
+		HOST_CHECK(TestOn());
+	}
+	host.unplugged = 0;
+	HostRun(&machine, 100000);
+	printf("interruzione di %u ms: uscite %s, errori di invio %u\n", TEST_GLITCH_US/1000, TestOn() ? "attive" : "spente",
+			can_dev.error_tx);
+	HOST_CHECK(TestOn() && can_dev.error_to == 0 && can_dev.error_glb == 0);
+}
+
+
+int main(void)
+{
+	TestUnplug();
+	TestGlitch();
+
+	return HostEnd();
+}
@@ -0,0 +1,141 @@
+/* supervisione dei comandi (MachineTick): latenza dall'ultimo MSG_OUT_ENABLE valido allo spegnimento
+   di ENABLE_POWER e SWITCH_ON, per ogni fase del messaggio rispetto al SysTick e al passo da 10ms, con ciclo macchina
+   normale, con passi da 10ms lenti e con un trasferimento di pagina e2prom in corso */
+#include "host.h"
+#include "canmsg.c"
+
+#define TEST_BASE                     0x100
+#define TEST_BASE_SEND                0x300
+#define TEST_PHASE_STEP               125    /* us fra le fasi provate dell'ultimo comando nel ciclo da 10ms */
+#define TEST_CMD_NUM                  8      /* comandi prima dell'ultimo, ogni quarto di timeout */
+
+typedef struct {
+	const char *name;
+	uint16_t timeout;           /* ms */
+	uint32_t slow_us;           /* durata del passo da 10ms */
+	uint8_t page;               /* trasferimento di pagina e2prom subito dopo l'ultimo comando */
+} test_case;
+
+static const test_case test_tab[] = {
+	{"timeout 2ms",                       2,   HOST_SLOW_US, 0},
+	{"timeout 10ms",                      10,  HOST_SLOW_US, 0},
+	{"timeout 100ms",                     100, HOST_SLOW_US, 0},
+	{"timeout 10ms, passo lento 5ms",     10,  5000,         0},
+	{"timeout 10ms, pagina e2prom",       10,  HOST_SLOW_US, 1},
+};
+
+
+/* comando alle uscite sul bus, non prima di t: ricevuto anche durante il passo da 10ms */
+static void TestOut(uint8_t on, uint64_t t)
+{
+	uint8_t data[4] = {0};
+
+	data[0] = on; /* enable_power */
+	data[2] = on; /* switch_on */
+	HOST_CHECK(HostBusPut(can_dev.rx_id[MSG_OUT_ENABLE], 0, 4, data, t) == 0);
+}
+
+
+static uint8_t TestOn(void)
+{
+	return HostPin(ENABLE_POWER_GPIO_Port, ENABLE_POWER_Pin) && HostPin(SWITCH_ON_micro_GPIO_Port, SWITCH_ON_micro_Pin);
+}
+
+
+/* ritorna la latenza in us dall'ultimo comando all'uscita ENABLE_POWER bassa */
+static uint32_t TestPhase(const test_case *tc, uint32_t phase, uint32_t *stall)
+{
+	machine_status machine;
+	uint64_t t_last, t;
+	uint16_t cmd[3];
+	uint32_t lat, bound;
+	uint8_t i, on = 0;
+
+	memset(&can_dev, 0, sizeof(can_dev));
+	HostInit();
+	HostEeNode(CAN_SPEED_250K, TEST_BASE, TEST_BASE_SEND);
+	HostBoot(&machine);
+	HostRun(&machine, 20000);
+
+	/* timeout da configurazione, a uscite spente */
+	cmd[0] = MSG_OPC_CMD_TIMEOUT;
+	cmd[1] = tc->timeout;
+	cmd[2] = HW_CHECK_3;
+	HOST_CHECK(HostRx(CONF_CANID, 0, 6, (const uint8_t *)cmd) == CAN_RX_FIFO0);
+	HostRun(&machine, 20000);
+	HOST_CHECK(MachineCmdTimeoutGet() == tc->timeout);
+	host_slow_us = tc->slow_us;
+
+	/* comandi ogni quarto di timeout fino all'ultimo, alla fase richiesta nel ciclo da 10ms:
+	   uscite sempre attive anche con il ritardo di elaborazione */
+	t = ((host.us + (TEST_CMD_NUM + 1)*tc->timeout*250)/10000 + 1)*10000 + phase;
+	for (i=TEST_CMD_NUM; i!=0; i--)
+		TestOut(1, t - i*tc->timeout*250);
+	TestOut(1, t);
+	while (host.rx_us < t) {
+		HostRun(&machine, host_loop_us);
+		if (TestOn())
+			on = 1;
+		else
+			HOST_CHECK(on == 0); /* nessuno scatto prima dell'ultimo comando */
+	}
+	t_last = host.rx_us;
+	if (tc->page) {
+		host.ee_slot = HOST_EE_SLOTS - 1;
+		CanEeWrite(FLASH_ADDR_SPEED_ID, CAN_SPEED_250K);
+	}
+	while (HostPin(ENABLE_POWER_GPIO_Port, ENABLE_POWER_Pin) && host.us - t_last < (tc->timeout + 100)*1000ULL)
+		HostRun(&machine, host_loop_us);
+	HOST_CHECK(on == 1);
+
+	HOST_CHECK(HostPin(ENABLE_POWER_GPIO_Port, ENABLE_POWER_Pin) == 0 && HostPin(SWITCH_ON_micro_GPIO_Port, SWITCH_ON_micro_Pin) == 0);
+	lat = HostPinFall(ENABLE_POWER_GPIO_Port, ENABLE_POWER_Pin) - t_last;
+	HOST_CHECK(HostPinFall(SWITCH_ON_micro_GPIO_Port, SWITCH_ON_micro_Pin) - t_last == lat);
+
+	/* mai prima di timeout-1ms, entro timeout+1ms dalla ricezione anche con il passo da 10ms lento;
+	   con la CPU in stallo per la flash lo spegnimento avviene alla ripresa */
+	*stall = tc->page ? HOST_EE_ERASE_US + (NumbOfVar + 1)*HOST_EE_WRITE_US : 0;
+	bound = (tc->timeout + 1)*1000 + *stall;
+	HOST_CHECK(lat > (uint32_t)(tc->timeout - 1)*1000 && lat <= bound);
+	if (tc->page)
+		HOST_CHECK(host.ee_transfer == 1 && lat > (tc->timeout + 1)*1000);
+
+	/* il ciclo macchina registra lo scatto e non riaccende le uscite fino al prossimo comando */
+	HostRun(&machine, 20000);
+	HOST_CHECK(machine.error_cmd_timeout == 1 && machine.enable_power == 0 && machine.switch_on == 0);
+	HOST_CHECK(HostPin(ENABLE_POWER_GPIO_Port, ENABLE_POWER_Pin) == 0);
+	t = host.us;
+	TestOut(1, t);
+	while (host.rx_us < t || CanRxQueueLevel(&can_dev.rx_queue[CAN_RX_FIFO1]) != 0)
+		HostRun(&machine, host_loop_us);
+	HOST_CHECK(TestOn());
+
+	return lat;
+}
+
+
+static void TestCase(const test_case *tc)
+{
+	uint32_t phase, lat, lat_min = UINT32_MAX, lat_max = 0, stall = 0;
+
+	for (phase=0; phase<10000; phase+=TEST_PHASE_STEP) {
+		lat = TestPhase(tc, phase, &stall);
+		if (lat < lat_min)
+			lat_min = lat;
+		if (lat > lat_max)
+			lat_max = lat;
+	}
+	printf("%-34s latenza min %6u  max %6u us  (limite %u us%s)\n", tc->name, lat_min, lat_max,
+			(tc->timeout + 1)*1000, stall ? " + stallo flash" : "");
+}
+
+
+int main(void)
+{
+	uint8_t i;
+
+	for (i=0; i!=sizeof(test_tab)/sizeof(test_tab[0]); i++)
+		TestCase(&test_tab[i]);
+
+	return HostEnd();
+}
@@ -0,0 +1,418 @@
+/* dispatcher dei comandi (can_cmd_tab, CanCommandExec): ogni elemento raggiungibile dal proprio messaggio,
+   ricerca indicizzata uguale alla scansione lineare per ogni messaggio e opcode, verifiche comuni (DLC, HW_CHECK_3, configurazione) prima del gestore, costo per gestore su host
+   e conferma del cambio di velocita' (speed_save) come prima della tabella */
+#include "host.h"
+#include "canmsg.c"
+
+#define TEST_BASE                     0x100
+#define TEST_BASE_SEND                0x300
+#define TEST_LOOPS                    20000
+#define TEST_RUNS                     11
+
+#define TEST_FN(f)                    {f, #f}
+
+static const struct {
+	uint8_t (*fn)(const msg_can_rx *msg, machine_status *machine);
+	const char *name;
+} test_fn_tab[] = {
+	TEST_FN(CanCmdCfgRtr), TEST_FN(CanCmdCanIdRec), TEST_FN(CanCmdCanIdSend), TEST_FN(CanCmdCanIdOffset),
+	TEST_FN(CanCmdMonMode), TEST_FN(CanCmdMonStat), TEST_FN(CanCmdTimeout), TEST_FN(CanCmdVeloc),
+	TEST_FN(CanCmdParamRead), TEST_FN(CanCmdStage), TEST_FN(CanCmdStageCommit), TEST_FN(CanCmdStageAbort),
+	TEST_FN(CanCmdSeg), TEST_FN(CanCmdBootloader), TEST_FN(CanCmdHwVer), TEST_FN(CanCmdFwVer),
+	TEST_FN(CanCmdCfgStatus), TEST_FN(CanCmdOutEnable), TEST_FN(CanCmdGroup), TEST_FN(CanCmdSync),
+	TEST_FN(CanCmdDiag), TEST_FN(CanCmdCngVeloc), TEST_FN(CanCmdLss),
+};
+
+static candev test_dev;             /* stato del nodo ripristinato prima di ogni comando */
+static machine_status test_machine;
+
+
+static const char *TestFnName(uint8_t (*fn)(const msg_can_rx *msg, machine_status *machine))
+{
+	uint8_t i;
+
+	for (i=0; i!=sizeof(test_fn_tab)/sizeof(test_fn_tab[0]); i++) {
+		if (test_fn_tab[i].fn == fn)
+			return test_fn_tab[i].name;
+	}
+	HOST_CHECK(0); /* gestore senza nome */
+	return "?";
+}
+
+
+/* riferimento: scansione lineare di can_cmd_tab, come prima dell'indice */
+static uint8_t TestFindRef(uint8_t msg_id, uint8_t rtr, uint16_t opc)
+{
+	const can_cmd_def *def;
+	uint8_t i;
+
+	for (i=0; i!=CAN_CMD_NUM; i++) {
+		def = &can_cmd_tab[i];
+		if (def->msg_id == msg_id && def->rtr == rtr && (opc & def->opc_mask) == def->opc)
+			break;
+	}
+
+	return i;
+}
+
+
+/* messaggio tipico dell'elemento: opcode, DLC minimo e HW_CHECK_3, parametri validi */
+static void TestMsg(uint8_t i, msg_can_rx *msg)
+{
+	const can_cmd_def *def = &can_cmd_tab[i];
+	uint16_t *cmd = (uint16_t *)msg->data;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_id = def->msg_id;
+	msg->header.IDE = CAN_ID_EXT;
+	msg->header.RTR = def->rtr ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+	msg->header.DLC = def->dlc_min;
+	if (def->msg_id == MSG_CONF && def->rtr == 0) {
+		cmd[0] = def->opc;
+		if (def->opc <= MSG_OPC_CANID_OFFSET)
+			cmd[1] = def->opc == MSG_OPC_CANID_OFFSET ? 1 : TEST_BASE; /* ID validi */
+		else if (def->opc == MSG_OPC_VELOC)
+			cmd[1] = CAN_SPEED_500K;
+		else if (def->opc == MSG_OPC_MON_STAT || def->opc == MSG_OPC_CMD_TIMEOUT)
+			cmd[1] = 100;
+		else if (def->opc == MSG_OPC_DIAG)
+			cmd[2] = TEST_BASE; /* risponde questo nodo */
+		else if (def->opc == MSG_OPC_BOOTLOADER) {
+			cmd[1] = HW_CHECK_0;
+			cmd[2] = HW_CHECK_2;
+		}
+	}
+	else if (def->msg_id == MSG_CNG_VELOC)
+		cmd[0] = CAN_SPEED_500K;
+	if (def->chk != 0)
+		cmd[def->chk] = HW_CHECK_3;
+	msg->ts = CanTimestamp();
+}
+
+
+static void TestRestore(void)
+{
+	memcpy(&can_dev, &test_dev, sizeof(can_dev));
+}
+
+
+static int TestExec(msg_can_rx *msg)
+{
+	machine_status machine = test_machine;
+
+	return CanCommandExec(msg, &machine);
+}
+
+
+/* stato del nodo invariato: il messaggio non ha raggiunto nessun gestore */
+static int TestUnchanged(msg_can_rx *msg)
+{
+	TestRestore();
+	HOST_CHECK(TestExec(msg) == 0);
+	can_dev.lss_t = test_dev.lss_t; /* sessione LSS rinnovata anche dai comandi scartati */
+
+	return memcmp(&can_dev, &test_dev, sizeof(can_dev)) == 0;
+}
+
+
+/* tempo del solo comando, lo stato e' ripristinato fuori misura; 0: comando, 1: misura a vuoto */
+static uint64_t TestBench(int mode, msg_can_rx *msg)
+{
+	uint64_t t, sum = 0;
+	uint32_t n;
+
+	for (n=0; n!=TEST_LOOPS; n++) {
+		TestRestore();
+		__asm__ volatile("" ::: "memory");
+		t = HostNs();
+		if (mode == 0)
+			TestExec(msg);
+		__asm__ volatile("" ::: "memory");
+		sum += HostNs() - t;
+	}
+
+	return sum;
+}
+
+
+static uint64_t TestBenchFind(uint8_t i)
+{
+	const can_cmd_def *def = &can_cmd_tab[i];
+	uint64_t t;
+	uint32_t n, sum = 0;
+
+	t = HostNs();
+	for (n=0; n!=TEST_LOOPS; n++) {
+		sum += CanCmdFind(def->msg_id, def->rtr, def->opc);
+		__asm__ volatile("" ::: "memory");
+	}
+	HOST_CHECK(sum == TEST_LOOPS*i);
+
+	return HostNs() - t;
+}
+
+
+/* ogni elemento e' il primo a corrispondere al proprio messaggio; le verifiche comuni lo escludono */
+/* ogni messaggio e opcode (tutti gli opcode solo per i data frame di MSG_CONF): stesso elemento della scansione lineare */
+static void TestFindAll(void)
+{
+	uint32_t opc, diff = 0;
+	uint16_t m;
+	uint8_t rtr;
+
+	for (m=0; m!=0x100; m++) {
+		for (rtr=0; rtr!=2; rtr++) {
+			for (opc=0; opc < 0x10000; opc += (m == MSG_CONF && rtr == 0) ? 1 : 0x1111)
+				diff += CanCmdFind(m, rtr, opc) != TestFindRef(m, rtr, opc);
+		}
+	}
+	HOST_CHECK(diff == 0);
+}
+
+
+static void TestReach(void)
+{
+	const can_cmd_def *def;
+	msg_can_rx msg;
+	uint8_t i;
+
+	for (i=0; i!=CAN_CMD_NUM; i++) {
+		def = &can_cmd_tab[i];
+		TestRestore();
+		TestMsg(i, &msg);
+		HOST_CHECK(CanCmdFind(def->msg_id, def->rtr, def->opc) == i);
+		HOST_CHECK(def->chk == 0 || def->chk*2 + 2 <= def->dlc_min);
+		HOST_CHECK(TestExec(&msg) == 0);
+
+		/* DLC fuori dai limiti */
+		if (def->dlc_min != 0) {
+			msg.header.DLC = def->dlc_min - 1;
+			HOST_CHECK(TestUnchanged(&msg));
+		}
+		if (def->dlc_max != 8) {
+			msg.header.DLC = def->dlc_max + 1;
+			HOST_CHECK(TestUnchanged(&msg));
+		}
+		msg.header.DLC = def->dlc_min;
+
+		/* HW_CHECK_3 errato */
+		if (def->chk != 0) {
+			((uint16_t *)msg.data)[def->chk] = HW_CHECK_3 ^ 1;
+			HOST_CHECK(TestUnchanged(&msg));
+			((uint16_t *)msg.data)[def->chk] = HW_CHECK_3;
+		}
+
+		/* configurazione a uscite attive o con un altro nodo selezionato */
+		if (def->cfg) {
+			test_dev.cfg_en = 0;
+			HOST_CHECK(TestUnchanged(&msg));
+			test_dev.cfg_en = 1;
+			test_dev.lss_active = 1;
+			HOST_CHECK(TestUnchanged(&msg));
+			test_dev.lss_active = 0;
+		}
+	}
+
+	/* ordine richiesto dalla ricerca binaria: gruppi consecutivi, opcode crescenti */
+	for (i=1; i!=CAN_CMD_NUM; i++) {
+		def = &can_cmd_tab[i];
+		if (def->msg_id == can_cmd_tab[i-1].msg_id && def->rtr == can_cmd_tab[i-1].rtr)
+			HOST_CHECK(def->opc > (can_cmd_tab[i-1].opc | (uint16_t)~can_cmd_tab[i-1].opc_mask));
+	}
+
+	/* opcode e request senza gestore */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_id = MSG_CONF;
+	msg.header.DLC = 8;
+	((uint16_t *)msg.data)[0] = 0x0203;
+	HOST_CHECK(CanCmdFind(MSG_CONF, 0, 0x0203) == CAN_CMD_NUM);
+	HOST_CHECK(TestUnchanged(&msg));
+	msg.msg_id = MSG_OUT_ENABLE;
+	msg.header.RTR = CAN_RTR_REMOTE;
+	HOST_CHECK(CanCmdFind(MSG_OUT_ENABLE, 1, 0) == CAN_CMD_NUM);
+	HOST_CHECK(TestUnchanged(&msg));
+}
+
+
+static void TestCost(void)
+{
+	msg_can_rx msg;
+	uint64_t ns[2], t, find;
+	double cost, worst = 0, find_max = 0;
+	uint8_t i, j, mode, worst_i = 0;
+
+	printf("elemento  gestore              costo su host (misura a vuoto esclusa)\n");
+	for (i=0; i!=CAN_CMD_NUM; i++) {
+		TestRestore();
+		TestMsg(i, &msg);
+		ns[0] = ns[1] = UINT64_MAX;
+		for (j=0; j!=TEST_RUNS; j++) {
+			for (mode=0; mode!=2; mode++) {
+				t = TestBench(mode, &msg);
+				if (t < ns[mode])
+					ns[mode] = t;
+			}
+		}
+		find = UINT64_MAX;
+		for (j=0; j!=TEST_RUNS; j++) {
+			t = TestBenchFind(i);
+			if (t < find)
+				find = t;
+		}
+		cost = ns[0] > ns[1] ? (double)(ns[0] - ns[1])/TEST_LOOPS : 0;
+		if (cost > worst) {
+			worst = cost;
+			worst_i = i;
+		}
+		if ((double)find/TEST_LOOPS > find_max)
+			find_max = (double)find/TEST_LOOPS;
+		printf("%8u  %-20s %7.1f ns  (ricerca %.1f ns)\n", i, TestFnName(can_cmd_tab[i].fn), cost, (double)find/TEST_LOOPS);
+	}
+	printf("gestore piu' costoso: %s (%.1f ns), ricerca piu' lenta %.1f ns\n", TestFnName(can_cmd_tab[worst_i].fn), worst, find_max);
+	TestRestore();
+}
+
+
+/* comando: request se dlc e' 0, altrimenti cmd[0] opc, cmd[1] val, cmd[2] HW_CHECK_3 */
+static void TestCmd(machine_status *machine, uint8_t msg_id, uint8_t dlc, uint16_t opc, uint16_t val)
+{
+	msg_can_rx msg;
+	uint16_t *cmd = (uint16_t *)msg.data;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_id = msg_id;
+	msg.header.IDE = CAN_ID_EXT;
+	msg.header.RTR = dlc ? CAN_RTR_DATA : CAN_RTR_REMOTE;
+	msg.header.DLC = dlc;
+	cmd[0] = opc;
+	cmd[1] = val;
+	cmd[2] = HW_CHECK_3;
+	msg.ts = CanTimestamp();
+	HOST_CHECK(CanCommandExec(&msg, machine) == 0);
+}
+
+
+/* conferma del cambio di velocita': salvataggio in e2prom solo al primo comando che la conferma */
+static void TestSpeedAck(machine_status *machine)
+{
+	uint16_t val;
+
+	/* nuova velocita': salvata solo alla request successiva, anche HW_VER */
+	TestCmd(machine, MSG_CONF, 6, MSG_OPC_VELOC, CAN_SPEED_500K);
+	HOST_CHECK(can_dev.speed == CAN_SPEED_500K && can_dev.speed_save == 1);
+	HostRun(machine, 20000);
+	HOST_CHECK(HostEeGet(FLASH_ADDR_SPEED_ID, &val) == 0 && val == CAN_SPEED_250K);
+	TestCmd(machine, MSG_HW_VER, 0, 0, 0);
+	HOST_CHECK(can_dev.speed_save == 0);
+	HostRun(machine, 20000);
+	HOST_CHECK(HostEeGet(FLASH_ADDR_SPEED_ID, &val) == 0 && val == CAN_SPEED_500K);
+
+	/* velocita' non valida: nessun cambio ma conferma richiesta, come prima della tabella */
+	TestCmd(machine, MSG_CONF, 6, MSG_OPC_VELOC, 0x20);
+	HOST_CHECK(can_dev.speed == CAN_SPEED_500K && can_dev.speed_save == 1);
+
+	/* request senza gestore in configurazione: conferma */
+	TestCmd(machine, MSG_OUT_ENABLE, 0, 0, 0);
+	HOST_CHECK(can_dev.speed_save == 0);
+
+	/* velocita' gia' attiva: conferma */
+	TestCmd(machine, MSG_CONF, 6, MSG_OPC_VELOC, 0x20);
+	TestCmd(machine, MSG_CONF, 6, MSG_OPC_VELOC, CAN_SPEED_500K);
+	HOST_CHECK(can_dev.speed_save == 0);
+
+	/* request fuori configurazione: nessuna conferma; comando alle uscite: conferma */
+	TestCmd(machine, MSG_CONF, 6, MSG_OPC_VELOC, 0x20);
+	can_dev.cfg_en = 0;
+	TestCmd(machine, MSG_FW_VER, 0, 0, 0);
+	HOST_CHECK(can_dev.speed_save == 1);
+	TestCmd(machine, MSG_OUT_ENABLE, 4, 0, 0);
+	HOST_CHECK(can_dev.speed_save == 0);
+	can_dev.cfg_en = 1;
+
+	/* CNG_VELOC: cambio senza conferma, confermato dal comando successivo */
+	TestCmd(machine, MSG_CNG_VELOC, 2, CAN_SPEED_250K, 0);
+	HOST_CHECK(can_dev.speed == CAN_SPEED_250K && can_dev.speed_save == 1);
+	TestCmd(machine, MSG_HW_VER, 0, 0, 0);
+	HOST_CHECK(can_dev.speed_save == 0);
+	HostRun(machine, 20000);
+	HOST_CHECK(HostEeGet(FLASH_ADDR_SPEED_ID, &val) == 0 && val == CAN_SPEED_250K);
+}
+
+
+/* coda di invio piena: il comando con risposta attende, la telemetria e' persa (mon_fail),
+   nessuno dei due e' un errore del bus */
+static void TestTxFull(machine_status *machine)
+{
+	CAN_TxHeaderTypeDef header = {0};
+	uint8_t data[8] = {0};
+	msg_can_rx msg;
+	uint16_t error_tx, error_tot;
+	uint32_t mon_fail;
+
+	header.ExtId = can_dev.tx_id[MSG_MON_INFO];
+	header.IDE = CAN_ID_EXT;
+	header.DLC = 8;
+	while (can_dev.tx_queue_num != CAN_TX_QUEUE)
+		HOST_CHECK(CanTxQueuePush(&header, data) == 0);
+	error_tx = can_dev.error_tx;
+	error_tot = can_dev.error_tot;
+	mon_fail = can_dev.mon_fail;
+
+	TestMsg(CanCmdFind(MSG_FW_VER, 1, 0), &msg);
+	HOST_CHECK(CanCommandExec(&msg, machine) == -1);
+	HOST_CHECK(CanTxQueuePush(&header, data) == -1);
+	CanSendData(MSG_MON_INFO, machine, 0);
+	HOST_CHECK(can_dev.tx_queue_full == 2 && can_dev.tx_queue_max == CAN_TX_QUEUE);
+	HOST_CHECK(can_dev.mon_fail == mon_fail + 1);
+	HOST_CHECK(can_dev.error_tx == error_tx && can_dev.error_tot == error_tot);
+
+	HostRun(machine, 20000);
+	HOST_CHECK(can_dev.tx_queue_num == 0 && can_dev.error_tx == error_tx);
+}
+
+
+/* diagnostica sull'ID di configurazione: risponde solo il nodo indicato, anche a uscite attive */
+static void TestDiag(machine_status *machine)
+{
+	msg_can_rx msg;
+	host_frame f;
+
+	while (HostTxPop(&f))
+		;
+	can_dev.cfg_en = 0;
+	TestMsg(CanCmdFind(MSG_CONF, 0, MSG_OPC_DIAG), &msg);
+	msg.data[2] = MSG_DIAG_PAGE_BUS;
+	HOST_CHECK(CanCommandExec(&msg, machine) == 0);
+	HostRun(machine, 1000);
+	HOST_CHECK(HostTxPop(&f) && f.id == can_dev.tx_id[MSG_DIAG_INFO] && f.dlc == 8 && f.data[0] == MSG_DIAG_PAGE_BUS);
+
+	/* altro nodo */
+	((uint16_t *)msg.data)[2] = TEST_BASE + 1;
+	HOST_CHECK(CanCommandExec(&msg, machine) == 0);
+	HostRun(machine, 1000);
+	HOST_CHECK(HostTxPop(&f) == 0);
+	can_dev.cfg_en = 1;
+}
+
+
+int main(void)
+{
+	machine_status machine;
+
+	HostInit();
+	HostEeNode(CAN_SPEED_250K, TEST_BASE, TEST_BASE_SEND);
+	HostBoot(&machine);
+	HostRun(&machine, 20000);
+	HOST_CHECK(can_dev.cfg_en == 1);
+	memcpy(&test_dev, &can_dev, sizeof(can_dev));
+	test_machine = machine;
+
+	TestReach();
+	TestFindAll();
+	TestCost();
+	TestSpeedAck(&machine);
+	TestTxFull(&machine);
+	TestDiag(&machine);
+
+	return HostEnd();
+}
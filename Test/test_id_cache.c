@@ -0,0 +1,261 @@
+/* ID risolti in can_dev (CanIdUpdate): costo della verifica software per messaggio ricevuto
+   rispetto al calcolo base + rec_offset*n ad ogni messaggio, e aggiornamento della cache
+   ad ogni configurazione degli ID */
+#include "host.h"
+#include "canmsg.c"
+
+#define TEST_BASE                     0x100
+#define TEST_BASE_SEND                0x300
+#define TEST_LOOPS                    200000 /* passaggi sull'insieme di ID di prova */
+#define TEST_ID_NUM                   16
+#define TEST_RUNS                     11
+
+static volatile uint32_t test_sink;
+
+
+/* riferimento: CanRxMsgId con il filtro piglia tutto, ID calcolati ad ogni messaggio come prima della cache */
+static uint8_t TestRxMsgIdRef(const CAN_RxHeaderTypeDef *header)
+{
+	uint32_t cmd_id;
+	uint8_t i;
+
+	if (header->IDE != CAN_ID_EXT)
+		return MSG_NONE;
+
+	cmd_id = header->ExtId;
+	if (cmd_id == can_dev.cfg_id)
+		return MSG_CONF;
+	if (cmd_id == CAN_LSS_ID)
+		return MSG_LSS;
+	if (can_dev.base != 0) {
+		if (cmd_id == CAN_SYNC_ID)
+			return MSG_SYNC;
+		if (cmd_id == CAN_BCAST_ID)
+			return MSG_GROUP;
+		for (i=0; i!=CAN_GROUP_NUM; i++) {
+			if (can_dev.group_id[i] != 0 && cmd_id == can_dev.group_id[i])
+				return MSG_GROUP;
+		}
+		for (i=0; i!=MSG_REC_NUM; i++) {
+			if (cmd_id == can_dev.base + can_dev.rec_offset*i)
+				return i;
+		}
+	}
+
+	return MSG_NONE;
+}
+
+
+/* traffico di prova: tutti i messaggi del nodo e messaggi di altri nodi (verifica completa senza esito) */
+static void TestIdSet(CAN_RxHeaderTypeDef *header)
+{
+	uint8_t i;
+
+	memset(header, 0, sizeof(*header)*TEST_ID_NUM);
+	for (i=0; i!=TEST_ID_NUM; i++) {
+		header[i].IDE = CAN_ID_EXT;
+		if (i < MSG_REC_NUM)
+			header[i].ExtId = can_dev.rx_id[i];
+		else
+			header[i].ExtId = 0x1FFF0000 + i;
+	}
+}
+
+
+static uint64_t TestBench(int ref, const CAN_RxHeaderTypeDef *header)
+{
+	uint64_t t;
+	uint32_t n, sum = 0;
+	uint8_t i;
+
+	t = HostNs();
+	for (n=0; n!=TEST_LOOPS; n++) {
+		for (i=0; i!=TEST_ID_NUM; i++)
+			sum += ref ? TestRxMsgIdRef(&header[i]) : CanRxMsgId(&header[i], CAN_RX_FIFO0);
+		__asm__ volatile("" ::: "memory"); /* nessuna fusione dei passaggi: can_dev puo' cambiare */
+	}
+	test_sink = sum;
+
+	return HostNs() - t;
+}
+
+
+/* i due percorsi classificano allo stesso modo gli ID del nodo e gli altri */
+static void TestIdMatch(void)
+{
+	CAN_RxHeaderTypeDef header[TEST_ID_NUM];
+	uint8_t i, flt_all;
+
+	flt_all = can_dev.flt_all;
+	can_dev.flt_all = 1;
+	TestIdSet(header);
+	for (i=0; i!=TEST_ID_NUM; i++) {
+		HOST_CHECK(CanRxMsgId(&header[i], CAN_RX_FIFO0) == TestRxMsgIdRef(&header[i]));
+		HOST_CHECK(CanRxMsgId(&header[i], CAN_RX_FIFO0) == (i < MSG_REC_NUM ? i : MSG_NONE));
+	}
+	for (i=0; i!=MSG_SEND_NUM; i++)
+		HOST_CHECK(can_dev.tx_id[i] == can_dev.base_send + can_dev.send_offset*i);
+	can_dev.flt_all = flt_all;
+}
+
+
+static void TestCfg(machine_status *machine, uint16_t opc, uint32_t val)
+{
+	uint16_t cmd[4];
+
+	cmd[0] = opc;
+	cmd[1] = val & 0xFFFF;
+	cmd[2] = val >> 16;
+	cmd[3] = HW_CHECK_3;
+	HOST_CHECK(HostRx(CONF_CANID, 0, 8, (const uint8_t *)cmd) >= 0);
+	HostRun(machine, 20000);
+}
+
+
+/* verifica di un oggetto parametri: ID candidati su una copia, quelli attivi mai toccati */
+static void TestParamCheck(void)
+{
+	uint8_t buf[CAN_PARAM_NUM*2];
+	candev dev;
+	uint8_t i;
+
+	memset(buf, 0xFF, sizeof(buf));
+	for (i=0; i!=CAN_PARAM_NUM; i++) {
+		if (can_param_tab[i] == FLASH_ADDR_CANID_L) {
+			buf[2*i] = (can_dev.cfg_id - 2*0x10) & 0xFF; /* MSG_CNG_VELOC sull'ID di configurazione */
+			buf[2*i + 1] = ((can_dev.cfg_id - 2*0x10) >> 8) & 0xFF;
+		}
+		else if (can_param_tab[i] == FLASH_ADDR_CANID_H)
+			buf[2*i] = buf[2*i + 1] = 0;
+	}
+	memcpy(&dev, &can_dev, sizeof(dev));
+	HOST_CHECK(CanParamIdCheck(buf) != 0);
+	HOST_CHECK(memcmp(&dev, &can_dev, sizeof(dev)) == 0);
+	memset(buf, 0xFF, sizeof(buf));
+	HOST_CHECK(CanParamIdCheck(buf) == 0);
+	HOST_CHECK(memcmp(&dev, &can_dev, sizeof(dev)) == 0);
+}
+
+
+/* commit a piu' variabili interrotto dopo k scritture: al riavvio il vecchio insieme, nessun ID
+   (solo configurazione) o il nuovo insieme, mai un misto */
+static void TestStageCut(void)
+{
+	machine_status machine;
+	uint8_t k, num;
+
+	for (k=0; ; k++) {
+		memset(&can_dev, 0, sizeof(can_dev));
+		HostInit();
+		HostEeNode(CAN_SPEED_250K, TEST_BASE, TEST_BASE_SEND);
+		HostBoot(&machine);
+		HostRun(&machine, 20000);
+
+		can_dev.stage_base = 0x5000;
+		can_dev.stage_base_send = 0x7000;
+		can_dev.stage_offset = 0x10;
+		can_dev.stage_mask = CAN_STAGE_BASE | CAN_STAGE_BASE_SEND | CAN_STAGE_OFFSET;
+		HOST_CHECK(CanStageCommit() == 0);
+		num = can_dev.ee_job_num;
+		if (k > num)
+			break;
+		while (can_dev.ee_job_num > num - k)
+			CanEeJobPop();
+
+		/* spegnimento: le scritture in coda sono perse */
+		memset(&can_dev, 0, sizeof(can_dev));
+		HostBoot(&machine);
+		if (k == 0)
+			HOST_CHECK(can_dev.base == TEST_BASE && can_dev.base_send == TEST_BASE_SEND && can_dev.rec_offset == 1);
+		else if (k < num)
+			HOST_CHECK(can_dev.base == 0);
+		else
+			HOST_CHECK(can_dev.base == 0x5000 && can_dev.base_send == 0x7000 && can_dev.rec_offset == 0x10);
+	}
+	HOST_CHECK(num == 10);
+
+	/* commit successivo a quello interrotto: stessa generazione del marcatore rimasto, insieme accettato */
+	CanEeJobPop();
+	memset(&can_dev, 0, sizeof(can_dev));
+	HostBoot(&machine);
+	HOST_CHECK(can_dev.base == 0);
+	can_dev.stage_base = 0x5000;
+	can_dev.stage_mask = CAN_STAGE_BASE;
+	HOST_CHECK(CanStageCommit() == 0);
+	HostRun(&machine, 20000);
+	memset(&can_dev, 0, sizeof(can_dev));
+	HostBoot(&machine);
+	HOST_CHECK(can_dev.base == 0x5000 && can_dev.id_gen == 1);
+}
+
+
+int main(void)
+{
+	machine_status machine;
+	CAN_RxHeaderTypeDef header[TEST_ID_NUM];
+	uint64_t ns_cache, ns_ref, t;
+	uint32_t old;
+	uint8_t i, data[8] = {0};
+
+	HostInit();
+	HostEeNode(CAN_SPEED_250K, TEST_BASE, TEST_BASE_SEND);
+	HostBoot(&machine);
+	HostRun(&machine, 20000);
+
+	/* cache al boot */
+	HOST_CHECK(can_dev.rx_id[MSG_OUT_ENABLE] == TEST_BASE + can_dev.rec_offset*MSG_OUT_ENABLE);
+	HOST_CHECK(can_dev.tx_id[MSG_MON_INFO] == TEST_BASE_SEND);
+	TestIdMatch();
+
+	/* costo per messaggio ricevuto con la verifica software (filtro piglia tutto) */
+	can_dev.flt_all = 1;
+	TestIdSet(header);
+	ns_ref = ns_cache = UINT64_MAX;
+	for (i=0; i!=TEST_RUNS; i++) { /* migliore di piu' prove: meno rumore del processo host */
+		t = TestBench(1, header);
+		if (t < ns_ref)
+			ns_ref = t;
+		t = TestBench(0, header);
+		if (t < ns_cache)
+			ns_cache = t;
+	}
+	can_dev.flt_all = 0;
+	printf("verifica software per messaggio: calcolo %.2f ns, cache %.2f ns (%+.1f%%)\n",
+			(double)ns_ref/TEST_LOOPS/TEST_ID_NUM, (double)ns_cache/TEST_LOOPS/TEST_ID_NUM,
+			100.0*((double)ns_cache - ns_ref)/ns_ref);
+	printf("ID del nodo: %u su %u, gli altri confrontati con tutti i %u ID di ricezione\n",
+			MSG_REC_NUM, TEST_ID_NUM, MSG_REC_NUM);
+
+	/* nuova base: cache aggiornata, filtri sul nuovo ID, vecchio ID scartato
+	   (CNG_VELOC alla stessa velocita': nessun effetto e configurazione ancora abilitata) */
+	data[0] = can_dev.speed;
+	old = can_dev.rx_id[MSG_CNG_VELOC];
+	TestCfg(&machine, MSG_OPC_CANID_REC, 0x4000);
+	HOST_CHECK(can_dev.base == 0x4000);
+	HOST_CHECK(can_dev.rx_id[MSG_CNG_VELOC] == 0x4000 + can_dev.rec_offset*MSG_CNG_VELOC);
+	HOST_CHECK(HostRx(old, 0, 2, data) < 0);
+	HOST_CHECK(HostRx(can_dev.rx_id[MSG_CNG_VELOC], 0, 2, data) == CAN_RX_FIFO0);
+	HostRun(&machine, 20000);
+	TestIdMatch();
+
+	/* nuovi offset: entrambe le tabelle ricalcolate */
+	old = can_dev.rx_id[MSG_CNG_VELOC];
+	TestCfg(&machine, MSG_OPC_CANID_OFFSET, 0x10);
+	HOST_CHECK(can_dev.rec_offset == 0x10 && can_dev.send_offset == 0x10);
+	HOST_CHECK(can_dev.rx_id[MSG_FW_VER] == 0x4000 + 0x10*MSG_FW_VER);
+	HOST_CHECK(can_dev.tx_id[MSG_MON_STAT] == can_dev.base_send + 0x10*MSG_MON_STAT);
+	HOST_CHECK(HostRx(old, 0, 2, data) < 0);
+	HOST_CHECK(HostRx(can_dev.rx_id[MSG_CNG_VELOC], 0, 2, data) == CAN_RX_FIFO0);
+	HostRun(&machine, 20000);
+	TestIdMatch();
+
+	/* nuova base di invio: i messaggi del nodo escono sul nuovo ID */
+	TestCfg(&machine, MSG_OPC_CANID_SEND, 0x6000);
+	HOST_CHECK(can_dev.tx_id[MSG_MON_INFO] == 0x6000);
+	TestIdMatch();
+
+	TestParamCheck();
+	TestStageCut();
+
+	return HostEnd();
+}
@@ -0,0 +1,299 @@
+/* messa in servizio per UID (fastscan): N nodi non configurati sullo stesso bus, il test fa da master.
+   Ogni nodo ha il proprio stato (host_node, can_dev, machine_status) e tutti avanzano insieme a passi
+   di TEST_SLICE_US; le risposte IDENTIFY uguali di piu' nodi si sovrappongono sul bus in un solo frame */
+#include "host.h"
+#include "canmsg.c"
+
+#define TEST_NODE_MAX                 32
+#define TEST_SLICE_US                 100
+#define TEST_TIMEOUT_US               2000   /* attesa della risposta del master */
+#define TEST_BASE                     0x1000 /* base del nodo n: TEST_BASE + n*TEST_BASE_STEP */
+#define TEST_BASE_SEND                0x8000
+#define TEST_BASE_STEP                0x10
+
+typedef struct {
+	host_node host;
+	candev dev;
+	machine_status machine;
+} test_node;
+
+static test_node test_node_tab[TEST_NODE_MAX];
+static uint8_t test_node_num;
+static uint64_t test_us;            /* tempo del master */
+static uint32_t test_req;           /* richieste inviate */
+static uint32_t test_timeout;       /* richieste senza risposta */
+
+
+static void TestNodeLoad(uint8_t i)
+{
+	HostNodeLoad(&test_node_tab[i].host);
+	memcpy(&can_dev, &test_node_tab[i].dev, sizeof(can_dev));
+}
+
+
+static void TestNodeSave(uint8_t i)
+{
+	HostNodeSave(&test_node_tab[i].host);
+	memcpy(&test_node_tab[i].dev, &can_dev, sizeof(can_dev));
+}
+
+
+static void TestNodeInit(uint8_t n)
+{
+	uint32_t seed = 0x2545F491;
+	uint8_t i;
+
+	test_node_num = n;
+	for (i=0; i!=n; i++) {
+		memset(&can_dev, 0, sizeof(can_dev));
+		HostInit();
+		/* UID: parole alte comuni a piu' nodi (stesso lotto), parola bassa diversa */
+		seed = seed*1664525 + 1013904223;
+		host_uid[0] = seed;
+		host_uid[1] = 0x32345106 + (i % 3);
+		host_uid[2] = 0x20383443;
+		HostEeNode(CAN_SPEED_250K, 0, 0);
+		HostBoot(&test_node_tab[i].machine);
+		HostRun(&test_node_tab[i].machine, 10000);
+		TestNodeSave(i);
+	}
+	test_us = test_node_tab[0].host.us;
+}
+
+
+/* richiesta del master, ricevuta da tutti i nodi */
+static void TestSend(uint32_t id, const uint8_t *data, uint8_t dlc)
+{
+	uint8_t i;
+
+	for (i=0; i!=test_node_num; i++) {
+		TestNodeLoad(i);
+		HostBusPut(id, 0, dlc, data, test_us);
+		TestNodeSave(i);
+	}
+	test_req++;
+}
+
+
+/* avanza tutti i nodi fino alla prima risposta su rsp_id o al timeout; ritorna i nodi che hanno risposto */
+static uint8_t TestWait(uint32_t rsp_id, uint8_t *rsp_data)
+{
+	host_frame fr;
+	uint64_t end;
+	uint8_t i, n = 0;
+
+	end = test_us + TEST_TIMEOUT_US;
+	while (n == 0 && test_us < end) {
+		test_us += TEST_SLICE_US;
+		for (i=0; i!=test_node_num; i++) {
+			TestNodeLoad(i);
+			if (host.us < test_us)
+				HostRun(&test_node_tab[i].machine, test_us - host.us);
+			while (HostTxPop(&fr)) {
+				if (fr.id == rsp_id) {
+					n++;
+					if (rsp_data != NULL)
+						memcpy(rsp_data, fr.data, 8);
+				}
+			}
+			TestNodeSave(i);
+		}
+	}
+	if (n == 0)
+		test_timeout++;
+
+	return n;
+}
+
+
+/* master in silenzio: tutti i nodi avanzano di us */
+static void TestIdle(uint64_t us)
+{
+	host_frame fr;
+	uint8_t i;
+
+	test_us += us;
+	for (i=0; i!=test_node_num; i++) {
+		TestNodeLoad(i);
+		HostRun(&test_node_tab[i].machine, test_us - host.us);
+		while (HostTxPop(&fr))
+			;
+		TestNodeSave(i);
+	}
+}
+
+
+static uint8_t TestFastscan(uint32_t id, uint8_t bit, uint8_t sub, uint8_t next)
+{
+	uint8_t data[8];
+
+	data[0] = CAN_LSS_CS_FASTSCAN;
+	data[1] = id & 0xFF;
+	data[2] = (id >> 8) & 0xFF;
+	data[3] = (id >> 16) & 0xFF;
+	data[4] = id >> 24;
+	data[5] = bit;
+	data[6] = sub;
+	data[7] = next;
+	TestSend(CAN_LSS_ID, data, 8);
+
+	return TestWait(CAN_LSS_RSP_ID, NULL);
+}
+
+
+static void TestCfg(uint16_t opc, uint32_t val, uint8_t dlc)
+{
+	uint16_t cmd[4];
+
+	cmd[0] = opc;
+	cmd[1] = val & 0xFFFF;
+	cmd[2] = val >> 16;
+	cmd[3] = HW_CHECK_3;
+	TestSend(CONF_CANID, (const uint8_t *)cmd, dlc);
+}
+
+
+/* ricerca di un nodo non configurato bit per bit: 0 se nessuno risponde al reset */
+static int TestScan(uint32_t *uid)
+{
+	uint8_t sub, bit, next;
+	uint32_t id;
+
+	if (TestFastscan(0, CAN_LSS_BIT_RESET, 0, 0) == 0)
+		return 0;
+
+	for (sub=0; sub!=CAN_LSS_SUB_NUM; sub++) {
+		next = (sub + 1) % CAN_LSS_SUB_NUM;
+		id = 0;
+		for (bit=32; bit--!=0;) {
+			/* bit a 0 provato per primo: senza risposta e' 1 */
+			if (TestFastscan(id, bit, sub, bit == 0 ? next : sub) == 0) {
+				id |= 1UL << bit;
+				if (bit == 0) /* conferma della parola completa: i nodi corrispondenti passano alla successiva */
+					HOST_CHECK(TestFastscan(id, 0, sub, next) != 0);
+			}
+		}
+		uid[sub] = id;
+	}
+
+	return 1;
+}
+
+
+/* commissioning di tutti i nodi: ritorna i nodi configurati */
+static uint8_t TestCommission(void)
+{
+	uint32_t uid[CAN_LSS_SUB_NUM], base;
+	uint8_t data[8], n = 0, i, sel;
+
+	memset(data, 0, sizeof(data));
+	data[0] = CAN_LSS_CS_SWITCH_GLOBAL;
+	data[1] = 1;
+	TestSend(CAN_LSS_ID, data, 8);
+	TestWait(CAN_LSS_RSP_ID, NULL);
+
+	while (n <= test_node_num && TestScan(uid)) {
+		/* un solo nodo selezionato, quello con l'UID trovato */
+		sel = 0;
+		for (i=0; i!=test_node_num; i++) {
+			if (test_node_tab[i].dev.lss_selected) {
+				sel++;
+				HOST_CHECK(memcmp(test_node_tab[i].dev.uid, uid, sizeof(uid)) == 0);
+			}
+		}
+		HOST_CHECK(sel == 1);
+
+		base = TEST_BASE + n*TEST_BASE_STEP;
+		TestCfg(MSG_OPC_STAGE | MSG_OPC_CANID_REC, base, 8);
+		TestWait(CONF_CANID, NULL); /* nessuna risposta: solo attesa */
+		TestCfg(MSG_OPC_STAGE | MSG_OPC_CANID_SEND, TEST_BASE_SEND + n*TEST_BASE_STEP, 8);
+		TestWait(CONF_CANID, NULL);
+		TestCfg(MSG_OPC_STAGE_COMMIT, HW_CHECK_3, 4);
+		HOST_CHECK(TestWait(CONF_CANID, data) == 1);
+		HOST_CHECK(data[0] == (MSG_OPC_STAGE_COMMIT & 0xFF) && data[2] == 0);
+		n++;
+	}
+
+	memset(data, 0, sizeof(data));
+	data[0] = CAN_LSS_CS_SWITCH_GLOBAL;
+	TestSend(CAN_LSS_ID, data, 8);
+	TestWait(CAN_LSS_RSP_ID, NULL);
+
+	return n;
+}
+
+
+static void TestRun(uint8_t num)
+{
+	uint64_t t0;
+	uint32_t base[TEST_NODE_MAX];
+	uint16_t h, l;
+	uint8_t n, i, j;
+
+	TestNodeInit(num);
+	test_req = test_timeout = 0;
+	t0 = test_us;
+	n = TestCommission();
+	printf("%3u nodi  %8.1f ms  (%6.1f ms/nodo)  richieste %5u  senza risposta %5u\n", num,
+			(test_us - t0)/1000.0, (test_us - t0)/1000.0/num, test_req, test_timeout);
+
+	HOST_CHECK(n == num);
+	for (i=0; i!=num; i++) {
+		TestNodeLoad(i);
+		HostRun(&test_node_tab[i].machine, 100000); /* salvataggi e reinizializzazione */
+		base[i] = can_dev.base;
+		HOST_CHECK(can_dev.base >= TEST_BASE && can_dev.base < TEST_BASE + num*TEST_BASE_STEP);
+		HOST_CHECK(can_dev.base_send - TEST_BASE_SEND == can_dev.base - TEST_BASE);
+		HOST_CHECK(can_dev.lss_active == 0 && can_dev.lss_selected == 0);
+		HOST_CHECK(HostEeGet(FLASH_ADDR_CANID_H, &h) == 0 && HostEeGet(FLASH_ADDR_CANID_L, &l) == 0);
+		HOST_CHECK(((uint32_t)h << 16 | l) == can_dev.base);
+		TestNodeSave(i);
+		for (j=0; j!=i; j++)
+			HOST_CHECK(base[j] != base[i]);
+	}
+}
+
+
+/* sessione aperta e master scomparso senza SWITCH_GLOBAL 0: la sessione resta attiva finche' arrivano
+   frame LSS o di configurazione, poi CAN_LSS_TO la chiude e i nodi accettano di nuovo la configurazione */
+static void TestLssTimeout(void)
+{
+	uint8_t data[8] = {0}, i;
+
+	TestNodeInit(2);
+	data[0] = CAN_LSS_CS_SWITCH_GLOBAL;
+	data[1] = 1;
+	TestSend(CAN_LSS_ID, data, 8);
+	TestIdle(10000);
+
+	/* configurazione ignorata dai nodi non selezionati, ma tiene viva la sessione */
+	for (i=0; i!=4; i++) {
+		TestCfg(MSG_OPC_STAGE | MSG_OPC_CANID_REC, TEST_BASE, 8);
+		TestIdle((CAN_LSS_TO - 500)*1000ULL);
+	}
+	for (i=0; i!=test_node_num; i++) {
+		HOST_CHECK(test_node_tab[i].dev.lss_active == 1);
+		HOST_CHECK(test_node_tab[i].dev.stage_mask == 0);
+	}
+
+	TestIdle((500 + 10)*1000ULL);
+	for (i=0; i!=test_node_num; i++)
+		HOST_CHECK(test_node_tab[i].dev.lss_active == 0 && test_node_tab[i].dev.lss_selected == 0);
+	TestCfg(MSG_OPC_STAGE | MSG_OPC_CANID_REC, TEST_BASE, 8);
+	TestIdle(10000);
+	for (i=0; i!=test_node_num; i++)
+		HOST_CHECK(test_node_tab[i].dev.stage_mask == CAN_STAGE_BASE);
+}
+
+
+int main(void)
+{
+	static const uint8_t num[] = {1, 2, 4, 8, 16, 32};
+	uint8_t i;
+
+	for (i=0; i!=sizeof(num); i++)
+		TestRun(num[i]);
+	TestLssTimeout();
+
+	return HostEnd();
+}
@@ -0,0 +1,173 @@
+/* ISR di ricezione: lettura della mailbox direttamente nello slot della coda (CanRxFifo) rispetto
+   alla lettura su stack e copia nella coda; messaggi scartati non pubblicati, coda piena con FIFO hw svuotata */
+#include "host.h"
+#include "canmsg.c"
+
+#define TEST_BASE                     0x100
+#define TEST_BASE_SEND                0x300
+#define TEST_LOOPS                    2000000
+#define TEST_RUNS                     11
+
+static volatile uint32_t test_sink;
+
+
+/* riferimento: ISR con lettura su stack e copia nello slot, come prima della lettura diretta */
+static void TestRxFifoCopy(CAN_HandleTypeDef *hcan, uint32_t fifo)
+{
+	CAN_RxHeaderTypeDef header;
+	uint8_t data[8];
+	can_rx_queue *q;
+	msg_can_rx *msg;
+	uint8_t msg_id;
+
+	if (HAL_CAN_GetRxMessage(hcan, fifo, &header, data) == HAL_OK) {
+		msg_id = CanRxMsgId(&header, fifo);
+		if (msg_id != MSG_NONE) {
+			q = &can_dev.rx_queue[fifo];
+			msg = CanRxQueueReserve(q);
+			if (msg != NULL) {
+				memcpy(&msg->header, &header, sizeof(CAN_RxHeaderTypeDef));
+				memcpy(msg->data, data, sizeof(msg->data));
+				msg->msg_id = msg_id;
+				msg->ts = CanTimestamp();
+				CanRxQueueCommit(q);
+				can_dev.rx++;
+			}
+			else {
+				q->drop++;
+			}
+		}
+
+		can_dev.error_glb = 0;
+		can_dev.tot_rx++;
+	}
+}
+
+
+/* messaggio nella FIFO0 hw senza interrupt: CNG_VELOC, primo indice della FIFO0 dopo la configurazione */
+static void TestFifoLoad(const host_frame *fr, uint8_t fmi)
+{
+	host.fifo[0][0] = *fr;
+	host.fifo_fmi[0][0] = fmi;
+	host.fifo_num[0] = 1;
+}
+
+
+/* 0: lettura diretta, 1: copia, 2: solo lettura dall'HAL simulato */
+static uint64_t TestBench(int mode, const host_frame *fr, uint8_t fmi)
+{
+	CAN_RxHeaderTypeDef header;
+	uint8_t data[8];
+	can_rx_queue *q = &can_dev.rx_queue[CAN_RX_FIFO0];
+	uint64_t t;
+	uint32_t n;
+
+	t = HostNs();
+	for (n=0; n!=TEST_LOOPS; n++) {
+		TestFifoLoad(fr, fmi);
+		if (mode == 0)
+			HAL_CAN_RxFifo0MsgPendingCallback(&hcan);
+		else if (mode == 1)
+			TestRxFifoCopy(&hcan, CAN_RX_FIFO0);
+		else {
+			HAL_CAN_GetRxMessage(&hcan, CAN_RX_FIFO0, &header, data);
+			test_sink += data[0];
+		}
+		if (CanRxQueueHead(q) != NULL) {
+			test_sink += q->msg[q->out & q->mask].data[1];
+			CanRxQueuePop(q);
+		}
+	}
+
+	return HostNs() - t;
+}
+
+
+static uint8_t TestFmi(uint8_t msg_id)
+{
+	uint8_t i;
+
+	for (i=0; i!=CAN_FLT_IDX_NUM; i++) {
+		if (can_dev.flt_msg[CAN_RX_FIFO0][i] == msg_id)
+			return i;
+	}
+	return 0xFF;
+}
+
+
+int main(void)
+{
+	machine_status machine;
+	can_rx_queue *q0;
+	host_frame fr = {0};
+	msg_can_rx *msg;
+	uint64_t ns[3], t;
+	uint16_t in;
+	uint8_t fmi, i, mode, data[8] = {0};
+
+	HostInit();
+	HostEeNode(CAN_SPEED_250K, TEST_BASE, TEST_BASE_SEND);
+	HostBoot(&machine);
+	HostRun(&machine, 20000);
+	q0 = &can_dev.rx_queue[CAN_RX_FIFO0];
+
+	/* costo per messaggio dell'ISR con il percorso normale (filtri hw, indice del filtro) */
+	fr.id = can_dev.rx_id[MSG_CNG_VELOC];
+	fr.dlc = 2;
+	fr.data[0] = CAN_SPEED_250K;
+	fr.data[1] = 0x5A;
+	fmi = TestFmi(MSG_CNG_VELOC);
+	HOST_CHECK(fmi != 0xFF);
+	for (mode=0; mode!=3; mode++)
+		ns[mode] = UINT64_MAX;
+	for (i=0; i!=TEST_RUNS; i++) {
+		for (mode=0; mode!=3; mode++) {
+			t = TestBench(mode, &fr, fmi);
+			if (t < ns[mode])
+				ns[mode] = t;
+		}
+	}
+	HOST_CHECK(CanRxQueueLevel(q0) == 0 && host.fifo_num[0] == 0);
+	printf("ISR per messaggio (HAL simulato %.2f ns escluso): lettura diretta %.2f ns, copia %.2f ns (%+.1f%%)\n",
+			(double)ns[2]/TEST_LOOPS, ((double)ns[0] - ns[2])/TEST_LOOPS, ((double)ns[1] - ns[2])/TEST_LOOPS,
+			100.0*((double)ns[0] - ns[1])/((double)ns[1] - ns[2]));
+	printf("stack dell'ISR: lettura diretta nessun buffer, copia %u byte (header + dati)\n",
+			(unsigned)(sizeof(CAN_RxHeaderTypeDef) + 8));
+
+	/* contenuto dello slot pubblicato uguale al messaggio letto */
+	memset(data, 0, sizeof(data));
+	data[0] = CAN_SPEED_250K;
+	data[1] = 0xA5;
+	in = q0->in;
+	HOST_CHECK(HostRx(can_dev.rx_id[MSG_CNG_VELOC], 0, 2, data) == CAN_RX_FIFO0);
+	HOST_CHECK(q0->in == in + 1);
+	msg = CanRxQueueHead(q0);
+	HOST_CHECK(msg != NULL && msg->msg_id == MSG_CNG_VELOC && msg->header.ExtId == can_dev.rx_id[MSG_CNG_VELOC]);
+	HOST_CHECK(msg != NULL && msg->header.DLC == 2 && msg->data[1] == 0xA5);
+	HostRun(&machine, 20000);
+	HOST_CHECK(CanRxQueueLevel(q0) == 0);
+
+	/* messaggio non per il nodo (indice del filtro senza messaggio): letto nello slot ma non pubblicato */
+	fr.data[1] = 0x11;
+	TestFifoLoad(&fr, CAN_FLT_IDX_NUM);
+	in = q0->in;
+	HAL_CAN_RxFifo0MsgPendingCallback(&hcan);
+	HOST_CHECK(q0->in == in && host.fifo_num[0] == 0);
+	HOST_CHECK(CanRxQueueHead(q0) == NULL);
+
+	/* coda piena: FIFO hw comunque svuotata, messaggio perso contato, slot in coda intatti */
+	for (i=0; i!=CAN_RX_QUEUE; i++) {
+		data[1] = i;
+		HOST_CHECK(HostRx(can_dev.rx_id[MSG_CNG_VELOC], 0, 2, data) == CAN_RX_FIFO0);
+	}
+	HOST_CHECK(CanRxQueueLevel(q0) == CAN_RX_QUEUE && q0->drop == 0);
+	data[1] = 0xEE;
+	HOST_CHECK(HostRx(can_dev.rx_id[MSG_CNG_VELOC], 0, 2, data) == CAN_RX_FIFO0);
+	HOST_CHECK(q0->drop == 1 && host.fifo_num[0] == 0 && host.rx_ovr == 0);
+	for (i=0; i!=CAN_RX_QUEUE; i++)
+		HOST_CHECK(q0->msg[(q0->out + i) & q0->mask].data[1] == i);
+	HostRun(&machine, 20000);
+	HOST_CHECK(CanRxQueueLevel(q0) == 0);
+
+	return HostEnd();
+}
@@ -0,0 +1,115 @@
+/* code rx a bus saturo ad 1 Mbit/s: messaggi persi (coda sw e FIFO hw) e occupazione massima
+   delle code con il ciclo macchina normale, con passi da 10ms lenti e con un trasferimento di pagina e2prom */
+#include "host.h"
+#include "canmsg.c"
+
+#define TEST_BITRATE                  CAN_BITRATE_1M
+#define TEST_BASE                     0x100
+#define TEST_BASE_SEND                0x300
+#define TEST_FRAMES                   20000  /* circa 1.7s di bus saturo */
+
+typedef struct {
+	const char *name;
+	uint32_t slow_us;           /* durata del passo da 10ms */
+	uint8_t hp;                 /* anche comandi alle uscite (FIFO1) */
+	uint8_t page;               /* trasferimento di pagina e2prom durante la raffica */
+	int8_t drop;                /* messaggi persi attesi: 0 nessuno, 1 almeno uno */
+} test_case;
+
+/* durata di un CNG_VELOC ad 1 Mbit/s: 83us; coda FIFO0 + FIFO hw = 35 messaggi, circa 2.9ms di bus */
+static const test_case test_tab[] = {
+	{"ciclo normale",              HOST_SLOW_US, 1, 0, 0},
+	{"passo lento 1ms",            1000,         0, 0, 0},
+	{"passo lento 2ms",            2000,         0, 0, 0},
+	{"passo lento 5ms",            5000,         0, 0, 1},
+	{"passo lento 10ms",           10000,        0, 0, 1},
+	{"trasferimento pagina e2prom", HOST_SLOW_US, 1, 1, 1},
+};
+
+
+static void TestStorm(machine_status *machine, const test_case *tc)
+{
+	uint8_t data[8];
+	uint32_t i;
+
+	for (i=0; i!=TEST_FRAMES; i++) {
+		memset(data, 0, sizeof(data));
+		if (tc->page && i == TEST_FRAMES/2) {
+			/* la prossima scrittura riempie la pagina attiva */
+			host.ee_slot = HOST_EE_SLOTS - 1;
+			CanEeWrite(FLASH_ADDR_SPEED_ID, CAN_SPEED_1M);
+		}
+		if (tc->hp && i % 4 == 0) {
+			data[0] = (i/4) & 1; /* enable_power */
+			HostBusPut(can_dev.rx_id[MSG_OUT_ENABLE], 0, 4, data, host.us);
+		}
+		else if (tc->hp && i % 4 == 3) {
+			HostBusPut(0x1FFF0000 + i, 0, 8, data, host.us); /* altro nodo: scartato dai filtri hw */
+		}
+		else {
+			data[0] = CAN_SPEED_1M; /* stessa velocita': nessun cambio, nessuna risposta */
+			HostBusPut(can_dev.rx_id[MSG_CNG_VELOC], 0, 2, data, host.us);
+		}
+		if (HostBusPending() > HOST_EXT_QUEUE/2)
+			HostRun(machine, HostBusPending()*HostFrameUs(0, 2)/2);
+	}
+	while (HostBusPending() != 0)
+		HostRun(machine, 1000);
+	HostRun(machine, 20000);
+}
+
+
+static void TestCase(const test_case *tc)
+{
+	machine_status machine;
+	can_rx_queue *q0, *q1;
+	uint32_t drop;
+	uint64_t t0;
+
+	memset(&can_dev, 0, sizeof(can_dev));
+	HostInit();
+	host_bus_bitrate = TEST_BITRATE;
+	host_slow_us = tc->slow_us;
+	HostEeNode(CAN_SPEED_1M, TEST_BASE, TEST_BASE_SEND);
+	HostBoot(&machine);
+
+	t0 = host.us;
+	TestStorm(&machine, tc);
+
+	q0 = &can_dev.rx_queue[CAN_RX_FIFO0];
+	q1 = &can_dev.rx_queue[CAN_RX_FIFO1];
+	drop = q0->drop + q1->drop;
+	printf("%-28s %6u %6u %6u %6u %6u %6u/%-3u %3u/%-2u %7u %8.1f\n", tc->name, host.rx, host.rx_flt,
+			can_dev.rx, drop, host.rx_ovr, q0->max, CAN_RX_QUEUE, q1->max, CAN_RX_HP_QUEUE,
+			CanCyclesToUs(can_dev.lat_queue.max), host.rx*1e6/(host.us - t0)/1000);
+
+	/* ogni messaggio accettato dai filtri e' in coda, perso per coda piena o perso nella FIFO hw */
+	HOST_CHECK(host.rx == TEST_FRAMES);
+	HOST_CHECK(host.rx_flt == can_dev.rx + drop + host.rx_ovr);
+	HOST_CHECK(can_dev.tot_rx == can_dev.rx + drop);
+	HOST_CHECK(can_dev.lat_queue.num == can_dev.rx);
+	HOST_CHECK(CanRxQueueLevel(q0) == 0 && CanRxQueueLevel(q1) == 0);
+	HOST_CHECK(q0->max <= CAN_RX_QUEUE && q1->max <= CAN_RX_HP_QUEUE);
+	if (tc->drop == 0)
+		HOST_CHECK(drop + host.rx_ovr == 0);
+	else
+		HOST_CHECK(drop + host.rx_ovr != 0);
+	/* la FIFO hw trabocca solo con la CPU ferma (scrittura in flash) */
+	if (tc->page)
+		HOST_CHECK(host.rx_ovr != 0 && host.ee_transfer == 1);
+	else
+		HOST_CHECK(host.rx_ovr == 0);
+}
+
+
+int main(void)
+{
+	uint8_t i;
+
+	printf("%-28s %6s %6s %6s %6s %6s %10s %6s %7s %8s\n", "caso", "bus", "filtri", "coda",
+			"persi", "ovr", "FIFO0 max", "FIFO1", "lat max", "frame/ms");
+	for (i=0; i!=sizeof(test_tab)/sizeof(test_tab[0]); i++)
+		TestCase(&test_tab[i]);
+
+	return HostEnd();
+}